@@ -16,19 +16,37 @@
  *  standalone and interesting MUD-like game.
  *
  * COMPILE:
- *     gcc mud_game.c -o mud_game
+ *     gcc -pthread mud_game.c -o mud_game
  *
  * RUN:
- *     ./mud_game
+ *     ./mud_game                  (single player on the console)
+ *     ./mud_game --listen 4000    (multi-session TCP server)
+ *     ./mud_game --world w.img    (play a compiled world image)
+ *
+ * WORLDS:
+ *     ./mud_game --compile-world world.txt world.img
+ *     ./mud_game --gen-world 1000000 big.txt
  *
  * FEATURES:
- *   - Text-based exploration of multiple rooms
- *   - Custom commands (e.g., go, look, take, drop, inventory, attack, stats, etc.)
- *   - Simple combat system (enemy spawns, level-ups, HP, MP, gold)
+ *   - Text-based exploration of multiple rooms, with shortest-route travel
+ *     to any room by name
+ *   - Custom commands (e.g., go, look, take, drop, inventory, attack, say, etc.)
+ *   - Simple combat system (enemy spawns, level-ups, HP, MP, gold), with a
+ *     multi-threaded Monte Carlo simulator for balancing it (--simulate)
+ *   - World clock: timed monster respawns and HP/MP regeneration, and
+ *     monsters that attack, pursue and flee on their own
  *   - Basic item usage (potions that restore HP/MP)
- *   - Saving/loading the game to a file
+ *   - Saving/loading the game to a file, with checkpoints written in the
+ *     background from a copy-on-write snapshot, and characters kept apart
+ *     in a hashed player store that scales to millions of them
  *   - Room-based descriptions with items to pick up
+ *   - Data-driven worlds compiled to a memory-mapped binary image, with
+ *     rooms paged out to a spill file under a memory budget (--room-memory)
  *   - Simple prompt/command loop
+ *   - Event-driven (epoll) multi-session TCP server mode, with world
+ *     regions run in parallel on a work-stealing thread pool, and players
+ *     seeing what others do in the same and neighbouring rooms
+ *   - Chat: say, shout and channels, each line shared by its recipients
  *
  * NOTE:
  *   This is a single-file demonstration MUD-like game in plain C, 
@@ -42,15 +60,148 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* MAX LIMITS AND CONSTANTS */
 #define MAX_NAME_LEN       50
-#define MAX_INVENTORY_SIZE 20
+#ifndef MAX_INVENTORY_SIZE
+#define MAX_INVENTORY_SIZE 20       /* a bag or a room floor; -D to change */
+#endif
+#define LEGACY_INVENTORY_SIZE 20    /* fixed by the v0 save layout */
+#define MAX_ITEM_PROTOS    65536    /* distinct items; ItemId is 16 bits */
+
+/* Inventory name index: a power of two at least 1.5x the capacity, so
+ * probe runs stay short when a container is full */
+#if MAX_INVENTORY_SIZE < LEGACY_INVENTORY_SIZE
+#error "MAX_INVENTORY_SIZE must hold a v0 save's inventory"
+#elif MAX_INVENTORY_SIZE <= 21
+#define ITEM_INDEX_SLOTS   32
+#elif MAX_INVENTORY_SIZE <= 42
+#define ITEM_INDEX_SLOTS   64
+#elif MAX_INVENTORY_SIZE <= 85
+#define ITEM_INDEX_SLOTS   128
+#elif MAX_INVENTORY_SIZE <= 170
+#define ITEM_INDEX_SLOTS   256
+#elif MAX_INVENTORY_SIZE <= 341
+#define ITEM_INDEX_SLOTS   512
+#elif MAX_INVENTORY_SIZE <= 682
+#define ITEM_INDEX_SLOTS   1024
+#elif MAX_INVENTORY_SIZE <= 1365
+#define ITEM_INDEX_SLOTS   2048
+#elif MAX_INVENTORY_SIZE <= 2730
+#define ITEM_INDEX_SLOTS   4096
+#else
+#error "MAX_INVENTORY_SIZE is limited to 2730"
+#endif
 #define MAX_ITEMS          100
-#define MAX_ROOMS          20
 #define MAX_CMD_LEN        100
 #define MAX_INPUT_LEN      256
-#define SAVE_FILE_NAME     "mud_savefile.dat"
+#define MAX_PROMPT_LEN     (MAX_NAME_LEN + 96)
+#define SAVE_FILE_NAME     "mud_savefile.dat"     /* checkpoint */
+#define JOURNAL_FILE_NAME  "mud_journal.dat"      /* mutations since it */
+#define JOURNAL_NEXT_NAME  "mud_journal.dat.next" /* mutations since a checkpoint in progress */
+#define PLAYER_STORE_NAME  "mud_players.dat"      /* characters, by name */
+#define MAX_EPOLL_EVENTS   256
+#define MAX_CMD_TRIE_NODES 256
+#define MAX_TOKENS         8
+#define ROOM_CHUNK_SHIFT   10       /* rooms are allocated 1024 at a time */
+#define ROOM_CHUNK_SIZE    (1 << ROOM_CHUNK_SHIFT)
+#define ROOM_LOADED        0x01     /* g_roomFlags: materialized */
+#define ROOM_DIRTY         0x02     /* g_roomFlags: changed since last spilled */
+#define ROOM_RESPAWN       0x04     /* g_roomFlags: respawn timer pending */
+#define ROOM_VIEW          0x08     /* g_roomFlags: Room.view is up to date */
+#define ROOM_REFERENCED    0x10     /* g_roomFlags: used since the clock hand passed */
+#define ROOM_RESIDENT_BYTES 512     /* a materialized room, its view and monsters */
+#define ROOM_SPILL_ALIGN   64       /* spill records are rewritten in place if they fit */
+#define ROOM_SPILL_TEMPLATE "mud_rooms.XXXXXX"    /* evicted rooms, unlinked at once */
+#define REGION_SHIFT       12       /* 4096 rooms per region; >= ROOM_CHUNK_SHIFT */
+#define MAX_WORKERS        256
+#define REGION_BATCH       64       /* mailbox entries per turn on a worker */
+#define PLAYER_CHUNK_SHIFT 10       /* player table storage, 1024 at a time */
+#define MAX_PLAYER_CHUNKS  4096
+#define SESSION_INPUT_LIMIT (64 * 1024) /* queued input before reads pause */
+#define LINE_TOO_LONG      '\x01'   /* queued in place of an over-long line */
+#define OUT_CHUNK_SIZE     4096     /* session output is queued in chunks */
+#define OUT_IOV_MAX        64       /* chunks per writev */
+#define OUTPUT_HIGH_WATER  (64 * 1024) /* unsent output before input pauses */
+#define WORLD_MAGIC        "MUDWRLD"
+#define WORLD_VERSION      2        /* 2 = exit graph in its own table */
+#define WORLD_BYTE_ORDER   0x01020304u
+#define JOURNAL_MAGIC      "MUDJRNL"
+#define JOURNAL_VERSION    4        /* 1 = removing an item shifted the rest,
+                                       2 = no run seed records,
+                                       3 = one monster per room,
+                                           one-byte record lengths */
+#define SAVE_MAGIC         "MUDSAVE"
+#define SAVE_VERSION       3        /* 0 = raw structs, 1 = raw checkpoint,
+                                       2 = characters in the checkpoint */
+#define LEGACY_CKPT_MAGIC  "MUDCKPT"
+#define PLAYER_STORE_MAGIC "MUDPLYR"
+#define PLAYER_STORE_VERSION 1
+#define PLAYER_STORE_HEADER 4096    /* header page; the slot table follows */
+#define PLAYER_STORE_MIN_SLOTS 1024
+#define PLAYER_STORE_SLACK (1024 * 1024) /* old record versions before a rewrite */
+#define JOURNAL_COMMIT_MS    20                 /* group commit window */
+#define JOURNAL_COMMIT_BYTES (64 * 1024)
+#define JOURNAL_COMPACT_BYTES (8 * 1024 * 1024) /* checkpoint past this */
+#define SNAPSHOT_POLL_MS     100                /* check on a background checkpoint */
+#define SNAPSHOT_NICE        10                 /* its writer yields to the game */
+#define PLAYER_STAT_COUNT  10
+#define TICK_MS            100      /* world clock resolution */
+#define WHEEL_BITS         6
+#define WHEEL_SLOTS        (1 << WHEEL_BITS)
+#define WHEEL_LEVELS       4        /* covers 2^24 ticks, about 19 days */
+#define MONSTER_MAX_LEVEL  3        /* monsters spawn at level 1-3 */
+#define MAX_ROOM_MONSTERS  8        /* living or dead, per room */
+#define MONSTER_SLAB_SIZE  256      /* region monster pools grow a slab at a time */
+#define MONSTER_POOL_SLABS 64       /* up to 16384 monsters per region */
+#define ROLL_BLOCK         256      /* damage rolls drawn per pass */
+#define ROUTE_LANDMARKS    8        /* hub rooms guiding route searches */
+#define ROUTE_CACHE_SLOTS  4096     /* found routes kept, power of two */
+#define TRAVEL_LEGS_SHOWN  8        /* travel describes this many legs of a route */
+#define LOOK_PLAYERS_SHOWN 10       /* look names this many other players */
+#define MAX_EVENT_LEN      (MAX_INPUT_LEN + 128) /* one line told to other players */
+#define MAX_CHANNEL_LEN    16       /* chat channel names, with the terminator */
+#define SIM_LANES          1024     /* careers a simulator thread plays at once */
+#define SIM_MAX_LEVEL      50       /* simulator table rows; higher levels share the last */
+#define SIM_MAX_ROUNDS     100      /* longer fights share the last histogram bucket */
+#define RESPAWN_MIN_TICKS  300      /* a killed monster returns in 30-90 s */
+#define RESPAWN_MAX_TICKS  900
+#define REGEN_TICKS        50       /* players regenerate every 5 s */
+#define MONSTER_AGGRO_TICKS 10      /* hostile monsters strike 1 s after you arrive */
+#define MONSTER_AI_TICKS   20       /* and then every 2 s */
+#define MONSTER_FLEE_HP    25       /* percent of max HP below which they run */
+#define LISTEN_BACKLOG     4096
+#define HIST_SUB_BITS      4        /* latency histograms: 16 buckets per power of two */
+#define HIST_BUCKETS       (64 << HIST_SUB_BITS)
+#define LOAD_DEFAULT_MIX   "move=40,look=30,item=20,combat=10"
+#define CHAT_BENCH_ROUNDS  20       /* lines per --bench-chat pass */
+#define METRICS_FILE_NAME  "mud_metrics.txt"      /* server snapshot */
+#define METRICS_DUMP_MS    10000
 
 /* Forward declarations for structures */
 typedef struct Item      Item;
@@ -58,6 +209,7 @@ typedef struct Inventory Inventory;
 typedef struct Room      Room;
 typedef struct Player    Player;
 typedef struct Monster   Monster;
+typedef struct Session   Session;
 
 /* ITEM TYPES */
 typedef enum {
@@ -84,44 +236,70 @@ typedef enum {
     MONSTER_DEAD
 } MonsterState;
 
-/* Item Structure */
+/* Item Structure: an immutable prototype in the item registry. Rooms and
+ * inventories hold ItemId handles, never copies. */
 struct Item {
-    char     name[MAX_NAME_LEN];
+    const char *name;       /* interned; lives as long as the registry */
     ItemType type;
     int      power;         /* e.g., for potions = HP/MP restore, for weapons = attack power */
     int      value;         /* gold value, or other usage */
+    uint32_t nameHash;      /* itemNameHash(name), for container indexes */
 };
 
-/* Inventory Structure */
+typedef uint16_t ItemId;    /* index into the item registry */
+
+/* Entry of an Inventory's name index: position + 1, 0 = empty */
+#if MAX_INVENTORY_SIZE < 255
+typedef uint8_t  InventorySlot;
+#else
+typedef uint16_t InventorySlot;
+#endif
+
+/* Inventory Structure: a player's bag, or the items on a room's floor.
+ * Unordered; `index` finds an item by name without scanning. */
 struct Inventory {
-    Item  items[MAX_INVENTORY_SIZE];
-    int   count;
+    ItemId  items[MAX_INVENTORY_SIZE];
+    int     count;
+    InventorySlot index[ITEM_INDEX_SLOTS];    /* by nameHash */
 };
 
-/* Monster Structure */
+/* Monster Structure. Monsters in the world live in their region's pool
+ * (see monster pools) and are linked into their room's list. */
 struct Monster {
-    char         name[MAX_NAME_LEN];
+    const char  *name;      /* static or interned, never freed */
     int          level;
     int          hp;
     int          maxHp;
     int          attackPower;
     MonsterState state;
+
+    int32_t      room;      /* -1 while the pool slot is free */
+    uint16_t     self;      /* pool slot + 1 */
+    uint16_t     next;      /* next in the room's list or the free list, 0 = end */
+    uint16_t     gen;       /* bumped each time the slot is freed */
 };
 
-/* Room Structure */
+/* Handle to a monster in the world: pool slot + 1 and generation. It stops
+ * resolving once the monster is removed, even if its slot is reused. */
+typedef uint32_t MonsterRef;
+
+/* Room Structure: the cold side of a room (text and floor items), made on
+ * first use and possibly evicted again (see ROOM PAGING). Exits, monsters
+ * and occupancy are kept in the world store's hot arrays, indexed by room
+ * number (see roomExit, firstMonster). */
 struct Room {
     int   id;
-    char  name[MAX_NAME_LEN];
-    char  description[256];
-    int   exits[DIR_COUNT]; /* indexes to other rooms, -1 if no exit */
+    const char *name;        /* point into the world image */
+    const char *description;
     
     /* Items on the ground in this room */
-    Item  itemsInRoom[MAX_INVENTORY_SIZE];
-    int   itemCount;
-    
-    /* Maybe a monster that spawns here */
-    Monster monster;
-    int     monsterPresent;
+    Inventory ground;
+
+    /* What `look` prints, rendered on demand and kept until roomChanged */
+    char     *view;
+    uint32_t  viewLen;
+    uint32_t  viewExits;     /* where its exit list starts */
+    uint32_t  poolNext;      /* next free slot + 1 while the slot is unused */
 };
 
 /* Player Structure */
@@ -140,59 +318,725 @@ struct Player {
     Inventory inventory;
 };
 
+/* COMMAND FLAGS (see CommandDef) */
+typedef enum {
+    CMD_EXACT_ONLY = 1,    /* never matched by an abbreviation */
+    CMD_KEEP_CASE  = 2     /* gets its argument as typed, not folded */
+} CommandFlag;
+
+/* SESSION STATES */
+typedef enum {
+    SESSION_NAME,       /* waiting for the character name */
+    SESSION_PLAYING,
+    SESSION_CLOSING     /* flush pending output, then disconnect */
+} SessionState;
+
+/* Growable byte buffer */
+typedef struct {
+    unsigned char *data;
+    size_t         len;
+    size_t         cap;
+} ByteBuf;
+
+/* Random number generator state (xoshiro256**). Every session and every
+ * region has its own, seeded from the world seed, so nothing random is
+ * shared between threads and a run can be repeated with --seed. */
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+/* Latency histogram with log-linear buckets (at most 1/16 relative error
+ * at any magnitude), in nanoseconds */
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} LatencyHist;
+
+/* How a session finishes a move into another region's room */
+typedef enum {
+    ARRIVE_NONE,
+    ARRIVE_QUIET,       /* login, load */
+    ARRIVE_LOOK         /* walked in: show the room */
+} ArriveMode;
+
+/* Text sent unchanged to many sessions (room events, chat): formatted
+ * once, then referenced from every recipient's output until it is sent */
+typedef struct {
+    uint32_t refs;         /* atomic */
+    uint32_t len;
+    char     data[];
+} SharedText;
+
+/* One chunk of queued session output, OUT_CHUNK_SIZE bytes in all. A
+ * chunk that refers to a shared text has no `data`, and nothing is
+ * appended to it. */
+typedef struct OutChunk {
+    struct OutChunk *next;
+    SharedText      *shared;
+    uint32_t         len;
+    char             data[];
+} OutChunk;
+#define OUT_CHUNK_DATA (OUT_CHUNK_SIZE - offsetof(OutChunk, data))
+
+/* Output chunks waiting to be sent, oldest first */
+typedef struct {
+    OutChunk *head;
+    OutChunk *tail;
+    size_t    pos;                    /* bytes of head already sent */
+    size_t    len;                    /* bytes queued over all chunks */
+} OutQueue;
+
+/* Session Structure: one connected player (or the local console) */
+struct Session {
+    int          fd;                  /* socket, or -1 for the console */
+    SessionState state;
+    Player       player;
+    uint64_t     playerKey;           /* hash of player.name, journal id */
+    int32_t      journaledStats[PLAYER_STAT_COUNT];
+    int32_t      savedStats[PLAYER_STAT_COUNT]; /* as of the last save, for load */
+
+    /* Partial input line received so far */
+    char         inBuf[MAX_INPUT_LEN];
+    int          inLen;
+    int          inOverflow;          /* discarding an over-long line */
+
+    /* Output not yet written: a chunk list, sent with writev */
+    OutQueue     out;
+    OutChunk    *outSpare;            /* one sent chunk kept for reuse */
+    OutChunk    *outSpareRef;         /* and one shared text reference */
+    uint32_t     watchEvents;         /* events currently armed in epoll */
+    uint32_t     regenTimer;          /* while playing, 0 = none */
+    uint32_t     aiTimer;             /* while hostile monsters are here, 0 = none */
+    int          playerIndex;         /* in the player table, while playing */
+
+    /* Server scheduling. The reactor owns the socket side (inBuf, lines,
+     * the flags it sets); while `busy`, a worker owns everything else. */
+    ByteBuf      lines;               /* complete lines not yet handed over */
+    ByteBuf      work;                /* lines a worker is running */
+    size_t       workPos;
+    Session     *mailNext;            /* region mailbox or done list link */
+    int          homeRegion;          /* runs here until logged in */
+    Rng          rng;                 /* combat and loot rolls */
+    MonsterRef   target;              /* monster last attacked */
+    Session     *roomNext;            /* other players in the same room */
+    Session     *roomPrev;
+    Session     *regionNext;          /* and in the same region */
+    Session     *regionPrev;
+    uint64_t     channel;             /* chat channel key, 0 = none */
+    char         channelName[MAX_CHANNEL_LEN];
+
+    /* Text from the region's timers (monsters acting) and from other
+     * players, for whichever thread owns the output next; see sessionNotify */
+    pthread_mutex_t noticeLock;
+    OutQueue     notices;
+    OutChunk    *noticeSpare;         /* lent by the output, see sessionTakeNotices */
+    OutChunk    *noticeSpareRef;
+    char         noticePrompt[MAX_PROMPT_LEN]; /* as of the latest notice */
+    int          noticePromptLen;
+    uint8_t      noticeDied;          /* the notices end the character */
+    uint8_t      noticePosted;        /* on the main thread's notice list */
+    Session     *noticeNext;
+    uint8_t      busy;                /* handed to a worker */
+    uint8_t      inputClosed;         /* peer finished sending */
+    uint8_t      peerGone;            /* socket failed: drop output */
+    uint8_t      hangup;              /* log out after `work` */
+    uint8_t      loggedOut;
+    uint8_t      arriving;            /* ArriveMode, set while in transit */
+};
+
+/* TIMER KINDS: what a world clock timer does when it fires */
+typedef enum {
+    TIMER_RESPAWN,         /* target = room whose monster comes back */
+    TIMER_REGEN,           /* session regains HP/MP, then re-arms */
+    TIMER_MONSTER_AI       /* hostile monsters in the session's room act */
+} TimerKind;
+
+/* EVENT COUNTERS kept by the metrics (see METRICS) */
+typedef enum {
+    METRIC_SAVES,
+    METRIC_LOADS,
+    METRIC_JOURNAL_COMMITS,
+    METRIC_CHECKPOINTS,
+    METRIC_SPAWNS,
+    METRIC_KILLS,
+    METRIC_ITEM_MOVES,
+    METRIC_ROOMS_PAGED_IN,
+    METRIC_ROOMS_EVICTED,
+    METRIC_COUNT
+} MetricCounter;
+
+/* JOURNAL RECORD TYPES */
+typedef enum {
+    JR_ROOM_MONSTER = 1,   /* a room's one monster (journal v3 and older) */
+    JR_ITEM_MOVE,          /* item moved between a room and an inventory */
+    JR_ITEM_CONSUME,       /* item used up */
+    JR_PLAYER_NAME,        /* first record for a player key */
+    JR_PLAYER_STATS,       /* player stats changed */
+    JR_RUN_SEED,           /* a run started with this --seed */
+    JR_ROOM_MONSTERS       /* a room's monster list changed (spawn, hit, kill) */
+} JournalRecordType;
+
+/* Who holds an item in a journal record */
+typedef enum {
+    HOLDER_ROOM,           /* id = room index */
+    HOLDER_PLAYER          /* id = player key */
+} HolderKind;
+
+/* SAVE FILE RECORD KINDS (see PERSISTENCE for the layout) */
+typedef enum {
+    SREC_WORLD  = 1,
+    SREC_PLAYER = 2,
+    SREC_ROOM   = 3,
+    SREC_END    = 255
+} SaveRecordKind;
+
+/* Save file field ids, per record kind. Readers skip ids they do not know
+ * and default the ones that are missing, so fields can be added freely;
+ * an id is never reused for something else. */
+enum { WF_ROOM_COUNT = 1, WF_SEQ, WF_SEED };
+enum { PF_NAME = 1, PF_LEVEL, PF_EXP, PF_EXP_NEXT, PF_HP, PF_MAX_HP, PF_MP,
+       PF_MAX_MP, PF_ATTACK, PF_GOLD, PF_ROOM, PF_ITEM };  /* LEVEL..ROOM = stats */
+enum { IF_NAME = 1, IF_TYPE, IF_POWER, IF_VALUE };
+enum { RF_INDEX = 1, RF_ITEM, RF_MONSTER_COUNT, RF_MONSTER };  /* MONSTER repeats */
+enum { MF_NAME = 1, MF_LEVEL, MF_HP, MF_MAX_HP, MF_ATTACK, MF_STATE };
+enum { EF_CRC = 1 };
+
+/* Save format v1 header (raw-struct checkpoint); only read for upgrades */
+typedef struct {
+    char     magic[8];     /* LEGACY_CKPT_MAGIC */
+    uint32_t version;
+    uint32_t roomCount;    /* must match the world */
+    uint64_t seq;          /* journal generation that continues from here */
+    uint32_t playerCount;
+    uint32_t reserved;
+} LegacyCheckpointHeader;
+
+/* Item, monster and player layouts of the raw-struct saves (v0, v1),
+ * which stored everything by value. Only read for upgrades. */
+typedef struct {
+    char     name[MAX_NAME_LEN];
+    ItemType type;
+    int      power;
+    int      value;
+} LegacyItem;
+
+typedef struct {
+    char         name[MAX_NAME_LEN];
+    int          level;
+    int          hp;
+    int          maxHp;
+    int          attackPower;
+    MonsterState state;
+} LegacyMonster;
+
+typedef struct {
+    char       name[MAX_NAME_LEN];
+    int        stats[PLAYER_STAT_COUNT];   /* level .. currentRoom */
+    LegacyItem items[LEGACY_INVENTORY_SIZE];
+    int        itemCount;
+} LegacyPlayer;
+
+/* Room layout of the original raw-struct saves (save format v0), which
+ * were LegacyPlayer | int roomCount | LegacyRoom[roomCount]. */
+typedef struct {
+    int     id;
+    char    name[MAX_NAME_LEN];
+    char    description[256];
+    int     exits[DIR_COUNT];
+    LegacyItem itemsInRoom[LEGACY_INVENTORY_SIZE];
+    int     itemCount;
+    LegacyMonster monster;
+    int     monsterPresent;
+} LegacyRoom;
+
+/* The characters in play this run, keyed by name; the rest wait in the
+ * player store. Players are stored in chunks that never move, so a session
+ * can update its own character without holding the table lock. */
+typedef struct {
+    Player   *chunks[MAX_PLAYER_CHUNKS];  /* 1 << PLAYER_CHUNK_SHIFT each */
+    uint64_t *changed[MAX_PLAYER_CHUNKS]; /* journal seq + 1 of the last change, 0 = none */
+    uint64_t *keys;
+    unsigned char *online; /* a session is playing this character */
+    unsigned char *stored; /* read in from the player store */
+    int       count;
+    int       cap;
+    int32_t  *slots;       /* open addressing: index + 1, 0 = empty */
+    size_t    slotCount;
+} PlayerTable;
+
+/* View into a caller-owned buffer (not NUL-terminated) */
+typedef struct {
+    const char *ptr;
+    size_t      len;
+} StrView;
+
+/* A tokenized command line; all views point into the input buffer */
+typedef struct {
+    StrView verb;
+    StrView args;                /* everything after the verb, trimmed */
+    StrView tokens[MAX_TOKENS];  /* individual words of args */
+    int     tokenCount;          /* words in args (only MAX_TOKENS kept) */
+    const char *rawArgs;         /* args as typed, before case folding */
+} CommandLine;
+
+/* Command table entry: a verb, its aliases and the handler it runs */
+typedef struct {
+    const char *name;
+    const char *aliases[3];
+    void      (*run)(Session *s);                    /* handler without argument */
+    void      (*runArg)(Session *s, const char *arg);/* handler with argument */
+    const char *fixedArg;    /* if set, passed to runArg instead of the user's */
+    int         flags;       /* CommandFlag bits */
+} CommandDef;
+
+/* Command trie node over 'a'..'z'. Child links and results are indexes. */
+typedef struct {
+    int16_t child[26];
+    int16_t exact;           /* command whose name/alias ends here, or -1 */
+    int16_t unique;          /* only command reachable below, -1 none, -2 many */
+} CmdTrieNode;
+
+/* Timer Structure: one pending event on a timing wheel, linked into its
+ * bucket by pool index (0 = none) */
+typedef struct {
+    uint64_t  due;          /* tick it fires on */
+    uint32_t  next;
+    uint32_t  prev;
+    int32_t   bucket;       /* level * WHEEL_SLOTS + slot, -1 = free */
+    TimerKind kind;
+    int       target;       /* room index for room timers */
+    Session  *session;      /* owner of session timers */
+} Timer;
+
+/* Timing wheel: the pending timers of one region (see WORLD CLOCK) */
+typedef struct {
+    uint64_t tick;          /* last tick processed */
+    Timer   *pool;          /* pool[0] is never used */
+    uint32_t poolCap;
+    uint32_t freeList;      /* chained through next */
+    uint32_t pending;       /* also read by the reactor */
+    uint32_t buckets[WHEEL_LEVELS * WHEEL_SLOTS];
+} TimerWheel;
+
+/* Monster pool of one region: slabs of MONSTER_SLAB_SIZE monsters, added
+ * as the region's population first grows and then recycled through a free
+ * list, so spawning and removing monsters never allocates. */
+typedef struct {
+    Monster  *slabs[MONSTER_POOL_SLABS];
+    uint16_t  slabCount;
+    uint16_t  freeList;     /* slot + 1, chained through next */
+    uint32_t  live;
+} MonsterPool;
+
+/* Text for players in another region: the ones in a neighbouring room
+ * (see roomTellNearby), or everyone there on a chat channel (worldTell) */
+typedef struct RoomEvent {
+    struct RoomEvent *next;
+    int         room;       /* -1 = every player in the region */
+    uint64_t    channel;    /* with room -1: only this channel, 0 = all */
+    SharedText *text;       /* one reference held by the event */
+} RoomEvent;
+
+/* Region Structure: a block of 1 << REGION_SHIFT rooms that one worker at
+ * a time runs. Sessions with work for the region wait in its mailbox, and
+ * so do events from other regions for the players here. */
+typedef struct {
+    pthread_mutex_t lock;   /* guards the mailbox, scheduled and tickDue */
+    Session   *mailHead;
+    Session   *mailTail;
+    RoomEvent *eventHead;
+    RoomEvent *eventTail;
+    int        scheduled;   /* on a worker's deque or running */
+    int        tickDue;     /* the world clock moved on */
+    TimerWheel wheel;       /* respawns here, regeneration of players here */
+    Rng        rng;         /* monster spawns and respawn delays */
+    MonsterPool monsters;   /* of the rooms here */
+    Session   *players;     /* in the rooms here, see moveOccupant */
+    uint32_t   rooms;       /* materialized now; also read by the reactor */
+    uint32_t   clockHand;   /* next room the eviction scan looks at */
+} Region;
+
+/* World image layout. The image is little-endian, fixed-width and laid out
+ * so that it can be mapped and used in place:
+ *   WorldHeader | exits | WorldRoom[roomCount] | WorldItem[itemCount] | strings
+ * The exit graph (int32 room index or -1, DIR_COUNT per room) is kept apart
+ * from the rest of the room data so that graph searches only touch it.
+ * Strings are NUL-terminated and referenced by offset into the string table. */
+typedef struct {
+    char     magic[8];         /* WORLD_MAGIC */
+    uint32_t version;
+    uint32_t byteOrder;        /* WORLD_BYTE_ORDER as written by the compiler */
+    uint32_t roomCount;
+    uint32_t itemCount;        /* item placements */
+    uint64_t exitsOffset;
+    uint64_t roomsOffset;
+    uint64_t itemsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+} WorldHeader;
+
+typedef struct {
+    uint32_t nameOff;
+    uint32_t descOff;
+    uint32_t firstItem;        /* this room's placements in the item table */
+    uint32_t itemCount;
+} WorldRoom;
+
+typedef struct {
+    uint32_t nameOff;
+    uint32_t type;             /* ItemType */
+    int32_t  power;
+    int32_t  value;
+} WorldItem;
+
 /* GLOBAL VARIABLES */
-static Room    g_rooms[MAX_ROOMS];
 static int     g_roomCount = 0;
-static Player  g_player;
+static const WorldHeader *g_world = NULL;
+static const WorldRoom   *g_worldRooms = NULL;
+static const WorldItem   *g_worldItems = NULL;
+static const char        *g_worldStrings = NULL;
+
+/* World store, hot side: one entry per room in flat arrays, so sweeps over
+ * every room (ticks, respawns, searches) stay in cache. */
+static const int32_t *g_roomExits = NULL;     /* [room * DIR_COUNT + dir], in the image */
+static uint8_t  *g_roomFlags = NULL;          /* ROOM_LOADED | ROOM_DIRTY | ROOM_RESPAWN | ... */
+static uint32_t *g_roomSlot = NULL;           /* slot + 1 in the room store, 0 = not materialized */
+static uint64_t *g_roomSpill = NULL;          /* spill file offset << 16 | length, 0 = none */
+static uint16_t *g_roomMonsterHead = NULL;    /* slot + 1 in the region's pool */
+static uint16_t *g_roomOccupants = NULL;      /* players standing in the room */
+static Session **g_roomPlayers = NULL;        /* the first of them, see moveOccupant */
+static Region   *g_regions = NULL;            /* room >> REGION_SHIFT */
+static int       g_regionCount = 0;
+static uint64_t  g_seed = 0;                 /* --seed; every Rng derives from it */
+static uint32_t  g_roomBudget = 0;           /* --room-memory in rooms, 0 = no limit */
+static int       g_spillFd = -1;             /* evicted rooms, see ROOM PAGING */
+static int       g_spillAppendOnly = 0;      /* a snapshot is reading the spill file */
+static Session g_console = { .fd = -1, .state = SESSION_PLAYING,
+                             .noticeLock = PTHREAD_MUTEX_INITIALIZER };
+static int     g_epollFd = -1;
 
 /*****************************************************************************
  * FUNCTION PROTOTYPES
  *****************************************************************************/
 
 /* Game initialization */
-void initGame();
-void createRooms();
-void initPlayer(const char *playerName);
-void initMonsters(Room *room);
+int  initGame(const char *worldPath);
+void initPlayer(Player *p, const char *playerName);
+void initMonsters(int room);
+
+/* World images & rooms */
+int  compileWorld(const char *text, size_t len, unsigned char **imageOut, size_t *sizeOut);
+int  compileWorldFile(const char *textPath, const char *imagePath);
+int  generateWorldFile(int roomCount, const char *textPath);
+int  attachWorldImage(const void *image, size_t size);
+int  mapWorldFile(const char *path);
+Room *getRoom(int index);
+void bindRoom(Room *room, int index);
+Region *regionOf(int room);
+int  roomExit(int room, int dir);
+Monster *firstMonster(int room);
+Monster *nextMonster(const Monster *m);
+Monster *addRoomMonster(int room, const Monster *proto);
+void removeRoomMonster(Monster *m);
+int  moveRoomMonster(Monster *m, int to);
+void setRoomMonsters(int room, const Monster *list, int count);
+MonsterRef monsterRef(const Monster *m);
+Monster *monsterFromRef(int room, MonsterRef ref);
+void roomChanged(int room);
+void moveOccupant(Session *s, int from, int to);
+const char *internName(const char *name);
+int  internItem(const Item *proto, int copyName);
+const Item *itemProto(ItemId id);
+
+/* Room paging */
+void readSpillRecord(int index, ByteBuf *out);
+void unspillRoom(Room *room, int index);
+void prefetchNeighbours(int room);
+int  roomStoreOverBudget();
+void regionTrim(Region *r);
+void roomStoreTrim();
+
+/* Routes */
+void exitGraphChanged();
+int  findRoute(int from, int to, uint8_t **dirsOut);
+
+/* Persistence */
+int  journalRecover();
+void journalAppend(JournalRecordType type, const unsigned char *payload, size_t len);
+int  journalCommit();
+void journalCommitAndExit();
+void journalMaybeCommit();
+int  journalTimeoutMs();
+void journalSnapshotWait();
+void journalRoomMonsters(int room);
+void journalItemMove(HolderKind fromKind, uint64_t fromId, int index,
+                     HolderKind toKind, uint64_t toId);
+void journalItemConsume(HolderKind kind, uint64_t id, int index);
+void journalPlayer(Session *s);
+int  writeCheckpoint(uint64_t seq);
+int  loginPlayer(Session *s, const char *requested);
+void logoutPlayer(Session *s);
+
+/* Player store */
+int  playerStoreOpen(uint64_t seq);
+int  playerStoreLoad(uint64_t key);
+int  playerStoreCommit(uint64_t seq, uint64_t base);
+void playerStoreReload();
+
+/* World clock & timers */
+void initWorldClock();
+uint32_t timerSchedule(TimerKind kind, int target, Session *s, uint32_t delayTicks);
+void timerCancel(int room, uint32_t id);
+void worldClockAdvance();
+void worldClockPost();
+int  worldClockTimeoutMs();
+void scheduleRespawn(int room);
+
+/* Regions & worker threads */
+int  schedulerStart(int threads);
+void schedulerStop();
+void schedulerPause();
+void schedulerResume();
+void regionPost(Region *r, Session *s);
+void regionPostEvent(Region *r, RoomEvent *ev);
+Session *schedulerTakeDone();
+Session *schedulerTakeNotices();
+void sessionNotify(Session *s, const char *text, size_t len, int died);
+void sessionNotifyShared(Session *s, SharedText *text);
+int  sessionTakeNotices(Session *s, int withPrompt);
+void roomTell(int room, const Session *skip, const char *fmt, ...);
+void roomTellNearby(int room, const char *fmt, ...);
+void worldTell(const Session *skip, uint64_t channel, SharedText *text);
+int  onWorkerThread();
+int  ownsRoom(int room);
+void sessionLeaveRoom(Session *s);
+void sessionEnterRoom(Session *s);
+void sessionArrive(Session *s);
 
 /* Command handling */
+void initCommands();
+int  findCommand(const char *verb, size_t len);
 void gameLoop();
-void parseCommand(const char *input);
-void doLook();
-void doGo(const char *direction);
-void doTake(const char *itemName);
-void doDrop(const char *itemName);
-void doInventory();
-void doStats();
-void doAttack();
-void doUse(const char *itemName);
-void doHelp();
-void doSave();
-void doLoad();
+int  handleLine(Session *s, char *line, size_t len);
+void parseCommand(Session *s, char *input, size_t len);
+void dispatchCommand(Session *s, const CommandLine *cl);
+void doLook(Session *s);
+void doGo(Session *s, const char *direction);
+void moveTo(Session *s, int nextRoom);
+void doTravel(Session *s, const char *roomName);
+void doTake(Session *s, const char *itemName);
+void doDrop(Session *s, const char *itemName);
+void doInventory(Session *s);
+void doStats(Session *s);
+void doAttack(Session *s, const char *target);
+void doUse(Session *s, const char *itemName);
+void doSay(Session *s, const char *message);
+void doShout(Session *s, const char *message);
+void doChannel(Session *s, const char *name);
+void doChat(Session *s, const char *message);
+void doHelp(Session *s);
+void doSave(Session *s);
+void doLoad(Session *s);
+void doQuit(Session *s);
+void doMetrics(Session *s);
+
+/* Sessions & networking */
+void sessPrintf(Session *s, const char *fmt, ...);
+void sessWrite(Session *s, const char *data, size_t len);
+void sessWriteShared(Session *s, SharedText *text);
+int  queueAppend(OutQueue *q, OutChunk **spare, const char *data, size_t n);
+int  queueShare(OutQueue *q, OutChunk **spare, SharedText *t);
+void queueSplice(OutQueue *into, OutQueue *from);
+SharedText *sharedTextPrintf(const char *fmt, ...);
+SharedText *sharedTextFormat(const char *fmt, va_list ap);
+void sharedTextHold(SharedText *text);
+void sharedTextDrop(SharedText *text);
+void printPrompt(Session *s);
+int  formatPrompt(char *buf, size_t size, const Player *p);
+int  runServer(int port, int threads);
+Session *newSession(int fd);
+void closeSession(Session *s);
+void sessionRead(Session *s);
+void sessionFlush(Session *s);
+void consoleFlush();
+void outputDiscard(Session *s);
 
 /* Utility */
+uint32_t itemNameHash(const char *name, size_t len);
 int  findItemInRoom(Room *room, const char *itemName);
-int  findItemInInventory(Inventory *inv, const char *itemName);
+int  findItemInInventory(const Inventory *inv, const char *itemName);
 void removeItemFromRoom(Room *room, int index);
 void removeItemFromInventory(Inventory *inv, int index);
-void addItemToInventory(Inventory *inv, Item item);
-void addItemToRoom(Room *room, Item item);
+int  addItemToInventory(Inventory *inv, ItemId item);
+void addItemToRoom(Room *room, ItemId item);
+void reindexInventory(Inventory *inv);
 int  getRoomIndexByName(const char *roomName);
 int  getExitIndexByName(const char *exitName);
-void combatWithMonster(Monster *monster);
+void rollDamage(Rng *rng, int n, const int *attack, const int *hp, int *damage);
+void combatRound(Rng *rng, int n, const int *playerAttack, int *playerHp,
+                 const int *monsterAttack, int *monsterHp, int *dealt, int *taken);
+void combatWithMonster(Session *s, Monster *monster);
+void monsterAIArm(Session *s);
+int  monstersAct(Session *s);
+int  monsterPursue(Session *s, int from);
+int  awardKill(Rng *rng, Player *p, int level, int *gold, int *exp);
 void levelUp(Player *p);
-void spawnMonster(Room *room);
-int  randomInRange(int min, int max);
+int  spawnLevel(Rng *rng);
+int  spawnPackSize(Rng *rng);
+void makeMonster(Monster *m, int level);
+Monster *spawnMonster(int room);
+void rngSeed(Rng *rng, uint64_t seed, uint64_t stream);
+uint64_t rngNext(Rng *rng);
+int  randomInRange(Rng *rng, int min, int max);
+uint64_t nowNs();
 void clearInputBuffer();
 char *trimWhitespace(char *str);
 void strToLower(char *str);
+void tokenizeLine(char *line, size_t len, CommandLine *cl);
+
+/* Benchmarks */
+int  runTokenizerBenchmark(const char *logPath);
+int  runMemoryBenchmark(const char *worldPath);
+int  runSweepBenchmark(const char *worldPath);
+int  runTravelBenchmark(const char *worldPath, int queries);
+int  runThreadBenchmark(const char *worldPath, int bots);
+int  runLoadBenchmark(const char *worldPath, int bots, long commands, const char *mix);
+int  runNetLoadBenchmark(int port, int bots, long commands, const char *mix);
+int  runChatBenchmark(const char *worldPath, int sessions);
+#if defined(MUD_SELF_TEST)
+int  runSaveCheck();
+#endif
+int  runSimulation(long careers, int fights, int level, int monsterLevel, int threads);
+
+/* Metrics */
+void initMetrics(const char *file);
+void metricsCount(MetricCounter c);
+void metricsRender(ByteBuf *b);
+int  metricsTimeoutMs();
+void metricsMaybeDump();
+void histRecord(LatencyHist *h, uint64_t ns);
+uint64_t histPercentile(const LatencyHist *h, double q);
+uint64_t allocationCount();
 
 /*****************************************************************************
  * MAIN
  *****************************************************************************/
 
-int main() {
-    srand((unsigned int)time(NULL));
+/* Print command-line usage */
+static void printUsage(const char *prog) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s [--world <image>] [--seed <n>] [--room-memory <MB>]\n"
+                    "      [--listen <port> [--threads <n>] [--metrics-file <file>]]\n", prog);
+    fprintf(stderr, "  %s --compile-world <world.txt> <world.img>\n", prog);
+    fprintf(stderr, "  %s --gen-world <rooms> <world.txt>\n", prog);
+    fprintf(stderr, "  %s --bench-tokenizer [command_log.txt]\n", prog);
+    fprintf(stderr, "  %s [--room-memory <MB>] --bench-memory <world.img>\n", prog);
+    fprintf(stderr, "  %s --bench-sweep <world.img>\n", prog);
+    fprintf(stderr, "  %s [--seed <n>] --bench-travel <world.img> [routes]\n", prog);
+    fprintf(stderr, "  %s --bench-threads <world.img> [bots]\n", prog);
+    fprintf(stderr, "  %s [--seed <n>] --bench-load <world.img> [bots] [commands] [mix]\n", prog);
+    fprintf(stderr, "  %s [--seed <n>] --bench-load-net <port> [bots] [commands] [mix]\n", prog);
+    fprintf(stderr, "  %s --bench-chat <world.img> [sessions]\n", prog);
+    fprintf(stderr, "      mix: %s (relative weights)\n", LOAD_DEFAULT_MIX);
+#if defined(MUD_SELF_TEST)
+    fprintf(stderr, "  %s --check-saves\n", prog);
+#endif
+    fprintf(stderr, "  %s [--seed <n>] [--threads <n>] --simulate [careers] [fights] [level]\n"
+                    "      [monster level]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *worldPath = NULL;
+    const char *metricsFile = METRICS_FILE_NAME;
+    int port = 0;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    g_seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ nowNs();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--world") == 0 && i + 1 < argc) {
+            worldPath = argv[++i];
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            /* Optional server mode: --listen <port> */
+            port = atoi(argv[++i]);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "Invalid port: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            char *end;
+            g_seed = strtoull(argv[++i], &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (strcmp(argv[i], "--room-memory") == 0 && i + 1 < argc) {
+            long mb = atol(argv[++i]);
+            if (mb <= 0) {
+                fprintf(stderr, "Invalid room memory budget: %s\n", argv[i]);
+                return 1;
+            }
+            uint64_t rooms = (uint64_t)mb * 1024 * 1024 / ROOM_RESIDENT_BYTES;
+            g_roomBudget = rooms < UINT32_MAX ? (uint32_t)rooms : UINT32_MAX;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1 || threads > MAX_WORKERS) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--compile-world") == 0 && i + 2 < argc) {
+            return compileWorldFile(argv[i + 1], argv[i + 2]);
+        } else if (strcmp(argv[i], "--gen-world") == 0 && i + 2 < argc) {
+            return generateWorldFile(atoi(argv[i + 1]), argv[i + 2]);
+        } else if (strcmp(argv[i], "--bench-tokenizer") == 0) {
+            return runTokenizerBenchmark(i + 1 < argc ? argv[i + 1] : NULL);
+        } else if (strcmp(argv[i], "--bench-memory") == 0 && i + 1 < argc) {
+            return runMemoryBenchmark(argv[i + 1]);
+        } else if (strcmp(argv[i], "--bench-sweep") == 0 && i + 1 < argc) {
+            return runSweepBenchmark(argv[i + 1]);
+        } else if (strcmp(argv[i], "--bench-travel") == 0 && i + 1 < argc) {
+            return runTravelBenchmark(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 1000);
+        } else if (strcmp(argv[i], "--bench-threads") == 0 && i + 1 < argc) {
+            return runThreadBenchmark(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 1000);
+        } else if (strcmp(argv[i], "--bench-load") == 0 && i + 1 < argc) {
+            return runLoadBenchmark(argv[i + 1],
+                                    i + 2 < argc ? atoi(argv[i + 2]) : 100,
+                                    i + 3 < argc ? atol(argv[i + 3]) : 1000000,
+                                    i + 4 < argc ? argv[i + 4] : LOAD_DEFAULT_MIX);
+        } else if (strcmp(argv[i], "--bench-load-net") == 0 && i + 1 < argc) {
+            return runNetLoadBenchmark(atoi(argv[i + 1]),
+                                       i + 2 < argc ? atoi(argv[i + 2]) : 100,
+                                       i + 3 < argc ? atol(argv[i + 3]) : 100000,
+                                       i + 4 < argc ? argv[i + 4] : LOAD_DEFAULT_MIX);
+        } else if (strcmp(argv[i], "--bench-chat") == 0 && i + 1 < argc) {
+            return runChatBenchmark(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 10000);
+#if defined(MUD_SELF_TEST)
+        } else if (strcmp(argv[i], "--check-saves") == 0) {
+            return runSaveCheck();
+#endif
+        } else if (strcmp(argv[i], "--simulate") == 0) {
+            return runSimulation(i + 1 < argc ? atol(argv[i + 1]) : 100000,
+                                 i + 2 < argc ? atoi(argv[i + 2]) : 50,
+                                 i + 3 < argc ? atoi(argv[i + 3]) : 1,
+                                 i + 4 < argc ? atoi(argv[i + 4]) : 0,
+                                 threads);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* Initialize game */
+    if (!initGame(worldPath)) {
+        return 1;
+    }
+    initMetrics(port ? metricsFile : NULL);
+    if (port) {
+        return runServer(port, threads);
+    }
     
     /* Create an introduction, prompt for player name */
     char nameBuf[MAX_NAME_LEN];
@@ -204,19 +1048,19 @@ int main() {
     }
     
     /* Trim newline, spaces */
-    trimWhitespace(nameBuf);
-    if (strlen(nameBuf) == 0) {
-        strcpy(nameBuf, "Hero");
+    char *name = trimWhitespace(nameBuf);
+    if (strlen(name) == 0) {
+        name = "Hero";
     }
     
-    /* Initialize game */
-    initGame();
-    initPlayer(nameBuf);
-
-    printf("Hello, %s! Type 'help' for a list of commands.\n", g_player.name);
+    loginPlayer(&g_console, name);
 
     /* Start game loop */
     gameLoop();
+    logoutPlayer(&g_console);
+    consoleFlush();
+    journalCommit();
+    journalSnapshotWait();
 
     return 0;
 }
@@ -225,597 +1069,8764 @@ int main() {
  * GAME INITIALIZATION FUNCTIONS
  *****************************************************************************/
 
-/* Top-level initialization: creates rooms, sets up items, etc. */
-void initGame() {
-    createRooms();
-}
-
-/* Basic custom rooms for demonstration */
-void createRooms() {
-    /* Example:
-     * 0: Town Square
-     * 1: Blacksmith
-     * 2: Forest Edge
-     * 3: Deep Forest
-     * 4: Ancient Ruin
-     */
-    g_roomCount = 5;
-    
-    /* Room 0 - Town Square */
-    g_rooms[0].id = 0;
-    strcpy(g_rooms[0].name, "Town Square");
-    strcpy(g_rooms[0].description, "You are in a bustling town square. A fountain stands in the center.");
-    g_rooms[0].exits[DIR_NORTH] = 1;
-    g_rooms[0].exits[DIR_SOUTH] = 2;
-    g_rooms[0].exits[DIR_EAST]  = -1;
-    g_rooms[0].exits[DIR_WEST]  = -1;
-    g_rooms[0].exits[DIR_UP]    = -1;
-    g_rooms[0].exits[DIR_DOWN]  = -1;
-    g_rooms[0].itemCount = 1;
-    strcpy(g_rooms[0].itemsInRoom[0].name, "Town Map");
-    g_rooms[0].itemsInRoom[0].type = ITEM_MISC;
-    g_rooms[0].itemsInRoom[0].power = 0;
-    g_rooms[0].itemsInRoom[0].value = 5;
-    g_rooms[0].monsterPresent = 0;
-
-    /* Room 1 - Blacksmith */
-    g_rooms[1].id = 1;
-    strcpy(g_rooms[1].name, "Blacksmith");
-    strcpy(g_rooms[1].description, "Sparks fly as the blacksmith hammers away at a glowing sword.");
-    g_rooms[1].exits[DIR_SOUTH] = 0;
-    g_rooms[1].exits[DIR_NORTH] = -1;
-    g_rooms[1].exits[DIR_EAST]  = -1;
-    g_rooms[1].exits[DIR_WEST]  = -1;
-    g_rooms[1].exits[DIR_UP]    = -1;
-    g_rooms[1].exits[DIR_DOWN]  = -1;
-    g_rooms[1].itemCount = 1;
-    strcpy(g_rooms[1].itemsInRoom[0].name, "Rusty Sword");
-    g_rooms[1].itemsInRoom[0].type = ITEM_WEAPON;
-    g_rooms[1].itemsInRoom[0].power = 5;
-    g_rooms[1].itemsInRoom[0].value = 10;
-    g_rooms[1].monsterPresent = 0;
-    
-    /* Room 2 - Forest Edge */
-    g_rooms[2].id = 2;
-    strcpy(g_rooms[2].name, "Forest Edge");
-    strcpy(g_rooms[2].description, "The forest looms ahead, tall and foreboding.");
-    g_rooms[2].exits[DIR_NORTH] = 0;
-    g_rooms[2].exits[DIR_SOUTH] = 3;
-    g_rooms[2].exits[DIR_EAST]  = -1;
-    g_rooms[2].exits[DIR_WEST]  = -1;
-    g_rooms[2].exits[DIR_UP]    = -1;
-    g_rooms[2].exits[DIR_DOWN]  = -1;
-    g_rooms[2].itemCount = 1;
-    strcpy(g_rooms[2].itemsInRoom[0].name, "Health Potion");
-    g_rooms[2].itemsInRoom[0].type = ITEM_POTION;
-    g_rooms[2].itemsInRoom[0].power = 20; /* restore 20 HP */
-    g_rooms[2].itemsInRoom[0].value = 15;
-    g_rooms[2].monsterPresent = 0;
-    
-    /* Room 3 - Deep Forest */
-    g_rooms[3].id = 3;
-    strcpy(g_rooms[3].name, "Deep Forest");
-    strcpy(g_rooms[3].description, "Dark and silent, the forest here is eerie.");
-    g_rooms[3].exits[DIR_NORTH] = 2;
-    g_rooms[3].exits[DIR_SOUTH] = 4;
-    g_rooms[3].exits[DIR_EAST]  = -1;
-    g_rooms[3].exits[DIR_WEST]  = -1;
-    g_rooms[3].exits[DIR_UP]    = -1;
-    g_rooms[3].exits[DIR_DOWN]  = -1;
-    g_rooms[3].itemCount = 1;
-    strcpy(g_rooms[3].itemsInRoom[0].name, "Mana Potion");
-    g_rooms[3].itemsInRoom[0].type = ITEM_POTION;
-    g_rooms[3].itemsInRoom[0].power = 15; /* restore 15 MP */
-    g_rooms[3].itemsInRoom[0].value = 12;
-    g_rooms[3].monsterPresent = 0;
-    
-    /* Room 4 - Ancient Ruin */
-    g_rooms[4].id = 4;
-    strcpy(g_rooms[4].name, "Ancient Ruin");
-    strcpy(g_rooms[4].description, "Cracked pillars and moss-covered stones hint at a lost civilization.");
-    g_rooms[4].exits[DIR_NORTH] = 3;
-    g_rooms[4].exits[DIR_SOUTH] = -1;
-    g_rooms[4].exits[DIR_EAST]  = -1;
-    g_rooms[4].exits[DIR_WEST]  = -1;
-    g_rooms[4].exits[DIR_UP]    = -1;
-    g_rooms[4].exits[DIR_DOWN]  = -1;
-    g_rooms[4].itemCount = 1;
-    strcpy(g_rooms[4].itemsInRoom[0].name, "Ancient Relic");
-    g_rooms[4].itemsInRoom[0].type = ITEM_MISC;
-    g_rooms[4].itemsInRoom[0].power = 0;
-    g_rooms[4].itemsInRoom[0].value = 100;
-    g_rooms[4].monsterPresent = 0;
-    
-    /* Initialize monsters in each room (some rooms may remain without monsters initially) */
-    for (int i = 0; i < g_roomCount; i++) {
-        initMonsters(&g_rooms[i]);
+/* The built-in demo world, compiled at startup when no image is given */
+static const char g_defaultWorld[] =
+    "# room <id> <name> / desc <text> / exit <direction> <room id> /\n"
+    "# item <weapon|potion|misc> <power> <value> <name>\n"
+    "room 0 Town Square\n"
+    "desc You are in a bustling town square. A fountain stands in the center.\n"
+    "exit north 1\n"
+    "exit south 2\n"
+    "item misc 0 5 Town Map\n"
+    "\n"
+    "room 1 Blacksmith\n"
+    "desc Sparks fly as the blacksmith hammers away at a glowing sword.\n"
+    "exit south 0\n"
+    "item weapon 5 10 Rusty Sword\n"
+    "\n"
+    "room 2 Forest Edge\n"
+    "desc The forest looms ahead, tall and foreboding.\n"
+    "exit north 0\n"
+    "exit south 3\n"
+    "item potion 20 15 Health Potion\n"
+    "\n"
+    "room 3 Deep Forest\n"
+    "desc Dark and silent, the forest here is eerie.\n"
+    "exit north 2\n"
+    "exit south 4\n"
+    "item potion 15 12 Mana Potion\n"
+    "\n"
+    "room 4 Ancient Ruin\n"
+    "desc Cracked pillars and moss-covered stones hint at a lost civilization.\n"
+    "exit north 3\n"
+    "item misc 0 100 Ancient Relic\n";
+
+/* Top-level initialization: sets up commands, maps the world and recovers
+ * saved state. Rooms are materialized from the image the first time they
+ * are touched. */
+int initGame(const char *worldPath) {
+    initCommands();
+    initWorldClock();
+
+    if (worldPath) {
+        return mapWorldFile(worldPath) && journalRecover();
     }
+
+    unsigned char *image;
+    size_t size;
+    if (!compileWorld(g_defaultWorld, sizeof(g_defaultWorld) - 1, &image, &size) ||
+        !attachWorldImage(image, size)) { /* kept for the life of the process */
+        return 0;
+    }
+    return journalRecover();
 }
 
 /* Initialize a monster for a given room, for demonstration some are random. */
-void initMonsters(Room *room) {
-    /* 30% chance a monster spawns initially for demonstration */
-    if (randomInRange(1, 10) <= 3) {
-        spawnMonster(room);
-    } else {
-        room->monsterPresent = 0;
+void initMonsters(int room) {
+    /* 30% chance monsters spawn initially for demonstration, sometimes a pack.
+     * New characters start in room 0, so it starts out empty. */
+    if (room == 0) {
+        return;
+    }
+    Rng *rng = &regionOf(room)->rng;
+    if (randomInRange(rng, 1, 10) <= 3) {
+        for (int n = spawnPackSize(rng); n > 0; n--) {
+            spawnMonster(room);
+        }
     }
 }
 
 /* Initialize player stats */
-void initPlayer(const char *playerName) {
-    memset(&g_player, 0, sizeof(Player));
-    strcpy(g_player.name, playerName);
-    g_player.level = 1;
-    g_player.exp = 0;
-    g_player.expToNextLevel = 10;
-    g_player.hp = 30;
-    g_player.maxHp = 30;
-    g_player.mp = 10;
-    g_player.maxMp = 10;
-    g_player.attackPower = 5;
-    g_player.gold = 0;
-    g_player.currentRoom = 0;
-    g_player.inventory.count = 0;
+void initPlayer(Player *p, const char *playerName) {
+    memset(p, 0, sizeof(Player));
+    snprintf(p->name, sizeof(p->name), "%s", playerName);
+    p->level = 1;
+    p->exp = 0;
+    p->expToNextLevel = 10;
+    p->hp = 30;
+    p->maxHp = 30;
+    p->mp = 10;
+    p->maxMp = 10;
+    p->attackPower = 5;
+    p->gold = 0;
+    p->currentRoom = 0;
+    p->inventory.count = 0;
 }
 
 /*****************************************************************************
- * GAME LOOP & COMMANDS
+ * WORLD IMAGES & ROOM STORE
  *****************************************************************************/
 
-void gameLoop() {
-    char inputBuf[MAX_INPUT_LEN];
-    
-    while (1) {
-        printf("\n[%s, L%d, HP:%d/%d, MP:%d/%d, Gold:%d] > ",
-               g_player.name,
-               g_player.level,
-               g_player.hp,
-               g_player.maxHp,
-               g_player.mp,
-               g_player.maxMp,
-               g_player.gold);
-        fflush(stdout);
-        
-        if (fgets(inputBuf, MAX_INPUT_LEN, stdin) == NULL) {
-            printf("Error reading command.\n");
-            continue;
-        }
-
-        /* Convert to lower case, trim */
-        trimWhitespace(inputBuf);
-        strToLower(inputBuf);
-        
-        if (strcmp(inputBuf, "quit") == 0 || strcmp(inputBuf, "exit") == 0) {
-            printf("Goodbye!\n");
-            break;
-        }
-        
-        parseCommand(inputBuf);
-        
-        /* Check if player is dead */
-        if (g_player.hp <= 0) {
-            printf("You have died. Game Over.\n");
-            break;
-        }
+static int bufReserve(ByteBuf *b, size_t extra) {
+    if (b->len + extra <= b->cap) {
+        return 1;
     }
+    size_t newCap = b->cap ? b->cap : 4096;
+    while (newCap < b->len + extra) {
+        newCap *= 2;
+    }
+    unsigned char *data = realloc(b->data, newCap);
+    if (!data) {
+        return 0;
+    }
+    b->data = data;
+    b->cap = newCap;
+    return 1;
 }
 
-/* Handle user input commands */
-void parseCommand(const char *input) {
-    if (strlen(input) == 0) {
-        return;
-    }
-
-    /* We will parse the first word as command, the rest as argument */
-    char cmd[MAX_CMD_LEN];
-    char arg[MAX_CMD_LEN];
-    memset(cmd, 0, sizeof(cmd));
-    memset(arg, 0, sizeof(arg));
-
-    /* Try to split into two tokens: command + argument */
-    sscanf(input, "%s %[^\n]", cmd, arg);
-
-    if (strcmp(cmd, "look") == 0) {
-        doLook();
-    } else if (strcmp(cmd, "go") == 0) {
-        doGo(arg);
-    } else if (strcmp(cmd, "take") == 0) {
-        doTake(arg);
-    } else if (strcmp(cmd, "drop") == 0) {
-        doDrop(arg);
-    } else if (strcmp(cmd, "inventory") == 0 || strcmp(cmd, "inv") == 0) {
-        doInventory();
-    } else if (strcmp(cmd, "stats") == 0) {
-        doStats();
-    } else if (strcmp(cmd, "attack") == 0) {
-        doAttack();
-    } else if (strcmp(cmd, "use") == 0) {
-        doUse(arg);
-    } else if (strcmp(cmd, "help") == 0) {
-        doHelp();
-    } else if (strcmp(cmd, "save") == 0) {
-        doSave();
-    } else if (strcmp(cmd, "load") == 0) {
-        doLoad();
-    } else {
-        printf("Unknown command: %s\n", cmd);
-        printf("Type 'help' to see available commands.\n");
+static int bufAppend(ByteBuf *b, const void *data, size_t n) {
+    if (!bufReserve(b, n)) {
+        return 0;
     }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return 1;
 }
 
-/* COMMAND: look */
-void doLook() {
-    Room *room = &g_rooms[g_player.currentRoom];
-    printf("=== %s ===\n", room->name);
-    printf("%s\n", room->description);
-    
-    /* Print items on the ground */
-    if (room->itemCount > 0) {
-        printf("You see the following items on the ground:\n");
-        for (int i = 0; i < room->itemCount; i++) {
-            printf("  - %s\n", room->itemsInRoom[i].name);
-        }
-    } else {
-        printf("There are no items here.\n");
-    }
-    
-    /* Print monster info if present */
-    if (room->monsterPresent && room->monster.state != MONSTER_DEAD) {
-        printf("A %s lurks here (Lvl %d, HP %d/%d).\n",
-               room->monster.name,
-               room->monster.level,
-               room->monster.hp,
-               room->monster.maxHp);
-    }
-    
-    printf("Exits:\n");
-    for (int i = 0; i < DIR_COUNT; i++) {
-        if (room->exits[i] != -1) {
-            switch (i) {
-                case DIR_NORTH: printf("  North\n"); break;
-                case DIR_SOUTH: printf("  South\n"); break;
-                case DIR_EAST:  printf("  East\n");  break;
-                case DIR_WEST:  printf("  West\n");  break;
-                case DIR_UP:    printf("  Up\n");    break;
-                case DIR_DOWN:  printf("  Down\n");  break;
-                default: break;
-            }
-        }
+static int bufPrintf(ByteBuf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !bufReserve(b, (size_t)n + 1)) {
+        return 0;
     }
+    va_start(ap, fmt);
+    vsnprintf((char *)b->data + b->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    b->len += (size_t)n;
+    return 1;
 }
 
-/* COMMAND: go <direction> */
-void doGo(const char *direction) {
-    if (strlen(direction) == 0) {
-        printf("Go where?\n");
-        return;
-    }
-    
-    int dirIndex = getExitIndexByName(direction);
-    if (dirIndex == -1) {
-        printf("Invalid direction. Try north, south, east, west, up, down.\n");
-        return;
-    }
-    
-    Room *room = &g_rooms[g_player.currentRoom];
-    int nextRoom = room->exits[dirIndex];
-    if (nextRoom == -1) {
-        printf("You can't go that way.\n");
-        return;
+/* 64-bit FNV-1a hash */
+static uint64_t hashBytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ull;
     }
-    
-    g_player.currentRoom = nextRoom;
-    doLook();
+    return h;
 }
 
-/* COMMAND: take <item> */
-void doTake(const char *itemName) {
-    if (strlen(itemName) == 0) {
-        printf("Take what?\n");
-        return;
-    }
-    
-    Room *room = &g_rooms[g_player.currentRoom];
-    int index = findItemInRoom(room, itemName);
-    if (index == -1) {
-        printf("There is no %s here.\n", itemName);
-        return;
+/* String table under construction; identical strings are stored once */
+typedef struct {
+    ByteBuf   bytes;
+    uint32_t *slots;      /* open addressing: offset + 1, 0 = empty */
+    size_t    slotCount;
+    size_t    used;
+} StringTable;
+
+static int stringTableGrow(StringTable *st) {
+    size_t newCount = st->slotCount ? st->slotCount * 2 : 1024;
+    uint32_t *slots = calloc(newCount, sizeof(uint32_t));
+    if (!slots) {
+        return 0;
     }
-    
-    if (g_player.inventory.count >= MAX_INVENTORY_SIZE) {
-        printf("Your inventory is full!\n");
-        return;
+    for (size_t i = 0; i < st->slotCount; i++) {
+        if (!st->slots[i]) {
+            continue;
+        }
+        const char *str = (const char *)st->bytes.data + st->slots[i] - 1;
+        size_t j = hashBytes(str, strlen(str)) & (newCount - 1);
+        while (slots[j]) {
+            j = (j + 1) & (newCount - 1);
+        }
+        slots[j] = st->slots[i];
     }
-    
-    Item item = room->itemsInRoom[index];
-    addItemToInventory(&g_player.inventory, item);
-    removeItemFromRoom(room, index);
-    printf("You picked up %s.\n", item.name);
+    free(st->slots);
+    st->slots = slots;
+    st->slotCount = newCount;
+    return 1;
 }
 
-/* COMMAND: drop <item> */
-void doDrop(const char *itemName) {
-    if (strlen(itemName) == 0) {
-        printf("Drop what?\n");
-        return;
-    }
-    
-    Inventory *inv = &g_player.inventory;
-    int index = findItemInInventory(inv, itemName);
-    if (index == -1) {
-        printf("You don't have %s.\n", itemName);
-        return;
+/* Add a string and return its offset, or UINT32_MAX on failure */
+static uint32_t internString(StringTable *st, const char *str) {
+    if ((st->used + 1) * 2 > st->slotCount && !stringTableGrow(st)) {
+        return UINT32_MAX;
     }
-    
-    /* Drop item in current room */
-    if (g_rooms[g_player.currentRoom].itemCount >= MAX_INVENTORY_SIZE) {
-        printf("There's no space to drop this here.\n");
-        return;
+    size_t len = strlen(str);
+    size_t j = hashBytes(str, len) & (st->slotCount - 1);
+    while (st->slots[j]) {
+        const char *other = (const char *)st->bytes.data + st->slots[j] - 1;
+        if (strcmp(other, str) == 0) {
+            return st->slots[j] - 1;
+        }
+        j = (j + 1) & (st->slotCount - 1);
     }
-    
-    Item item = inv->items[index];
-    addItemToRoom(&g_rooms[g_player.currentRoom], item);
-    removeItemFromInventory(inv, index);
-    printf("You dropped %s.\n", item.name);
-}
-
-/* COMMAND: inventory */
-void doInventory() {
-    Inventory *inv = &g_player.inventory;
-    if (inv->count == 0) {
-        printf("Your inventory is empty.\n");
-        return;
+    if (st->bytes.len + len + 1 >= UINT32_MAX) {
+        return UINT32_MAX;
     }
-    
-    printf("You are carrying:\n");
-    for (int i = 0; i < inv->count; i++) {
-        printf("  - %s\n", inv->items[i].name);
+    uint32_t off = (uint32_t)st->bytes.len;
+    if (!bufAppend(&st->bytes, str, len + 1)) {
+        return UINT32_MAX;
     }
+    st->slots[j] = off + 1;
+    st->used++;
+    return off;
 }
 
-/* COMMAND: stats */
-void doStats() {
-    printf("=== %s ===\n", g_player.name);
-    printf("Level: %d\n", g_player.level);
-    printf("EXP: %d / %d\n", g_player.exp, g_player.expToNextLevel);
-    printf("HP: %d / %d\n", g_player.hp, g_player.maxHp);
-    printf("MP: %d / %d\n", g_player.mp, g_player.maxMp);
-    printf("Attack Power: %d\n", g_player.attackPower);
-    printf("Gold: %d\n", g_player.gold);
+/* Parse an ItemType keyword; -1 if unknown */
+static int parseItemType(const char *word) {
+    if (strcmp(word, "weapon") == 0) return ITEM_WEAPON;
+    if (strcmp(word, "potion") == 0) return ITEM_POTION;
+    if (strcmp(word, "misc") == 0)   return ITEM_MISC;
+    return -1;
 }
 
-/* COMMAND: attack */
-void doAttack() {
-    Room *room = &g_rooms[g_player.currentRoom];
-    if (!room->monsterPresent || room->monster.state == MONSTER_DEAD) {
-        printf("There's nothing here to attack.\n");
-        return;
+/* Compile world-definition text into a binary world image (malloc'd).
+ * Format, one directive per line ('#' starts a comment):
+ *   room <id> <name>        start a room; ids are 0..N-1 in any order
+ *   desc <text>             description of the current room
+ *   exit <direction> <id>   one-way exit from the current room
+ *   item <weapon|potion|misc> <power> <value> <name>
+ * Returns 1 on success; errors are reported on stderr. */
+int compileWorld(const char *text, size_t len, unsigned char **imageOut, size_t *sizeOut) {
+    WorldRoom   *rooms = NULL;
+    int32_t     *exits = NULL;      /* DIR_COUNT per room */
+    char        *defined = NULL;
+    size_t       roomCap = 0;
+    uint32_t     roomCount = 0;
+    ByteBuf      items = { 0 };
+    StringTable  strings = { 0 };
+    WorldRoom   *cur = NULL;
+    int32_t     *curExits = NULL;
+    int          lineNo = 0;
+    int          ok = 0;
+    char         line[1024];
+
+    uint32_t emptyOff = internString(&strings, "");
+    if (emptyOff == UINT32_MAX) {
+        goto fail;
     }
-    
-    combatWithMonster(&room->monster);
-    /* If monster was killed, possibly spawn a new monster occasionally */
-    if (room->monster.state == MONSTER_DEAD) {
-        printf("You defeated the %s!\n", room->monster.name);
-        g_player.gold += randomInRange(5, 20) * room->monster.level;
-        g_player.exp += 5 * room->monster.level;
-        printf("You gained %d gold and %d exp.\n", 
-               5 * room->monster.level, 
-               5 * room->monster.level);
-        
-        if (g_player.exp >= g_player.expToNextLevel) {
-            levelUp(&g_player);
+
+    for (size_t pos = 0; pos < len; ) {
+        /* Copy out the next line */
+        size_t end = pos;
+        while (end < len && text[end] != '\n') {
+            end++;
         }
-        
-        /* 20% chance to spawn a new monster in the same room after a victory. */
-        if (randomInRange(1, 10) <= 2) {
-            spawnMonster(room);
+        lineNo++;
+        if (end - pos >= sizeof(line)) {
+            fprintf(stderr, "world:%d: line too long\n", lineNo);
+            goto fail;
         }
-    }
-}
+        memcpy(line, text + pos, end - pos);
+        line[end - pos] = '\0';
+        pos = end + 1;
 
-/* COMMAND: use <item> */
-void doUse(const char *itemName) {
-    if (strlen(itemName) == 0) {
-        printf("Use what?\n");
-        return;
+        char *l = trimWhitespace(line);
+        if (*l == '\0' || *l == '#') {
+            continue;
+        }
+
+        char keyword[16];
+        int  consumed = 0;
+        if (sscanf(l, "%15s %n", keyword, &consumed) != 1) {
+            continue;
+        }
+        char *rest = l + consumed;
+
+        if (strcmp(keyword, "room") == 0) {
+            char *nameStart;
+            long id = strtol(rest, &nameStart, 10);
+            nameStart = trimWhitespace(nameStart);
+            if (nameStart == rest || id < 0 || id >= INT32_MAX / 2) {
+                fprintf(stderr, "world:%d: bad room id\n", lineNo);
+                goto fail;
+            }
+            if (*nameStart == '\0' || strlen(nameStart) >= MAX_NAME_LEN) {
+                fprintf(stderr, "world:%d: room name missing or too long\n", lineNo);
+                goto fail;
+            }
+            if ((size_t)id >= roomCap) {
+                size_t newCap = roomCap ? roomCap : 64;
+                while (newCap <= (size_t)id) {
+                    newCap *= 2;
+                }
+                WorldRoom *r = realloc(rooms, newCap * sizeof(WorldRoom));
+                int32_t *e = realloc(exits, newCap * DIR_COUNT * sizeof(int32_t));
+                char *d = realloc(defined, newCap);
+                if (!r || !e || !d) {
+                    free(r ? r : rooms);
+                    free(e ? e : exits);
+                    free(d ? d : defined);
+                    rooms = NULL;
+                    exits = NULL;
+                    defined = NULL;
+                    fprintf(stderr, "world: out of memory\n");
+                    goto fail;
+                }
+                memset(d + roomCap, 0, newCap - roomCap);
+                rooms = r;
+                exits = e;
+                defined = d;
+                roomCap = newCap;
+            }
+            if (defined[id]) {
+                fprintf(stderr, "world:%d: room %ld defined twice\n", lineNo, id);
+                goto fail;
+            }
+            defined[id] = 1;
+            if ((uint32_t)id >= roomCount) {
+                roomCount = (uint32_t)id + 1;
+            }
+
+            cur = &rooms[id];
+            curExits = &exits[id * DIR_COUNT];
+            cur->nameOff = internString(&strings, nameStart);
+            cur->descOff = emptyOff;
+            for (int d = 0; d < DIR_COUNT; d++) {
+                curExits[d] = -1;
+            }
+            cur->firstItem = (uint32_t)(items.len / sizeof(WorldItem));
+            cur->itemCount = 0;
+            if (cur->nameOff == UINT32_MAX) {
+                goto fail;
+            }
+            continue;
+        }
+
+        if (!cur) {
+            fprintf(stderr, "world:%d: '%s' before any room\n", lineNo, keyword);
+            goto fail;
+        }
+
+        if (strcmp(keyword, "desc") == 0) {
+            cur->descOff = internString(&strings, rest);
+            if (cur->descOff == UINT32_MAX) {
+                goto fail;
+            }
+        } else if (strcmp(keyword, "exit") == 0) {
+            char dirName[16];
+            long target;
+            int dir;
+            if (sscanf(rest, "%15s %ld", dirName, &target) != 2 ||
+                (dir = getExitIndexByName(dirName)) == -1 || target < 0) {
+                fprintf(stderr, "world:%d: expected 'exit <direction> <room id>'\n", lineNo);
+                goto fail;
+            }
+            curExits[dir] = (int32_t)target;
+        } else if (strcmp(keyword, "item") == 0) {
+            char typeName[16];
+            WorldItem item;
+            int n = 0;
+            if (sscanf(rest, "%15s %d %d %n", typeName, &item.power, &item.value, &n) != 3 ||
+                parseItemType(typeName) < 0 || rest[n] == '\0' ||
+                strlen(rest + n) >= MAX_NAME_LEN) {
+                fprintf(stderr, "world:%d: expected 'item <type> <power> <value> <name>'\n", lineNo);
+                goto fail;
+            }
+            if (cur->firstItem + cur->itemCount != items.len / sizeof(WorldItem)) {
+                fprintf(stderr, "world:%d: items must follow their room\n", lineNo);
+                goto fail;
+            }
+            item.type = (uint32_t)parseItemType(typeName);
+            item.nameOff = internString(&strings, rest + n);
+            if (item.nameOff == UINT32_MAX || !bufAppend(&items, &item, sizeof(item))) {
+                goto fail;
+            }
+            cur->itemCount++;
+        } else {
+            fprintf(stderr, "world:%d: unknown directive '%s'\n", lineNo, keyword);
+            goto fail;
+        }
     }
-    
-    Inventory *inv = &g_player.inventory;
-    int index = findItemInInventory(inv, itemName);
-    if (index == -1) {
-        printf("You don't have %s.\n", itemName);
-        return;
+
+    /* Every id must be defined and every exit must lead somewhere */
+    if (roomCount == 0) {
+        fprintf(stderr, "world: no rooms defined\n");
+        goto fail;
     }
-    
-    Item item = inv->items[index];
-    if (item.type == ITEM_POTION) {
-        /* Use it to restore HP or MP */
-        if (strstr(item.name, "health") || strstr(item.name, "Health")) {
-            g_player.hp += item.power;
-            if (g_player.hp > g_player.maxHp) {
-                g_player.hp = g_player.maxHp;
-            }
-            printf("You used %s. Your HP is now %d/%d.\n",
-                   item.name,
-                   g_player.hp,
-                   g_player.maxHp);
-        } else if (strstr(item.name, "mana") || strstr(item.name, "Mana")) {
-            g_player.mp += item.power;
-            if (g_player.mp > g_player.maxMp) {
-                g_player.mp = g_player.maxMp;
-            }
-            printf("You used %s. Your MP is now %d/%d.\n",
-                   item.name,
-                   g_player.mp,
-                   g_player.maxMp);
-        } else {
-            /* Generic potion effect: restore HP or do something else */
-            g_player.hp += item.power;
-            if (g_player.hp > g_player.maxHp) {
-                g_player.hp = g_player.maxHp;
+    for (uint32_t i = 0; i < roomCount; i++) {
+        if (!defined[i]) {
+            fprintf(stderr, "world: room %u is missing\n", i);
+            goto fail;
+        }
+        for (int d = 0; d < DIR_COUNT; d++) {
+            if (exits[i * DIR_COUNT + d] >= (int32_t)roomCount) {
+                fprintf(stderr, "world: room %u has an exit to unknown room %d\n",
+                        i, exits[i * DIR_COUNT + d]);
+                goto fail;
             }
-            printf("You used %s. It restored %d HP. HP is now %d/%d.\n",
-                   item.name,
-                   item.power,
-                   g_player.hp,
-                   g_player.maxHp);
         }
-        
-        removeItemFromInventory(inv, index);
-    } else {
-        printf("You can't 'use' that item directly.\n");
     }
-}
 
-/* COMMAND: help */
-void doHelp() {
-    printf("Available commands:\n");
-    printf("  look               - Look around the room\n");
-    printf("  go <direction>     - Move to another room (north, south, east, west, up, down)\n");
-    printf("  take <item>        - Pick up an item from the ground\n");
-    printf("  drop <item>        - Drop an item onto the ground\n");
-    printf("  inventory (inv)    - Show your inventory\n");
-    printf("  stats              - Show player stats\n");
-    printf("  attack             - Attack a monster if present\n");
-    printf("  use <item>         - Use an item (e.g., potion)\n");
-    printf("  save               - Save the game\n");
-    printf("  load               - Load the game\n");
-    printf("  help               - Show this help text\n");
-    printf("  quit / exit        - Quit the game\n");
+    /* Lay out the image */
+    WorldHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WORLD_MAGIC, sizeof(WORLD_MAGIC));
+    hdr.version = WORLD_VERSION;
+    hdr.byteOrder = WORLD_BYTE_ORDER;
+    hdr.roomCount = roomCount;
+    hdr.itemCount = (uint32_t)(items.len / sizeof(WorldItem));
+    hdr.exitsOffset = sizeof(WorldHeader);
+    hdr.roomsOffset = hdr.exitsOffset + (uint64_t)roomCount * DIR_COUNT * sizeof(int32_t);
+    hdr.itemsOffset = hdr.roomsOffset + (uint64_t)roomCount * sizeof(WorldRoom);
+    hdr.stringsOffset = hdr.itemsOffset + items.len;
+    hdr.stringsSize = strings.bytes.len;
+
+    size_t size = (size_t)(hdr.stringsOffset + hdr.stringsSize);
+    unsigned char *image = malloc(size);
+    if (!image) {
+        fprintf(stderr, "world: out of memory\n");
+        goto fail;
+    }
+    memcpy(image, &hdr, sizeof(hdr));
+    memcpy(image + hdr.exitsOffset, exits, (size_t)roomCount * DIR_COUNT * sizeof(int32_t));
+    memcpy(image + hdr.roomsOffset, rooms, (size_t)roomCount * sizeof(WorldRoom));
+    if (items.len) {
+        memcpy(image + hdr.itemsOffset, items.data, items.len);
+    }
+    memcpy(image + hdr.stringsOffset, strings.bytes.data, strings.bytes.len);
+    *imageOut = image;
+    *sizeOut = size;
+    ok = 1;
+
+fail:
+    free(rooms);
+    free(exits);
+    free(defined);
+    free(items.data);
+    free(strings.bytes.data);
+    free(strings.slots);
+    return ok;
 }
 
-/* COMMAND: save */
-void doSave() {
-    FILE *f = fopen(SAVE_FILE_NAME, "wb");
+/* Read a whole file into memory */
+static char *readWholeFile(const char *path, size_t *lenOut) {
+    FILE *f = fopen(path, "rb");
     if (!f) {
-        printf("Failed to save the game.\n");
+        return NULL;
+    }
+    ByteBuf b = { 0 };
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (!bufAppend(&b, chunk, n)) {
+            free(b.data);
+            fclose(f);
+            return NULL;
+        }
+    }
+    fclose(f);
+    *lenOut = b.len;
+    return b.data ? (char *)b.data : calloc(1, 1);
+}
+
+/* Offline step: compile a world text file into an image file */
+int compileWorldFile(const char *textPath, const char *imagePath) {
+    size_t len;
+    char *text = readWholeFile(textPath, &len);
+    if (!text) {
+        perror(textPath);
+        return 1;
+    }
+
+    unsigned char *image;
+    size_t size;
+    int ok = compileWorld(text, len, &image, &size);
+    free(text);
+    if (!ok) {
+        return 1;
+    }
+
+    FILE *f = fopen(imagePath, "wb");
+    if (!f || fwrite(image, 1, size, f) != size || fclose(f) != 0) {
+        perror(imagePath);
+        free(image);
+        return 1;
+    }
+    printf("Compiled %u rooms into %s (%zu bytes).\n",
+           ((const WorldHeader *)image)->roomCount, imagePath, size);
+    free(image);
+    return 0;
+}
+
+/* Write a large grid-shaped world text file for testing */
+int generateWorldFile(int roomCount, const char *textPath) {
+    static const char *biomes[] = { "Plains", "Forest", "Hills", "Marsh" };
+    static const char *descs[] = {
+        "Tall grass ripples in the wind as far as the eye can see.",
+        "Ancient trees crowd together, their branches blotting out the sky.",
+        "Rolling hills rise and fall around you.",
+        "The ground squelches underfoot and mist hangs over stagnant pools.",
+    };
+    if (roomCount <= 0) {
+        fprintf(stderr, "Room count must be positive.\n");
+        return 1;
+    }
+    FILE *f = fopen(textPath, "w");
+    if (!f) {
+        perror(textPath);
+        return 1;
+    }
+
+    int width = 1;
+    while ((long)width * width < roomCount) {
+        width++;
+    }
+    for (int i = 0; i < roomCount; i++) {
+        int x = i % width;
+        int y = i / width;
+        int biome = ((x >> 4) + (y >> 4)) & 3;
+        if (i == 0) {
+            fprintf(f, "room 0 Town Square\n");
+            fprintf(f, "desc You are in a bustling town square. A fountain stands in the center.\n");
+        } else {
+            fprintf(f, "room %d %s %d-%d\n", i, biomes[biome], x, y);
+            fprintf(f, "desc %s\n", descs[biome]);
+        }
+        if (y > 0)                               fprintf(f, "exit north %d\n", i - width);
+        if (i + width < roomCount)               fprintf(f, "exit south %d\n", i + width);
+        if (x + 1 < width && i + 1 < roomCount)  fprintf(f, "exit east %d\n", i + 1);
+        if (x > 0)                               fprintf(f, "exit west %d\n", i - 1);
+        if (i % 7 == 3)  fprintf(f, "item potion 20 15 Health Potion\n");
+        if (i % 11 == 5) fprintf(f, "item potion 15 12 Mana Potion\n");
+        if (i % 53 == 9) fprintf(f, "item weapon 5 10 Rusty Sword\n");
+    }
+
+    if (fclose(f) != 0) {
+        perror(textPath);
+        return 1;
+    }
+    printf("Generated %d rooms (%dx%d grid) in %s.\n", roomCount, width, width, textPath);
+    return 0;
+}
+
+/* The rooms materialized now, in slabs of ROOM_CHUNK_SIZE found through
+ * g_roomSlot. The slots of evicted rooms are handed out again, so with a
+ * budget the slabs stop growing once it is reached. */
+static struct {
+    pthread_mutex_t lock;   /* slabs and the free list */
+    Room   **slabs;         /* one pointer per ROOM_CHUNK_SIZE rooms of the world */
+    uint32_t slabCount;
+    uint32_t freeList;      /* slot + 1, chained through Room.poolNext */
+    uint32_t resident;      /* rooms materialized now */
+} g_roomStore = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Check an image's header and table bounds, then make it the current world.
+ * The image is used in place and must outlive the game. */
+int attachWorldImage(const void *image, size_t size) {
+    const WorldHeader *hdr = image;
+    if (size < sizeof(WorldHeader) || memcmp(hdr->magic, WORLD_MAGIC, sizeof(WORLD_MAGIC)) != 0) {
+        fprintf(stderr, "Not a world image.\n");
+        return 0;
+    }
+    if (hdr->byteOrder != WORLD_BYTE_ORDER || hdr->version != WORLD_VERSION) {
+        fprintf(stderr, "Unsupported world image (version %u); recompile it with --compile-world.\n",
+                hdr->version);
+        return 0;
+    }
+    if (hdr->roomCount == 0 || hdr->roomCount >= INT32_MAX / 2 ||
+        hdr->exitsOffset % 4 || hdr->roomsOffset % 4 || hdr->itemsOffset % 4 ||
+        hdr->exitsOffset + (uint64_t)hdr->roomCount * DIR_COUNT * sizeof(int32_t) > size ||
+        hdr->roomsOffset + (uint64_t)hdr->roomCount * sizeof(WorldRoom) > size ||
+        hdr->itemsOffset + (uint64_t)hdr->itemCount * sizeof(WorldItem) > size ||
+        hdr->stringsSize == 0 || hdr->stringsOffset > size ||
+        hdr->stringsSize > size - hdr->stringsOffset ||
+        ((const char *)image)[hdr->stringsOffset + hdr->stringsSize - 1] != '\0') {
+        fprintf(stderr, "World image is corrupt.\n");
+        return 0;
+    }
+
+    /* Hot arrays are zero-filled on demand by the kernel, so untouched
+     * parts of a large world cost no memory. */
+    size_t chunks = ((size_t)hdr->roomCount + ROOM_CHUNK_SIZE - 1) >> ROOM_CHUNK_SHIFT;
+    Room **roomSlabs = calloc(chunks, sizeof(Room *));
+    uint8_t *flags = calloc(hdr->roomCount, sizeof(uint8_t));
+    uint32_t *slots = calloc(hdr->roomCount, sizeof(uint32_t));
+    uint64_t *spill = calloc(hdr->roomCount, sizeof(uint64_t));
+    uint16_t *monsters = calloc(hdr->roomCount, sizeof(uint16_t));
+    uint16_t *occupants = calloc(hdr->roomCount, sizeof(uint16_t));
+    Session **players = calloc(hdr->roomCount, sizeof(Session *));
+    int regionCount = (int)(((size_t)hdr->roomCount + (1u << REGION_SHIFT) - 1) >> REGION_SHIFT);
+    Region *regions = calloc((size_t)regionCount, sizeof(Region));
+    if (!roomSlabs || !flags || !slots || !spill || !monsters || !occupants || !players ||
+        !regions) {
+        free(roomSlabs);
+        free(flags);
+        free(slots);
+        free(spill);
+        free(monsters);
+        free(occupants);
+        free(players);
+        free(regions);
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    for (int i = 0; i < regionCount; i++) {
+        pthread_mutex_init(&regions[i].lock, NULL);
+        rngSeed(&regions[i].rng, g_seed, (uint64_t)i);
+    }
+
+    g_world = hdr;
+    g_roomExits = (const int32_t *)((const char *)image + hdr->exitsOffset);
+    g_roomFlags = flags;
+    g_roomSlot = slots;
+    g_roomSpill = spill;
+    g_roomMonsterHead = monsters;
+    g_roomOccupants = occupants;
+    g_roomPlayers = players;
+    g_regions = regions;
+    g_regionCount = regionCount;
+    g_worldRooms = (const WorldRoom *)((const char *)image + hdr->roomsOffset);
+    g_worldItems = (const WorldItem *)((const char *)image + hdr->itemsOffset);
+    g_worldStrings = (const char *)image + hdr->stringsOffset;
+    g_roomStore.slabs = roomSlabs;
+    g_roomCount = (int)hdr->roomCount;
+    exitGraphChanged();
+    return 1;
+}
+
+/* Map a compiled world image read-only. The pages are shared with every
+ * other process mapping the same file. */
+int mapWorldFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        fprintf(stderr, "%s: empty or unreadable world image\n", path);
+        close(fd);
+        return 0;
+    }
+    void *image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+    if (!attachWorldImage(image, (size_t)st.st_size)) {
+        munmap(image, (size_t)st.st_size);
+        return 0;
+    }
+    return 1;
+}
+
+/* Names that arrive at run time (from saves and the journal) are kept
+ * here, once each, for the life of the process. */
+static const char **g_nameSlots = NULL;
+static size_t       g_nameSlotCount = 0;
+static size_t       g_nameCount = 0;
+static pthread_mutex_t g_nameLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *internNameLocked(const char *name) {
+    if ((g_nameCount + 1) * 2 > g_nameSlotCount) {
+        size_t newCount = g_nameSlotCount ? g_nameSlotCount * 2 : 64;
+        const char **slots = calloc(newCount, sizeof(char *));
+        if (!slots) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < g_nameSlotCount; i++) {
+            if (g_nameSlots[i]) {
+                size_t j = hashBytes(g_nameSlots[i], strlen(g_nameSlots[i])) & (newCount - 1);
+                while (slots[j]) {
+                    j = (j + 1) & (newCount - 1);
+                }
+                slots[j] = g_nameSlots[i];
+            }
+        }
+        free(g_nameSlots);
+        g_nameSlots = slots;
+        g_nameSlotCount = newCount;
+    }
+    size_t j = hashBytes(name, strlen(name)) & (g_nameSlotCount - 1);
+    while (g_nameSlots[j]) {
+        if (strcmp(g_nameSlots[j], name) == 0) {
+            return g_nameSlots[j];
+        }
+        j = (j + 1) & (g_nameSlotCount - 1);
+    }
+    char *copy = strdup(name);
+    if (!copy) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    g_nameSlots[j] = copy;
+    g_nameCount++;
+    return copy;
+}
+
+/* Return the pooled copy of a name, adding it if needed. Exits if memory
+ * runs out. */
+const char *internName(const char *name) {
+    pthread_mutex_lock(&g_nameLock);
+    const char *pooled = internNameLocked(name);
+    pthread_mutex_unlock(&g_nameLock);
+    return pooled;
+}
+
+/* Item registry: every distinct item (name, type, power, value) is stored
+ * once and never changes; containers refer to it by ItemId. The array is
+ * reserved at full size up front so that it never moves under a reader on
+ * another thread; only the pages in use are ever touched. */
+static Item     *g_items = NULL;
+static int       g_itemCount = 0;
+static pthread_mutex_t g_itemLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *g_itemSlots = NULL;      /* open addressing: id + 1, 0 = empty */
+static size_t    g_itemSlotCount = 0;
+
+static uint64_t itemHash(const Item *item) {
+    uint64_t h = hashBytes(item->name, strlen(item->name));
+    uint32_t fields[3] = { (uint32_t)item->type, (uint32_t)item->power, (uint32_t)item->value };
+    return h ^ hashBytes(fields, sizeof(fields));
+}
+
+static int itemSlotsGrow() {
+    size_t newCount = g_itemSlotCount ? g_itemSlotCount * 2 : 256;
+    uint32_t *slots = calloc(newCount, sizeof(uint32_t));
+    if (!slots) {
+        return 0;
+    }
+    for (int id = 0; id < g_itemCount; id++) {
+        size_t j = itemHash(&g_items[id]) & (newCount - 1);
+        while (slots[j]) {
+            j = (j + 1) & (newCount - 1);
+        }
+        slots[j] = (uint32_t)id + 1;
+    }
+    free(g_itemSlots);
+    g_itemSlots = slots;
+    g_itemSlotCount = newCount;
+    return 1;
+}
+
+static int internItemLocked(const Item *proto, int copyName) {
+    if (!g_items && !(g_items = calloc(MAX_ITEM_PROTOS, sizeof(Item)))) {
+        return -1;
+    }
+    if ((size_t)(g_itemCount + 1) * 2 > g_itemSlotCount && !itemSlotsGrow()) {
+        return -1;
+    }
+    size_t j = itemHash(proto) & (g_itemSlotCount - 1);
+    while (g_itemSlots[j]) {
+        const Item *other = &g_items[g_itemSlots[j] - 1];
+        if (other->type == proto->type && other->power == proto->power &&
+            other->value == proto->value && strcmp(other->name, proto->name) == 0) {
+            return (int)g_itemSlots[j] - 1;
+        }
+        j = (j + 1) & (g_itemSlotCount - 1);
+    }
+    if (g_itemCount >= MAX_ITEM_PROTOS) {
+        return -1;
+    }
+    Item *item = &g_items[g_itemCount];
+    *item = *proto;
+    if (copyName) {
+        item->name = internName(proto->name);
+    }
+    item->nameHash = itemNameHash(item->name, strlen(item->name));
+    g_itemSlots[j] = (uint32_t)g_itemCount + 1;
+    return g_itemCount++;
+}
+
+/* Return the id of an item, registering it if it is new. The name is used
+ * in place (it must outlive the game, like world image strings) unless
+ * copyName is set. Returns -1 if the registry is full. */
+int internItem(const Item *proto, int copyName) {
+    pthread_mutex_lock(&g_itemLock);
+    int id = internItemLocked(proto, copyName);
+    pthread_mutex_unlock(&g_itemLock);
+    return id;
+}
+
+/* The prototype behind an item handle */
+const Item *itemProto(ItemId id) {
+    return &g_items[id];
+}
+
+/* String from the world image's string table */
+static const char *worldString(uint32_t off) {
+    return off < g_world->stringsSize ? g_worldStrings + off : "";
+}
+
+/* Point a room at its immutable data in the world image */
+void bindRoom(Room *room, int index) {
+    const WorldRoom *wr = &g_worldRooms[index];
+    room->id = index;
+    room->name = worldString(wr->nameOff);
+    room->description = worldString(wr->descOff);
+}
+
+/* The region a room belongs to */
+Region *regionOf(int room) {
+    return &g_regions[room >> REGION_SHIFT];
+}
+
+/* Room reached by leaving `room` in direction `dir`, or -1 */
+int roomExit(int room, int dir) {
+    int32_t e = g_roomExits[(size_t)room * DIR_COUNT + dir];
+    return (e >= 0 && e < g_roomCount) ? e : -1;
+}
+
+static Monster *poolSlot(MonsterPool *pool, uint32_t slot1) {
+    uint32_t slot = slot1 - 1;
+    return &pool->slabs[slot / MONSTER_SLAB_SIZE][slot % MONSTER_SLAB_SIZE];
+}
+
+/* Take a monster from a region's pool, adding a slab if every slot is in
+ * use. Returns NULL once the pool is at MONSTER_POOL_SLABS. */
+static Monster *poolAlloc(MonsterPool *pool) {
+    if (!pool->freeList) {
+        if (pool->slabCount == MONSTER_POOL_SLABS) {
+            return NULL;
+        }
+        Monster *slab = calloc(MONSTER_SLAB_SIZE, sizeof(Monster));
+        if (!slab) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        uint32_t base = (uint32_t)pool->slabCount * MONSTER_SLAB_SIZE;
+        for (int i = MONSTER_SLAB_SIZE - 1; i >= 0; i--) {
+            slab[i].room = -1;
+            slab[i].self = (uint16_t)(base + (uint32_t)i + 1);
+            slab[i].next = pool->freeList;
+            pool->freeList = slab[i].self;
+        }
+        pool->slabs[pool->slabCount++] = slab;
+    }
+    Monster *m = poolSlot(pool, pool->freeList);
+    pool->freeList = m->next;
+    m->next = 0;
+    pool->live++;
+    return m;
+}
+
+/* Return a monster to its pool; handles to it stop resolving */
+static void poolFree(MonsterPool *pool, Monster *m) {
+    m->room = -1;
+    m->gen++;
+    m->next = pool->freeList;
+    pool->freeList = m->self;
+    pool->live--;
+}
+
+/* First monster in a room, living or dead, or NULL. The room must have
+ * been materialized with getRoom. */
+Monster *firstMonster(int room) {
+    uint16_t head = g_roomMonsterHead[room];
+    return head ? poolSlot(&regionOf(room)->monsters, head) : NULL;
+}
+
+/* The monster after `m` in its room, or NULL */
+Monster *nextMonster(const Monster *m) {
+    return m->next ? poolSlot(&regionOf(m->room)->monsters, m->next) : NULL;
+}
+
+/* Add a copy of `proto` at the end of a room's monsters. Returns it, or
+ * NULL if the room already has MAX_ROOM_MONSTERS or the pool is full. */
+Monster *addRoomMonster(int room, const Monster *proto) {
+    Monster *tail = NULL;
+    int count = 0;
+    for (Monster *m = firstMonster(room); m; m = nextMonster(m)) {
+        tail = m;
+        count++;
+    }
+    if (count >= MAX_ROOM_MONSTERS) {
+        return NULL;
+    }
+    Monster *m = poolAlloc(&regionOf(room)->monsters);
+    if (!m) {
+        return NULL;
+    }
+    m->name = proto->name;
+    m->level = proto->level;
+    m->hp = proto->hp;
+    m->maxHp = proto->maxHp;
+    m->attackPower = proto->attackPower;
+    m->state = proto->state;
+    m->room = room;
+    if (tail) {
+        tail->next = m->self;
+    } else {
+        g_roomMonsterHead[room] = m->self;
+    }
+    roomChanged(room);
+    return m;
+}
+
+/* Take a monster out of its room and give its slot back to the pool */
+void removeRoomMonster(Monster *m) {
+    int room = m->room;
+    MonsterPool *pool = &regionOf(room)->monsters;
+    uint16_t *link = &g_roomMonsterHead[room];
+    while (*link != m->self) {
+        link = &poolSlot(pool, *link)->next;
+    }
+    *link = m->next;
+    poolFree(pool, m);
+    roomChanged(room);
+}
+
+/* Move a monster to the end of another room's list in the same region.
+ * It keeps its pool slot, so handles to it stay valid. Returns 0 if that
+ * room already has MAX_ROOM_MONSTERS. */
+int moveRoomMonster(Monster *m, int to) {
+    Monster *tail = NULL;
+    int count = 0;
+    for (Monster *o = firstMonster(to); o; o = nextMonster(o)) {
+        tail = o;
+        count++;
+    }
+    if (count >= MAX_ROOM_MONSTERS) {
+        return 0;
+    }
+    int from = m->room;
+    MonsterPool *pool = &regionOf(from)->monsters;
+    uint16_t *link = &g_roomMonsterHead[from];
+    while (*link != m->self) {
+        link = &poolSlot(pool, *link)->next;
+    }
+    *link = m->next;
+    m->next = 0;
+    m->room = to;
+    if (tail) {
+        tail->next = m->self;
+    } else {
+        g_roomMonsterHead[to] = m->self;
+    }
+    roomChanged(from);
+    roomChanged(to);
+    return 1;
+}
+
+/* Replace a room's monsters (loading and replay). Dead ones get their
+ * respawn timer back. */
+void setRoomMonsters(int room, const Monster *list, int count) {
+    Monster *m;
+    while ((m = firstMonster(room)) != NULL) {
+        removeRoomMonster(m);
+    }
+    for (int i = 0; i < count; i++) {
+        if (addRoomMonster(room, &list[i]) && list[i].state == MONSTER_DEAD) {
+            scheduleRespawn(room);
+        }
+    }
+}
+
+MonsterRef monsterRef(const Monster *m) {
+    return (MonsterRef)m->self << 16 | m->gen;
+}
+
+/* The monster a handle names, if it still exists and is in `room` */
+Monster *monsterFromRef(int room, MonsterRef ref) {
+    MonsterPool *pool = &regionOf(room)->monsters;
+    uint32_t slot1 = ref >> 16;
+    if (slot1 == 0 || slot1 > (uint32_t)pool->slabCount * MONSTER_SLAB_SIZE) {
+        return NULL;
+    }
+    Monster *m = poolSlot(pool, slot1);
+    return m->gen == (uint16_t)ref && m->room == room ? m : NULL;
+}
+
+/* Something `look` shows in a room changed (floor items, or its monster's
+ * state or HP): the cached view is rendered again on the next look, and
+ * the room is written back if it is evicted */
+void roomChanged(int room) {
+    g_roomFlags[room] = (uint8_t)((g_roomFlags[room] & ~ROOM_VIEW) | ROOM_DIRTY);
+}
+
+/* A player moved from one room to another; -1 for entering or leaving
+ * the game. Each room keeps its players in a list linked through the
+ * sessions, so reaching them costs nothing per player elsewhere. The
+ * list head is stored atomically: neighbouring regions peek at it to see
+ * whether a room is worth sending an event to. Each region keeps a list
+ * of its players the same way, for chat. Moves between regions come here
+ * twice (leaving, then arriving), each time on the region's own worker. */
+void moveOccupant(Session *s, int from, int to) {
+    Region *fromRegion = from >= 0 ? regionOf(from) : NULL;
+    Region *toRegion = to >= 0 ? regionOf(to) : NULL;
+    if (fromRegion && fromRegion != toRegion) {
+        if (s->regionPrev) {
+            s->regionPrev->regionNext = s->regionNext;
+        } else {
+            __atomic_store_n(&fromRegion->players, s->regionNext, __ATOMIC_RELAXED);
+        }
+        if (s->regionNext) {
+            s->regionNext->regionPrev = s->regionPrev;
+        }
+        s->regionNext = s->regionPrev = NULL;
+    }
+    if (toRegion && toRegion != fromRegion) {
+        s->regionNext = toRegion->players;
+        if (s->regionNext) {
+            s->regionNext->regionPrev = s;
+        }
+        __atomic_store_n(&toRegion->players, s, __ATOMIC_RELAXED);
+    }
+
+    if (from >= 0) {
+        if (g_roomOccupants[from] > 0) {
+            g_roomOccupants[from]--;
+        }
+        if (s->roomPrev) {
+            s->roomPrev->roomNext = s->roomNext;
+        } else {
+            __atomic_store_n(&g_roomPlayers[from], s->roomNext, __ATOMIC_RELAXED);
+        }
+        if (s->roomNext) {
+            s->roomNext->roomPrev = s->roomPrev;
+        }
+        s->roomNext = s->roomPrev = NULL;
+    }
+    if (to >= 0) {
+        if (g_roomOccupants[to] < UINT16_MAX) {
+            g_roomOccupants[to]++;
+        }
+        s->roomNext = g_roomPlayers[to];
+        if (s->roomNext) {
+            s->roomNext->roomPrev = s;
+        }
+        __atomic_store_n(&g_roomPlayers[to], s, __ATOMIC_RELAXED);
+        prefetchNeighbours(to);
+    }
+}
+
+static Room *roomSlotPtr(uint32_t slot1) {
+    uint32_t slot = slot1 - 1;
+    return &g_roomStore.slabs[slot >> ROOM_CHUNK_SHIFT][slot & (ROOM_CHUNK_SIZE - 1)];
+}
+
+/* Give a room an empty slot in the store */
+static Room *roomAlloc(int index) {
+    pthread_mutex_lock(&g_roomStore.lock);
+    if (!g_roomStore.freeList) {
+        Room *slab = calloc(ROOM_CHUNK_SIZE, sizeof(Room));
+        if (!slab) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        uint32_t base = g_roomStore.slabCount << ROOM_CHUNK_SHIFT;
+        for (int i = ROOM_CHUNK_SIZE - 1; i >= 0; i--) {
+            slab[i].poolNext = g_roomStore.freeList;
+            g_roomStore.freeList = base + (uint32_t)i + 1;
+        }
+        g_roomStore.slabs[g_roomStore.slabCount++] = slab;
+    }
+    uint32_t slot = g_roomStore.freeList;
+    Room *room = roomSlotPtr(slot);
+    g_roomStore.freeList = room->poolNext;
+    __atomic_add_fetch(&g_roomStore.resident, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_roomStore.lock);
+
+    memset(room, 0, sizeof(*room));
+    __atomic_store_n(&g_roomSlot[index], slot, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&regionOf(index)->rooms, 1, __ATOMIC_RELAXED);
+    return room;
+}
+
+/* Give an evicted room's slot back to the store */
+static void roomFree(int index) {
+    uint32_t slot = g_roomSlot[index];
+    __atomic_store_n(&g_roomSlot[index], 0, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&regionOf(index)->rooms, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&g_roomStore.lock);
+    roomSlotPtr(slot)->poolNext = g_roomStore.freeList;
+    g_roomStore.freeList = slot;
+    __atomic_sub_fetch(&g_roomStore.resident, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_roomStore.lock);
+}
+
+/* Return a room, materializing it on first use. A room that was evicted
+ * comes back from the spill file; one never seen before comes from the
+ * world image: its starting items are placed and monsters may spawn. */
+Room *getRoom(int index) {
+    uint32_t slot = g_roomSlot[index];
+    if (slot) {
+        g_roomFlags[index] |= ROOM_REFERENCED;
+        return roomSlotPtr(slot);
+    }
+
+    Room *room = roomAlloc(index);
+    bindRoom(room, index);
+    g_roomFlags[index] |= ROOM_LOADED | ROOM_REFERENCED;
+    if (g_roomSpill[index]) {
+        unspillRoom(room, index);
+        return room;
+    }
+
+    const WorldRoom *wr = &g_worldRooms[index];
+    if (wr->firstItem <= g_world->itemCount && wr->itemCount <= g_world->itemCount - wr->firstItem) {
+        for (uint32_t i = 0; i < wr->itemCount && room->ground.count < MAX_INVENTORY_SIZE; i++) {
+            const WorldItem *wi = &g_worldItems[wr->firstItem + i];
+            Item proto;
+            proto.name = worldString(wi->nameOff);
+            proto.type = wi->type <= ITEM_MISC ? (ItemType)wi->type : ITEM_MISC;
+            proto.power = wi->power;
+            proto.value = wi->value;
+            int id = internItem(&proto, 0);
+            if (id < 0) {
+                fprintf(stderr, "Too many distinct items.\n");
+                exit(1);
+            }
+            addItemToInventory(&room->ground, (ItemId)id);
+        }
+    }
+    initMonsters(index);
+    g_roomFlags[index] |= ROOM_DIRTY; /* its monsters exist nowhere else */
+    journalRoomMonsters(index);
+    return room;
+}
+
+/*****************************************************************************
+ * ROUTES
+ *
+ * `travel <room name>` needs two things the world image does not have: a
+ * way to find a room by name, and shortest routes over the exit graph.
+ *
+ * Room names are indexed in an open-addressing table keyed by the same
+ * case-folded hash as item names. Routes come from an A* search whose
+ * estimate uses ROUTE_LANDMARKS hub rooms, picked spread out across the
+ * world: every room stores its distance from and to each hub, and by the
+ * triangle inequality no route from v to t can be shorter than
+ * d(hub, t) - d(hub, v) or d(v, hub) - d(t, hub). The estimate is exact for
+ * many pairs, so the search mostly walks straight down the route instead
+ * of flooding the world the way a breadth-first search would.
+ *
+ * Both are built on the first travel, and again only after the exit graph
+ * changes (exitGraphChanged); the graph only changes while no session is
+ * running, when a world is attached. Found routes are kept in a direct-
+ * mapped cache keyed by their end rooms, so trips between busy places are
+ * answered without a search.
+ *****************************************************************************/
+
+/* A route found earlier */
+typedef struct {
+    int32_t  from;
+    int32_t  to;
+    uint32_t version;       /* exit graph the route was found on */
+    uint32_t len;
+    uint8_t *dirs;          /* Direction per step */
+} CachedRoute;
+
+/* Search state of one room, valid while stamp matches the search */
+typedef struct {
+    uint32_t stamp;
+    uint32_t g;             /* steps from the start */
+    int32_t  parent;
+    uint8_t  dir;           /* taken from parent to here */
+    uint8_t  closed;
+} RouteNode;
+
+typedef struct {
+    uint64_t key;           /* estimate << 32 | ~steps: longer routes first on ties */
+    int32_t  room;
+} RouteOpen;
+
+static struct {
+    pthread_mutex_t lock;              /* building, and the cache */
+    uint32_t  graphVersion;            /* bumped by exitGraphChanged */
+    uint32_t  builtVersion;            /* what the tables below are for */
+    int32_t  *nameSlots;               /* room, or -1 */
+    uint32_t  nameMask;
+    int       hubCount;
+    int32_t   hubs[ROUTE_LANDMARKS];
+    uint16_t *hubDist;                 /* [room][hub][from, to], saturated */
+    CachedRoute cache[ROUTE_CACHE_SLOTS];
+} g_routes = { .lock = PTHREAD_MUTEX_INITIALIZER, .graphVersion = 1 };
+
+static __thread RouteNode *t_routeNodes;
+static __thread int        t_routeNodeCount;
+static __thread uint32_t   t_routeStamp;
+static __thread RouteOpen *t_routeOpen;
+static __thread size_t     t_routeOpenCap;
+
+/* The exit graph changed: forget every route and rebuild the hub tables
+ * on the next travel */
+void exitGraphChanged() {
+    pthread_mutex_lock(&g_routes.lock);
+    g_routes.graphVersion++;
+    pthread_mutex_unlock(&g_routes.lock);
+}
+
+/* Breadth-first distances from `src` along exits (or against them, using
+ * the reverse graph `inStart`/`inRooms`), saturated at UINT16_MAX and
+ * stored every `stride` entries of `out`. */
+static void routeBfs(int src, const uint32_t *inStart, const int32_t *inRooms,
+                     uint16_t *out, int stride, int32_t *queue) {
+    for (int i = 0; i < g_roomCount; i++) {
+        out[(size_t)i * stride] = UINT16_MAX;
+    }
+    size_t head = 0, tail = 0;
+    out[(size_t)src * stride] = 0;
+    queue[tail++] = src;
+    while (head < tail) {
+        int room = queue[head++];
+        uint16_t d = out[(size_t)room * stride];
+        uint16_t nd = d < UINT16_MAX - 1 ? (uint16_t)(d + 1) : UINT16_MAX - 1;
+        if (inStart) {
+            for (uint32_t e = inStart[room]; e < inStart[room + 1]; e++) {
+                int next = inRooms[e];
+                if (out[(size_t)next * stride] == UINT16_MAX) {
+                    out[(size_t)next * stride] = nd;
+                    queue[tail++] = next;
+                }
+            }
+        } else {
+            for (int dir = 0; dir < DIR_COUNT; dir++) {
+                int next = roomExit(room, dir);
+                if (next >= 0 && out[(size_t)next * stride] == UINT16_MAX) {
+                    out[(size_t)next * stride] = nd;
+                    queue[tail++] = next;
+                }
+            }
+        }
+    }
+}
+
+static void freeRouteTables() {
+    free(g_routes.nameSlots);
+    free(g_routes.hubDist);
+    g_routes.nameSlots = NULL;
+    g_routes.hubDist = NULL;
+    for (int i = 0; i < ROUTE_CACHE_SLOTS; i++) {
+        free(g_routes.cache[i].dirs);
+        g_routes.cache[i].dirs = NULL;
+        g_routes.cache[i].len = 0;
+        g_routes.cache[i].version = 0;
+    }
+}
+
+/* Build the name index and the hub distances for the current world.
+ * Called with g_routes.lock held. */
+static void buildRouteTables() {
+    freeRouteTables();
+    size_t n = (size_t)g_roomCount;
+    size_t slots = 16;
+    while (slots < 2 * n) {
+        slots *= 2;
+    }
+    int hubs = g_roomCount < ROUTE_LANDMARKS ? g_roomCount : ROUTE_LANDMARKS;
+    int32_t *nameSlots = malloc(slots * sizeof(int32_t));
+    uint16_t *hubDist = malloc(n * 2 * (size_t)hubs * sizeof(uint16_t));
+    uint32_t *inStart = calloc(n + 1, sizeof(uint32_t));
+    int32_t *inRooms = malloc(n * DIR_COUNT * sizeof(int32_t));
+    int32_t *queue = malloc(n * sizeof(int32_t));
+    uint16_t *nearest = malloc(n * sizeof(uint16_t)); /* to the closest hub so far */
+    if (!nameSlots || !hubDist || !inStart || !inRooms || !queue || !nearest) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    /* Names: the lowest-numbered room wins when names repeat */
+    memset(nameSlots, 0xff, slots * sizeof(int32_t));
+    for (int room = 0; room < g_roomCount; room++) {
+        const char *name = worldString(g_worldRooms[room].nameOff);
+        size_t i = itemNameHash(name, strlen(name)) & (slots - 1);
+        while (nameSlots[i] >= 0 &&
+               strcasecmp(worldString(g_worldRooms[nameSlots[i]].nameOff), name) != 0) {
+            i = (i + 1) & (slots - 1);
+        }
+        if (nameSlots[i] < 0) {
+            nameSlots[i] = room;
+        }
+    }
+
+    /* Reverse exit graph, for distances to the hubs */
+    for (int room = 0; room < g_roomCount; room++) {
+        for (int dir = 0; dir < DIR_COUNT; dir++) {
+            int next = roomExit(room, dir);
+            if (next >= 0) {
+                inStart[next + 1]++;
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        inStart[i + 1] += inStart[i];
+    }
+    uint32_t *fill = malloc(n * sizeof(uint32_t));
+    if (!fill) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(fill, inStart, n * sizeof(uint32_t));
+    for (int room = 0; room < g_roomCount; room++) {
+        for (int dir = 0; dir < DIR_COUNT; dir++) {
+            int next = roomExit(room, dir);
+            if (next >= 0) {
+                inRooms[fill[next]++] = room;
+            }
+        }
+    }
+    free(fill);
+
+    /* Hubs, farthest first: each new hub is the room farthest from all
+     * the hubs so far (starting from the room farthest from room 0) */
+    int stride = 2 * hubs;
+    routeBfs(0, NULL, NULL, nearest, 1, queue);
+    for (int h = 0; h < hubs; h++) {
+        int best = 0;
+        for (int room = 1; room < g_roomCount; room++) {
+            if (nearest[room] != UINT16_MAX && nearest[room] > nearest[best]) {
+                best = room;
+            }
+        }
+        g_routes.hubs[h] = best;
+        routeBfs(best, NULL, NULL, hubDist + 2 * h, stride, queue);
+        routeBfs(best, inStart, inRooms, hubDist + 2 * h + 1, stride, queue);
+        for (size_t room = 0; room < n; room++) {
+            uint16_t d = hubDist[room * (size_t)stride + 2 * h];
+            if (h == 0 || d < nearest[room]) {
+                nearest[room] = d;
+            }
+        }
+    }
+
+    free(inStart);
+    free(inRooms);
+    free(queue);
+    free(nearest);
+    g_routes.nameSlots = nameSlots;
+    g_routes.nameMask = (uint32_t)(slots - 1);
+    g_routes.hubCount = hubs;
+    g_routes.hubDist = hubDist;
+    g_routes.builtVersion = g_routes.graphVersion;
+}
+
+/* Make sure the tables match the current exit graph */
+static void routeTablesReady() {
+    pthread_mutex_lock(&g_routes.lock);
+    if (g_routes.builtVersion != g_routes.graphVersion) {
+        buildRouteTables();
+    }
+    pthread_mutex_unlock(&g_routes.lock);
+}
+
+/* Index of the room with this name (any case), or -1. When several rooms
+ * share a name, the lowest-numbered one. */
+int getRoomIndexByName(const char *roomName) {
+    routeTablesReady();
+    uint32_t i = itemNameHash(roomName, strlen(roomName)) & g_routes.nameMask;
+    for (int32_t room; (room = g_routes.nameSlots[i]) >= 0; i = (i + 1) & g_routes.nameMask) {
+        if (strcasecmp(worldString(g_worldRooms[room].nameOff), roomName) == 0) {
+            return room;
+        }
+    }
+    return -1;
+}
+
+/* Fewest steps a route from v to t can possibly take */
+static uint32_t routeEstimate(int v, int t) {
+    int stride = 2 * g_routes.hubCount;
+    const uint16_t *dv = g_routes.hubDist + (size_t)v * stride;
+    const uint16_t *dt = g_routes.hubDist + (size_t)t * stride;
+    uint32_t best = 0;
+    for (int k = 0; k < stride; k += 2) {
+        /* d(hub, t) - d(hub, v) and d(v, hub) - d(t, hub), where known */
+        if (dv[k] != UINT16_MAX && dt[k] != UINT16_MAX && dt[k] > dv[k] &&
+            (uint32_t)(dt[k] - dv[k]) > best) {
+            best = (uint32_t)(dt[k] - dv[k]);
+        }
+        if (dv[k + 1] != UINT16_MAX && dt[k + 1] != UINT16_MAX && dv[k + 1] > dt[k + 1] &&
+            (uint32_t)(dv[k + 1] - dt[k + 1]) > best) {
+            best = (uint32_t)(dv[k + 1] - dt[k + 1]);
+        }
+    }
+    return best;
+}
+
+static int routeOpenPush(size_t *count, uint64_t key, int room) {
+    if (*count == t_routeOpenCap) {
+        size_t cap = t_routeOpenCap ? t_routeOpenCap * 2 : 1024;
+        RouteOpen *open = realloc(t_routeOpen, cap * sizeof(RouteOpen));
+        if (!open) {
+            return 0;
+        }
+        t_routeOpen = open;
+        t_routeOpenCap = cap;
+    }
+    RouteOpen *heap = t_routeOpen;
+    size_t i = (*count)++;
+    while (i > 0 && heap[(i - 1) / 2].key > key) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i].key = key;
+    heap[i].room = room;
+    return 1;
+}
+
+static RouteOpen routeOpenPop(size_t *count) {
+    RouteOpen *heap = t_routeOpen;
+    RouteOpen top = heap[0];
+    RouteOpen last = heap[--(*count)];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= *count) {
+            break;
+        }
+        if (child + 1 < *count && heap[child + 1].key < heap[child].key) {
+            child++;
+        }
+        if (heap[child].key >= last.key) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* A* from `from` to `to`. Returns the number of steps and a malloc'd
+ * array of directions in *dirsOut, or -1 if `to` cannot be reached. */
+static int routeSearch(int from, int to, uint8_t **dirsOut) {
+    if (t_routeNodeCount != g_roomCount) {
+        free(t_routeNodes);
+        /* calloc'd pages stay untouched until a search reaches them */
+        t_routeNodes = calloc((size_t)g_roomCount, sizeof(RouteNode));
+        if (!t_routeNodes) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        t_routeNodeCount = g_roomCount;
+        t_routeStamp = 0;
+    }
+    if (++t_routeStamp == 0) {
+        memset(t_routeNodes, 0, (size_t)g_roomCount * sizeof(RouteNode));
+        t_routeStamp = 1;
+    }
+    RouteNode *nodes = t_routeNodes;
+    uint32_t stamp = t_routeStamp;
+
+    size_t open = 0;
+    nodes[from] = (RouteNode){ stamp, 0, -1, 0, 0 };
+    if (!routeOpenPush(&open, (uint64_t)routeEstimate(from, to) << 32 | UINT32_MAX, from)) {
+        return -1;
+    }
+    while (open > 0) {
+        int room = routeOpenPop(&open).room;
+        RouteNode *node = &nodes[room];
+        if (node->closed) {
+            continue; /* reached again by a shorter route after being queued */
+        }
+        node->closed = 1;
+        if (room == to) {
+            break;
+        }
+        uint32_t g = node->g + 1;
+        for (int dir = 0; dir < DIR_COUNT; dir++) {
+            int next = roomExit(room, dir);
+            if (next < 0) {
+                continue;
+            }
+            RouteNode *nn = &nodes[next];
+            if (nn->stamp == stamp && (nn->closed || nn->g <= g)) {
+                continue;
+            }
+            *nn = (RouteNode){ stamp, g, room, (uint8_t)dir, 0 };
+            uint64_t f = (uint64_t)g + routeEstimate(next, to);
+            if (!routeOpenPush(&open, f << 32 | (uint32_t)~g, next)) {
+                return -1;
+            }
+        }
+    }
+    if (nodes[to].stamp != stamp || !nodes[to].closed) {
+        return -1;
+    }
+
+    int len = (int)nodes[to].g;
+    uint8_t *dirs = malloc(len ? (size_t)len : 1);
+    if (!dirs) {
+        return -1;
+    }
+    for (int room = to, i = len; room != from; room = nodes[room].parent) {
+        dirs[--i] = nodes[room].dir;
+    }
+    *dirsOut = dirs;
+    return len;
+}
+
+/* Shortest route from one room to another: the cached one if there is
+ * one, else a new search whose result is cached. Returns the number of
+ * steps with a malloc'd copy of the directions in *dirsOut, or -1 if
+ * there is no way there. */
+int findRoute(int from, int to, uint8_t **dirsOut) {
+    routeTablesReady();
+    uint32_t slot = (uint32_t)(((uint64_t)(uint32_t)from * 0x9e3779b97f4a7c15ull ^
+                                (uint32_t)to * 0xc2b2ae3d27d4eb4full) >> 32) & (ROUTE_CACHE_SLOTS - 1);
+    CachedRoute *c = &g_routes.cache[slot];
+
+    pthread_mutex_lock(&g_routes.lock);
+    if (c->version == g_routes.graphVersion && c->from == from && c->to == to) {
+        uint8_t *dirs = malloc(c->len ? c->len : 1);
+        int len = (int)c->len;
+        if (dirs) {
+            memcpy(dirs, c->dirs, c->len);
+        }
+        pthread_mutex_unlock(&g_routes.lock);
+        if (!dirs) {
+            return -1;
+        }
+        *dirsOut = dirs;
+        return len;
+    }
+    uint32_t version = g_routes.graphVersion;
+    pthread_mutex_unlock(&g_routes.lock);
+
+    uint8_t *dirs;
+    int len = routeSearch(from, to, &dirs);
+    if (len < 0) {
+        return -1;
+    }
+    uint8_t *copy = malloc(len ? (size_t)len : 1);
+    if (copy) {
+        memcpy(copy, dirs, (size_t)len);
+        pthread_mutex_lock(&g_routes.lock);
+        if (version == g_routes.graphVersion) {
+            free(c->dirs);
+            c->from = from;
+            c->to = to;
+            c->version = version;
+            c->len = (uint32_t)len;
+            c->dirs = copy;
+            copy = NULL;
+        }
+        pthread_mutex_unlock(&g_routes.lock);
+        free(copy);
+    }
+    *dirsOut = dirs;
+    return len;
+}
+
+/*****************************************************************************
+ * PERSISTENCE: JOURNAL & CHECKPOINTS
+ *
+ * Every change to game state is appended to the journal as a small record
+ * (item moved, monster changed, player stats changed). Records are buffered
+ * and written with a single write + fdatasync per group commit: when the
+ * buffer is JOURNAL_COMMIT_MS old or JOURNAL_COMMIT_BYTES big, or on 'save'.
+ * Once the journal passes JOURNAL_COMPACT_BYTES the full state is written
+ * to a new checkpoint and the journal starts over. Recovery loads the
+ * checkpoint and replays the journal records that follow it.
+ *
+ * Checkpoints are written in the background. The main thread pauses the
+ * workers just long enough to fork(); the child holds a copy-on-write
+ * image of the world as it was at that instant and serializes, fsyncs and
+ * renames the checkpoint at low priority while the game goes on. Records
+ * from then on go to a new journal, JOURNAL_NEXT_NAME, whose seq is the
+ * checkpoint's; once the child has exited cleanly it is renamed over the
+ * old journal. Until then recovery replays the old journal and the new one
+ * on top of the old checkpoint, or just the new one if the checkpoint made
+ * it to disk before a crash.
+ *
+ * Journal file: header (magic, version, seq), then records of
+ *     u8 type | u16 length | payload | u32 CRC-32 of the preceding bytes
+ * (the length is a single byte in journals before v4).
+ * A journal only applies to the checkpoint with the same seq, so a crash
+ * between writing a checkpoint and resetting the journal is harmless.
+ *
+ * Checkpoint (save) file, format v3, all integers little-endian:
+ *     "MUDSAVE\0" | u32 version | u32 reserved | record* | END record
+ *     record := u8 kind | u32 length | field*
+ *     field  := u8 id | u16 length | value (u32/u64, string, nested fields)
+ * One WORLD record comes first, then ROOM records. The END record holds
+ * the CRC-32 of every byte before it. Characters are kept in the player
+ * store (see PLAYER STORE), committed with the same seq just before the
+ * checkpoint. Older saves (raw structs in v0 and v1, characters as PLAYER
+ * records in v2) are converted the first time they are loaded.
+ *****************************************************************************/
+
+#define JOURNAL_HEADER_SIZE 24
+
+static struct {
+    int      fd;
+    uint64_t seq;
+    uint64_t size;            /* bytes already in the file */
+    ByteBuf  pending;         /* records not yet written */
+    ByteBuf  spare;           /* the other buffer, swapped in per commit */
+    uint64_t pendingSinceNs;
+    int      replaying;       /* applying records: don't log them again */
+    uint32_t version;         /* of the journal being replayed */
+    uint64_t lastSeed;        /* of the last run in the recovered state */
+    int      hasLastSeed;
+    uint64_t checkpointSeq;   /* of the checkpoint on disk */
+    pid_t    snapshotPid;     /* child writing a checkpoint, 0 = none */
+    int      rotating;        /* fd is JOURNAL_NEXT_NAME, not yet renamed */
+    pthread_mutex_t lock;     /* guards pending and pendingSinceNs */
+    pthread_mutex_t commitLock; /* one commit writes the file at a time */
+} g_journal = { .fd = -1, .version = JOURNAL_VERSION,
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .commitLock = PTHREAD_MUTEX_INITIALIZER };
+
+static PlayerTable g_playerTable;
+
+/* The player store's header, as of one commit */
+typedef struct {
+    uint64_t seq;             /* of the checkpoint it goes with */
+    uint64_t end;             /* records before this offset count */
+    uint64_t count;           /* characters */
+    uint64_t live;            /* bytes of their latest records */
+} StoreCommit;
+
+static struct {
+    int         fd;
+    uint64_t    slotCount;
+    StoreCommit cur;
+    StoreCommit prev;         /* the commit before, to roll back to */
+} g_playerStore = { .fd = -1 };
+static pthread_mutex_t g_playerLock = PTHREAD_MUTEX_INITIALIZER; /* lookups, adds, online */
+
+static uint32_t g_crcTable[8][256];
+static pthread_once_t g_crcOnce = PTHREAD_ONCE_INIT;
+
+static void crc32Init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        g_crcTable[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            g_crcTable[t][i] = (g_crcTable[t - 1][i] >> 8) ^ g_crcTable[0][g_crcTable[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+/* CRC-32 (IEEE), slicing-by-8 so checksumming keeps up with the disk */
+static uint32_t crc32Update(uint32_t crc, const void *data, size_t len) {
+    uint32_t (*table)[256] = g_crcTable;
+    pthread_once(&g_crcOnce, crc32Init);
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                             (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+                      (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* Little-endian encoding helpers; each returns the advanced pointer */
+static unsigned char *putU8(unsigned char *p, unsigned v) {
+    *p = (unsigned char)v;
+    return p + 1;
+}
+
+static unsigned char *putU32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+    return p + 4;
+}
+
+static unsigned char *putU64(unsigned char *p, uint64_t v) {
+    p = putU32(p, (uint32_t)v);
+    return putU32(p, (uint32_t)(v >> 32));
+}
+
+static uint32_t getU32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t getU16(const unsigned char *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint64_t getU64(const unsigned char *p) {
+    return (uint64_t)getU32(p) | (uint64_t)getU32(p + 4) << 32;
+}
+
+/* Bounds-checked reader over a byte range; `bad` is set on overrun */
+typedef struct {
+    const unsigned char *p;
+    size_t len;
+    size_t pos;
+    int    bad;
+} Reader;
+
+static unsigned readU8(Reader *r) {
+    if (r->len - r->pos < 1) {
+        r->bad = 1;
+        return 0;
+    }
+    return r->p[r->pos++];
+}
+
+static uint16_t readU16(Reader *r) {
+    if (r->len - r->pos < 2) {
+        r->bad = 1;
+        return 0;
+    }
+    uint16_t v = getU16(r->p + r->pos);
+    r->pos += 2;
+    return v;
+}
+
+static uint32_t readU32(Reader *r) {
+    if (r->len - r->pos < 4) {
+        r->bad = 1;
+        return 0;
+    }
+    uint32_t v = getU32(r->p + r->pos);
+    r->pos += 4;
+    return v;
+}
+
+static uint64_t readU64(Reader *r) {
+    if (r->len - r->pos < 8) {
+        r->bad = 1;
+        return 0;
+    }
+    uint64_t v = getU64(r->p + r->pos);
+    r->pos += 8;
+    return v;
+}
+
+/* Copy a u8-length-prefixed string into a fixed buffer */
+static void readName(Reader *r, char *out, size_t outSize) {
+    unsigned n = readU8(r);
+    if (n >= outSize || r->len - r->pos < n) {
+        r->bad = 1;
+        out[0] = '\0';
+        return;
+    }
+    memcpy(out, r->p + r->pos, n);
+    out[n] = '\0';
+    r->pos += n;
+}
+
+static unsigned char *putName(unsigned char *p, const char *name) {
+    size_t n = strnlen(name, MAX_NAME_LEN - 1);
+    p = putU8(p, (unsigned)n);
+    memcpy(p, name, n);
+    return p + n;
+}
+
+/* Player stats in journal order */
+static void getPlayerStats(const Player *p, int32_t out[PLAYER_STAT_COUNT]) {
+    out[0] = p->level;
+    out[1] = p->exp;
+    out[2] = p->expToNextLevel;
+    out[3] = p->hp;
+    out[4] = p->maxHp;
+    out[5] = p->mp;
+    out[6] = p->maxMp;
+    out[7] = p->attackPower;
+    out[8] = p->gold;
+    out[9] = p->currentRoom;
+}
+
+static void setPlayerStats(Player *p, const int32_t in[PLAYER_STAT_COUNT]) {
+    p->level = in[0];
+    p->exp = in[1];
+    p->expToNextLevel = in[2];
+    p->hp = in[3];
+    p->maxHp = in[4];
+    p->mp = in[5];
+    p->maxMp = in[6];
+    p->attackPower = in[7];
+    p->gold = in[8];
+    p->currentRoom = (in[9] >= 0 && in[9] < g_roomCount) ? in[9] : 0;
+}
+
+/* Journal key for a character name */
+static uint64_t playerKeyFor(const char *name) {
+    return hashBytes(name, strlen(name));
+}
+
+/* A character in the player table, by index */
+static Player *playerAt(int index) {
+    return &g_playerTable.chunks[index >> PLAYER_CHUNK_SHIFT][index & ((1 << PLAYER_CHUNK_SHIFT) - 1)];
+}
+
+/* Journal seq + 1 of a character's last change, 0 if it has none */
+static uint64_t *playerChangedSeq(int index) {
+    return &g_playerTable.changed[index >> PLAYER_CHUNK_SHIFT][index & ((1 << PLAYER_CHUNK_SHIFT) - 1)];
+}
+
+/* Record that a character changed, so the next checkpoint writes it to
+ * the player store */
+static void playerChanged(int index) {
+    *playerChangedSeq(index) = g_journal.seq + 1;
+}
+
+/* Index of a character in the player table, or -1 */
+static int playerTableFind(uint64_t key) {
+    PlayerTable *t = &g_playerTable;
+    if (t->slotCount == 0) {
+        return -1;
+    }
+    for (size_t j = key & (t->slotCount - 1); t->slots[j]; j = (j + 1) & (t->slotCount - 1)) {
+        if (t->keys[t->slots[j] - 1] == key) {
+            return t->slots[j] - 1;
+        }
+    }
+    return -1;
+}
+
+/* Add a fresh character to the player table and return its index */
+static int playerTableAdd(uint64_t key, const char *name) {
+    PlayerTable *t = &g_playerTable;
+    int chunk = t->count >> PLAYER_CHUNK_SHIFT;
+    if (chunk >= MAX_PLAYER_CHUNKS) {
+        fprintf(stderr, "Too many characters.\n");
+        exit(1);
+    }
+    if (!t->chunks[chunk] &&
+        (!(t->chunks[chunk] = malloc(sizeof(Player) << PLAYER_CHUNK_SHIFT)) ||
+         !(t->changed[chunk] = malloc(sizeof(uint64_t) << PLAYER_CHUNK_SHIFT)))) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    if (t->count == t->cap) {
+        int newCap = t->cap ? t->cap * 2 : 64;
+        uint64_t *keys = realloc(t->keys, (size_t)newCap * sizeof(uint64_t));
+        if (keys) t->keys = keys;
+        unsigned char *online = realloc(t->online, (size_t)newCap);
+        if (online) t->online = online;
+        unsigned char *stored = realloc(t->stored, (size_t)newCap);
+        if (stored) t->stored = stored;
+        if (!keys || !online || !stored) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        t->cap = newCap;
+    }
+    if ((size_t)(t->count + 1) * 2 > t->slotCount) {
+        size_t newCount = t->slotCount ? t->slotCount * 2 : 128;
+        int32_t *slots = calloc(newCount, sizeof(int32_t));
+        if (!slots) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        for (int i = 0; i < t->count; i++) {
+            size_t j = t->keys[i] & (newCount - 1);
+            while (slots[j]) {
+                j = (j + 1) & (newCount - 1);
+            }
+            slots[j] = i + 1;
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->slotCount = newCount;
+    }
+
+    int index = t->count++;
+    t->keys[index] = key;
+    t->online[index] = 0;
+    t->stored[index] = 0;
+    initPlayer(playerAt(index), name);
+    playerChanged(index);
+    size_t j = key & (t->slotCount - 1);
+    while (t->slots[j]) {
+        j = (j + 1) & (t->slotCount - 1);
+    }
+    t->slots[j] = index + 1;
+    return index;
+}
+
+/* Index of a character, read in from the player store if it is not in
+ * the table yet; -1 if there is no such character */
+static int playerFind(uint64_t key) {
+    int index = playerTableFind(key);
+    return index >= 0 ? index : playerStoreLoad(key);
+}
+
+/* Index of the character called `name`, or -1; `key` is set to its key,
+ * or to the one a new character of that name gets. A key identifies one
+ * character everywhere (table, store, journal), so a name whose hash is
+ * already some other character's takes the next key along that is free
+ * or holds that same name. Characters are never deleted, so the same
+ * walk always ends at the same key. */
+static int playerFindName(const char *name, uint64_t *key) {
+    uint64_t k = playerKeyFor(name);
+    for (;; k++) {
+        if (k == 0) {
+            continue;   /* the store cannot tell key 0 from key 1 */
+        }
+        int index = playerFind(k);
+        if (index < 0 || strcmp(playerAt(index)->name, name) == 0) {
+            *key = k;
+            return index;
+        }
+    }
+}
+
+/* Queue one record for the next group commit */
+void journalAppend(JournalRecordType type, const unsigned char *payload, size_t len) {
+    if (g_journal.fd < 0 || g_journal.replaying) {
+        return;
+    }
+    if (len > UINT16_MAX) {
+        /* Cannot happen (see the record size checks): losing the record
+         * would let the saved game drift from the running one */
+        fprintf(stderr, "Journal record of type %d is too long (%zu bytes).\n", (int)type, len);
+        abort();
+    }
+    unsigned char head[3] = { (unsigned char)type, (unsigned char)len, (unsigned char)(len >> 8) };
+    unsigned char tail[4];
+    uint32_t crc = crc32Update(crc32Update(0, head, 3), payload, len);
+    putU32(tail, crc);
+
+    pthread_mutex_lock(&g_journal.lock);
+    if (g_journal.pending.len == 0) {
+        g_journal.pendingSinceNs = nowNs();
+    }
+    if (!bufAppend(&g_journal.pending, head, 3) ||
+        !bufAppend(&g_journal.pending, payload, len) ||
+        !bufAppend(&g_journal.pending, tail, 4)) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    pthread_mutex_unlock(&g_journal.lock);
+}
+
+/* Write a journal header for `seq` to an empty file */
+static int journalWriteHeader(int fd, uint64_t seq) {
+    unsigned char hdr[JOURNAL_HEADER_SIZE];
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    putU32(hdr + 8, JOURNAL_VERSION);
+    putU64(hdr + 16, seq);
+    return pwrite(fd, hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) && fdatasync(fd) == 0;
+}
+
+/* Start the journal over at `seq` (just after a checkpoint) */
+static int journalReset(uint64_t seq) {
+    if (ftruncate(g_journal.fd, 0) < 0 || !journalWriteHeader(g_journal.fd, seq)) {
+        perror(JOURNAL_FILE_NAME);
+        return 0;
+    }
+    g_journal.seq = seq;
+    g_journal.size = JOURNAL_HEADER_SIZE;
+    return 1;
+}
+
+/* Write a fresh checkpoint and truncate the journal behind it. Worker
+ * threads must be paused (or not running). */
+static int journalCompact() {
+    if (!writeCheckpoint(g_journal.seq + 1)) {
+        return 0;
+    }
+    /* Anything queued since the last commit is already in the checkpoint */
+    g_journal.pending.len = 0;
+    g_journal.checkpointSeq = g_journal.seq + 1;
+    return journalReset(g_journal.seq + 1);
+}
+
+/* Write every queued record and fdatasync them. Records queued while the
+ * write is in progress go to the other buffer and wait for the next one. */
+static int journalWrite() {
+    pthread_mutex_lock(&g_journal.commitLock);
+    pthread_mutex_lock(&g_journal.lock);
+    ByteBuf batch = g_journal.pending;
+    g_journal.pending = g_journal.spare;
+    g_journal.pending.len = 0;
+    pthread_mutex_unlock(&g_journal.lock);
+
+    int ok = 1;
+    size_t done = 0;
+    while (done < batch.len) {
+        ssize_t n = pwrite(g_journal.fd, batch.data + done,
+                           batch.len - done, (off_t)(g_journal.size + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        done += (size_t)n;
+    }
+    if (ok && done > 0 && fdatasync(g_journal.fd) < 0) {
+        ok = 0;
+    }
+
+    if (ok) {
+        if (done > 0) {
+            metricsCount(METRIC_JOURNAL_COMMITS);
+        }
+        g_journal.size += done;
+        batch.len = 0;
+        g_journal.spare = batch;
+    } else {
+        /* Keep the batch, ahead of anything queued since, for a retry */
+        perror(JOURNAL_FILE_NAME);
+        pthread_mutex_lock(&g_journal.lock);
+        if (!bufAppend(&batch, g_journal.pending.data, g_journal.pending.len)) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        g_journal.spare = g_journal.pending;
+        g_journal.spare.len = 0;
+        g_journal.pending = batch;
+        pthread_mutex_unlock(&g_journal.lock);
+    }
+    pthread_mutex_unlock(&g_journal.commitLock);
+    return ok;
+}
+
+/* Close descriptors first..last; 0 if the kernel has no close_range */
+static int closeFdRange(unsigned first, unsigned last) {
+    if (first > last) {
+        return 1;
+    }
+#ifdef SYS_close_range
+    return syscall(SYS_close_range, first, last, 0) == 0;
+#else
+    return 0;
+#endif
+}
+
+/* Close every descriptor from 3 up except `keepA` and `keepB` (-1 for
+ * none): a few close_range calls, or where the kernel is older than 5.9
+ * just the ones /proc/self/fd lists, never a loop up to the fd limit. */
+static void closeFdsExcept(int keepA, int keepB) {
+    int keep[2] = { keepA < keepB ? keepA : keepB, keepA < keepB ? keepB : keepA };
+    unsigned next = 3;
+    int ok = 1;
+    for (int k = 0; k < 2 && ok; k++) {
+        if (keep[k] >= (int)next) {
+            ok = closeFdRange(next, (unsigned)keep[k] - 1);
+            next = (unsigned)keep[k] + 1;
+        }
+    }
+    if (ok && closeFdRange(next, ~0U)) {
+        return;
+    }
+
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) {
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int fd = atoi(e->d_name);   /* "." and ".." give 0 */
+        if (fd >= 3 && fd != dirfd(d) && fd != keepA && fd != keepB) {
+            close(fd);
+        }
+    }
+    closedir(d);
+}
+
+/* Start writing a checkpoint in a forked child. Everything queued is
+ * written to the current journal first, so a crash before the child
+ * finishes loses nothing. Worker threads must be paused. Returns 0 if no
+ * child could be started. */
+static int journalSnapshotStart() {
+    uint64_t seq = g_journal.seq + 1;
+    if (!journalWrite()) {
+        return 0;
+    }
+    int fd = open(JOURNAL_NEXT_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !journalWriteHeader(fd, seq)) {
+        perror(JOURNAL_NEXT_NAME);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    /* Spill records the child may read must stay where they are */
+    __atomic_store_n(&g_spillAppendOnly, 1, __ATOMIC_RELAXED);
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Let go of the parent's sockets and files, or clients it
+         * disconnects stay connected until the child is done. _exit: the
+         * parent's buffered output and exit handlers are its own. */
+        closeFdsExcept(g_spillFd, g_playerStore.fd);
+        g_journal.fd = -1;   /* the parent's, and closed: see journalCommitAndExit */
+        setpriority(PRIO_PROCESS, 0, SNAPSHOT_NICE);
+        _exit(writeCheckpoint(seq) ? 0 : 1);
+    }
+    if (pid < 0) {
+        perror("fork");
+        __atomic_store_n(&g_spillAppendOnly, 0, __ATOMIC_RELAXED);
+        close(fd);
+        unlink(JOURNAL_NEXT_NAME);
+        return 0;
+    }
+    close(g_journal.fd);
+    g_journal.fd = fd;
+    g_journal.seq = seq;
+    g_journal.size = JOURNAL_HEADER_SIZE;
+    g_journal.rotating = 1;
+    g_journal.snapshotPid = pid;
+    return 1;
+}
+
+/* The new journal takes the old one's place, its checkpoint being on disk */
+static void journalRotated() {
+    if (rename(JOURNAL_NEXT_NAME, JOURNAL_FILE_NAME) < 0) {
+        perror(JOURNAL_FILE_NAME);
+        return;
+    }
+    g_journal.rotating = 0;
+}
+
+/* Check on a background checkpoint; `block` waits for it to finish */
+static void journalSnapshotReap(int block) {
+    if (g_journal.snapshotPid <= 0) {
+        return;
+    }
+    int status = 0;
+    pid_t pid;
+    do {
+        pid = waitpid(g_journal.snapshotPid, &status, block ? 0 : WNOHANG);
+    } while (pid < 0 && errno == EINTR);
+    if (pid == 0) {
+        return;
+    }
+    g_journal.snapshotPid = 0;
+    __atomic_store_n(&g_spillAppendOnly, 0, __ATOMIC_RELAXED);
+    playerStoreReload(); /* the child may have rewritten it */
+    if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        metricsCount(METRIC_CHECKPOINTS);
+        g_journal.checkpointSeq = g_journal.seq;
+        journalRotated();
+    } else {
+        /* Both journals stay; the next checkpoint is written in the
+         * foreground and replaces them */
+        fprintf(stderr, "Background checkpoint failed.\n");
+    }
+}
+
+/* Wait for a background checkpoint, before exiting */
+void journalSnapshotWait() {
+    journalSnapshotReap(1);
+}
+
+/* The journal is long: fold it into a checkpoint, in the background if
+ * possible. Main thread only. */
+static void journalCheckpoint() {
+    journalSnapshotReap(0);
+    if (g_journal.snapshotPid > 0) {
+        return; /* one at a time; the journal grows until it is done */
+    }
+    schedulerPause();
+    if (g_journal.rotating || !journalSnapshotStart()) {
+        if (journalCompact() && g_journal.rotating) {
+            journalRotated();
+        }
+    }
+    schedulerResume();
+}
+
+/* Make every queued record durable with one write and one fdatasync.
+ * Returns 0 if the journal could not be written. */
+int journalCommit() {
+    if (g_journal.fd < 0) {
+        return 0;
+    }
+    int ok = journalWrite();
+
+    /* A checkpoint needs the world to hold still, so workers leave it to
+     * the main thread */
+    if (!onWorkerThread()) {
+        journalSnapshotReap(0);
+        if (ok && g_journal.size > JOURNAL_COMPACT_BYTES) {
+            journalCheckpoint();
+        }
+    }
+    return ok;
+}
+
+/* The game cannot go on (say, the only copy of a room is unreadable):
+ * make the queued records durable, so no change a player has already
+ * seen is lost, and stop. Safe on any thread. _exit rather than exit: the
+ * other workers are still running, and the exit handlers and stdio
+ * teardown must not run under them. */
+void journalCommitAndExit() {
+    /* journalWrite rather than journalCommit: a checkpoint from here could
+     * hit the same bad record again */
+    if (g_journal.fd >= 0) {
+        journalWrite();
+    }
+    _exit(1);
+}
+
+/* Commit if the oldest queued record has waited long enough */
+void journalMaybeCommit() {
+    journalSnapshotReap(0);
+    pthread_mutex_lock(&g_journal.lock);
+    int due = g_journal.pending.len >= JOURNAL_COMMIT_BYTES ||
+              (g_journal.pending.len > 0 &&
+               nowNs() - g_journal.pendingSinceNs >= JOURNAL_COMMIT_MS * 1000000ull);
+    pthread_mutex_unlock(&g_journal.lock);
+    if (due) {
+        journalCommit();
+    }
+}
+
+/* How long an event loop may sleep before the next group commit is due,
+ * or before a background checkpoint is checked on again */
+int journalTimeoutMs() {
+    pthread_mutex_lock(&g_journal.lock);
+    int64_t waited = -1;
+    if (g_journal.pending.len > 0) {
+        waited = (int64_t)((nowNs() - g_journal.pendingSinceNs) / 1000000ull);
+    }
+    pthread_mutex_unlock(&g_journal.lock);
+    int timeout = -1;
+    if (waited >= 0) {
+        timeout = waited >= JOURNAL_COMMIT_MS ? 0 : (int)(JOURNAL_COMMIT_MS - waited);
+    }
+    if (g_journal.snapshotPid > 0 && (timeout < 0 || timeout > SNAPSHOT_POLL_MS)) {
+        timeout = SNAPSHOT_POLL_MS;
+    }
+    return timeout;
+}
+
+#define JOURNAL_MONSTER_SIZE (1 + 4 * 4 + 1 + MAX_NAME_LEN)
+_Static_assert(4 + 1 + MAX_ROOM_MONSTERS * JOURNAL_MONSTER_SIZE <= UINT16_MAX,
+               "a room's monster list must fit in one journal record");
+
+static unsigned char *putMonster(unsigned char *p, const Monster *m) {
+    p = putU8(p, m->state);
+    p = putU32(p, (uint32_t)m->level);
+    p = putU32(p, (uint32_t)m->hp);
+    p = putU32(p, (uint32_t)m->maxHp);
+    p = putU32(p, (uint32_t)m->attackPower);
+    return putName(p, m->name ? m->name : "");
+}
+
+/* RECORD: all of a room's monsters */
+void journalRoomMonsters(int room) {
+    unsigned char buf[4 + 1 + MAX_ROOM_MONSTERS * JOURNAL_MONSTER_SIZE], *p = buf;
+    unsigned char *count = buf + 4;
+    p = putU32(p, (uint32_t)room);
+    p = putU8(p, 0);
+    for (const Monster *m = firstMonster(room); m; m = nextMonster(m)) {
+        p = putMonster(p, m);
+        (*count)++;
+    }
+    journalAppend(JR_ROOM_MONSTERS, buf, (size_t)(p - buf));
+}
+
+/* RECORD: item `index` of one holder moved to the end of another */
+void journalItemMove(HolderKind fromKind, uint64_t fromId, int index,
+                     HolderKind toKind, uint64_t toId) {
+    unsigned char buf[24], *p = buf;
+    p = putU8(p, fromKind);
+    p = putU64(p, fromId);
+    p = putU32(p, (uint32_t)index);
+    p = putU8(p, toKind);
+    p = putU64(p, toId);
+    journalAppend(JR_ITEM_MOVE, buf, (size_t)(p - buf));
+}
+
+/* RECORD: item `index` of a holder was used up */
+void journalItemConsume(HolderKind kind, uint64_t id, int index) {
+    unsigned char buf[16], *p = buf;
+    p = putU8(p, kind);
+    p = putU64(p, id);
+    p = putU32(p, (uint32_t)index);
+    journalAppend(JR_ITEM_CONSUME, buf, (size_t)(p - buf));
+}
+
+/* RECORD: a (re)created character */
+static void journalPlayerName(uint64_t key, const char *name) {
+    unsigned char buf[8 + 1 + MAX_NAME_LEN], *p = buf;
+    p = putU64(p, key);
+    p = putName(p, name);
+    journalAppend(JR_PLAYER_NAME, buf, (size_t)(p - buf));
+}
+
+/* RECORD: player stats, if they changed since the last record. Also keeps
+ * the player table's copy of the character current. */
+void journalPlayer(Session *s) {
+    if (s->state == SESSION_NAME) {
+        return;
+    }
+    int32_t stats[PLAYER_STAT_COUNT];
+    getPlayerStats(&s->player, stats);
+    if (memcmp(stats, s->journaledStats, sizeof(stats)) != 0) {
+        unsigned char buf[8 + 4 * PLAYER_STAT_COUNT], *p = buf;
+        p = putU64(p, s->playerKey);
+        for (int i = 0; i < PLAYER_STAT_COUNT; i++) {
+            p = putU32(p, (uint32_t)stats[i]);
+        }
+        journalAppend(JR_PLAYER_STATS, buf, (size_t)(p - buf));
+        memcpy(s->journaledStats, stats, sizeof(stats));
+    }
+    Player *saved = playerAt(s->playerIndex);
+    if (memcmp(saved, &s->player, sizeof(Player)) != 0) {
+        *saved = s->player;  /* only this session writes it */
+        playerChanged(s->playerIndex);
+    }
+}
+
+/* Items held by a journal holder, or NULL if it does not exist */
+static Inventory *holderItems(HolderKind kind, uint64_t id) {
+    if (kind == HOLDER_ROOM) {
+        if (id >= (uint64_t)g_roomCount) {
+            return NULL;
+        }
+        roomChanged((int)id);
+        return &getRoom((int)id)->ground;
+    }
+    int index = playerFind(id);
+    if (index < 0) {
+        return NULL;
+    }
+    playerChanged(index);
+    return &playerAt(index)->inventory;
+}
+
+/* Remove a replayed item the way the journal's version did */
+static void replayRemoveItem(Inventory *inv, int index) {
+    if (g_journal.version >= 2) {
+        removeItemFromInventory(inv, index);
+        return;
+    }
+    memmove(&inv->items[index], &inv->items[index + 1],
+            (size_t)(inv->count - index - 1) * sizeof(ItemId));
+    inv->count--;
+    reindexInventory(inv);
+}
+
+/* Read a monster written by putMonster. Returns 0 if it is malformed. */
+static int readMonster(Reader *r, Monster *m) {
+    char name[MAX_NAME_LEN];
+    m->state = (MonsterState)readU8(r);
+    m->level = (int32_t)readU32(r);
+    m->hp = (int32_t)readU32(r);
+    m->maxHp = (int32_t)readU32(r);
+    m->attackPower = (int32_t)readU32(r);
+    readName(r, name, sizeof(name));
+    if (r->bad || m->state > MONSTER_DEAD) {
+        return 0;
+    }
+    m->name = internName(name);
+    return 1;
+}
+
+/* Apply one journal record during recovery. Returns 0 if it is malformed. */
+static int applyJournalRecord(unsigned type, Reader *r) {
+    switch (type) {
+        case JR_ROOM_MONSTER:
+        case JR_ROOM_MONSTERS: {
+            uint32_t roomIndex = readU32(r);
+            unsigned count = readU8(r);  /* v3 and older: monster present */
+            Monster list[MAX_ROOM_MONSTERS];
+            if (count > MAX_ROOM_MONSTERS) {
+                return 0;
+            }
+            for (unsigned i = 0; i < (type == JR_ROOM_MONSTER ? 1 : count); i++) {
+                if (!readMonster(r, &list[i])) {
+                    return 0;
+                }
+            }
+            if (roomIndex >= (uint32_t)g_roomCount) {
+                return 0;
+            }
+            getRoom((int)roomIndex);
+            setRoomMonsters((int)roomIndex, list, type == JR_ROOM_MONSTER ? count != 0 : (int)count);
+            return 1;
+        }
+        case JR_ITEM_MOVE: {
+            HolderKind fromKind = (HolderKind)readU8(r);
+            uint64_t fromId = readU64(r);
+            uint32_t index = readU32(r);
+            HolderKind toKind = (HolderKind)readU8(r);
+            uint64_t toId = readU64(r);
+            Inventory *from, *to;
+            if (r->bad || !(from = holderItems(fromKind, fromId)) ||
+                !(to = holderItems(toKind, toId)) ||
+                index >= (uint32_t)from->count || !addItemToInventory(to, from->items[index])) {
+                return 0;
+            }
+            replayRemoveItem(from, (int)index);
+            return 1;
+        }
+        case JR_ITEM_CONSUME: {
+            HolderKind kind = (HolderKind)readU8(r);
+            uint64_t id = readU64(r);
+            uint32_t index = readU32(r);
+            Inventory *items;
+            if (r->bad || !(items = holderItems(kind, id)) || index >= (uint32_t)items->count) {
+                return 0;
+            }
+            replayRemoveItem(items, (int)index);
+            return 1;
+        }
+        case JR_PLAYER_NAME: {
+            uint64_t key = readU64(r);
+            char name[MAX_NAME_LEN];
+            readName(r, name, sizeof(name));
+            if (r->bad) {
+                return 0;
+            }
+            int index = playerFind(key);
+            if (index < 0) {
+                playerTableAdd(key, name);
+            } else {
+                initPlayer(playerAt(index), name);
+                playerChanged(index);
+            }
+            return 1;
+        }
+        case JR_PLAYER_STATS: {
+            uint64_t key = readU64(r);
+            int32_t stats[PLAYER_STAT_COUNT];
+            for (int i = 0; i < PLAYER_STAT_COUNT; i++) {
+                stats[i] = (int32_t)readU32(r);
+            }
+            int index = r->bad ? -1 : playerFind(key);
+            if (index < 0) {
+                return 0;
+            }
+            setPlayerStats(playerAt(index), stats);
+            playerChanged(index);
+            return 1;
+        }
+        case JR_RUN_SEED:
+            g_journal.lastSeed = readU64(r);
+            g_journal.hasLastSeed = 1;
+            return !r->bad;
+        default:
+            return 0;
+    }
+}
+
+/* Save file writer: buffered output with a running CRC */
+typedef struct {
+    FILE    *f;
+    uint32_t crc;
+    int      failed;
+} SaveWriter;
+
+static void saveWrite(SaveWriter *w, const void *data, size_t n) {
+    w->crc = crc32Update(w->crc, data, n);
+    if (fwrite(data, 1, n, w->f) != n) {
+        w->failed = 1;
+    }
+}
+
+/* Append one field (u8 id | u16 length | value) to a record body */
+static void putField(ByteBuf *b, unsigned id, const void *data, size_t n) {
+    if (n > UINT16_MAX || !bufReserve(b, 3 + n)) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    unsigned char *p = b->data + b->len;
+    p[0] = (unsigned char)id;
+    p[1] = (unsigned char)n;
+    p[2] = (unsigned char)(n >> 8);
+    memcpy(p + 3, data, n);
+    b->len += 3 + n;
+}
+
+static void putFieldU32(ByteBuf *b, unsigned id, uint32_t v) {
+    unsigned char buf[4];
+    putU32(buf, v);
+    putField(b, id, buf, 4);
+}
+
+static void putFieldU64(ByteBuf *b, unsigned id, uint64_t v) {
+    unsigned char buf[8];
+    putU64(buf, v);
+    putField(b, id, buf, 8);
+}
+
+static void putFieldStr(ByteBuf *b, unsigned id, const char *s) {
+    putField(b, id, s, strnlen(s, MAX_NAME_LEN - 1));
+}
+
+/* Nested item fields */
+static void putFieldItem(ByteBuf *b, unsigned id, const Item *item, ByteBuf *scratch) {
+    scratch->len = 0;
+    putFieldStr(scratch, IF_NAME, item->name);
+    putFieldU32(scratch, IF_TYPE, item->type);
+    putFieldU32(scratch, IF_POWER, (uint32_t)item->power);
+    putFieldU32(scratch, IF_VALUE, (uint32_t)item->value);
+    putField(b, id, scratch->data, scratch->len);
+}
+
+/* Append the fields of a materialized room's ROOM record to `body`.
+ * `nested` and `scratch` are work buffers. */
+static void encodeRoomRecord(ByteBuf *body, int index, ByteBuf *nested, ByteBuf *scratch) {
+    const Room *room = roomSlotPtr(g_roomSlot[index]);
+    putFieldU32(body, RF_INDEX, (uint32_t)index);
+    for (int k = 0; k < room->ground.count; k++) {
+        putFieldItem(body, RF_ITEM, itemProto(room->ground.items[k]), scratch);
+    }
+    uint32_t monsterCount = 0;
+    for (const Monster *m = firstMonster(index); m; m = nextMonster(m)) {
+        monsterCount++;
+    }
+    putFieldU32(body, RF_MONSTER_COUNT, monsterCount);
+    for (const Monster *m = firstMonster(index); m; m = nextMonster(m)) {
+        nested->len = 0;
+        putFieldStr(nested, MF_NAME, m->name ? m->name : "");
+        putFieldU32(nested, MF_LEVEL, (uint32_t)m->level);
+        putFieldU32(nested, MF_HP, (uint32_t)m->hp);
+        putFieldU32(nested, MF_MAX_HP, (uint32_t)m->maxHp);
+        putFieldU32(nested, MF_ATTACK, (uint32_t)m->attackPower);
+        putFieldU32(nested, MF_STATE, m->state);
+        putField(body, RF_MONSTER, nested->data, nested->len);
+    }
+}
+
+/* The fields of a PLAYER record: name, stats and inventory */
+static void encodePlayerRecord(ByteBuf *body, const Player *p, ByteBuf *scratch) {
+    int32_t stats[PLAYER_STAT_COUNT];
+    getPlayerStats(p, stats);
+    putFieldStr(body, PF_NAME, p->name);
+    for (int k = 0; k < PLAYER_STAT_COUNT; k++) {
+        putFieldU32(body, PF_LEVEL + k, (uint32_t)stats[k]);
+    }
+    for (int k = 0; k < p->inventory.count; k++) {
+        putFieldItem(body, PF_ITEM, itemProto(p->inventory.items[k]), scratch);
+    }
+}
+
+static void saveRecord(SaveWriter *w, SaveRecordKind kind, const ByteBuf *body) {
+    unsigned char head[5];
+    head[0] = (unsigned char)kind;
+    putU32(head + 1, (uint32_t)body->len);
+    saveWrite(w, head, sizeof(head));
+    saveWrite(w, body->data, body->len);
+}
+
+/* Write the full state: characters that changed go to the player store,
+ * every touched room to a new checkpoint file, which replaces the old one
+ * atomically. */
+int writeCheckpoint(uint64_t seq) {
+    if (!playerStoreCommit(seq, g_journal.checkpointSeq)) {
+        return 0;
+    }
+    char tmpName[64];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", SAVE_FILE_NAME);
+    FILE *f = fopen(tmpName, "wb");
+    if (!f) {
+        perror(tmpName);
+        return 0;
+    }
+    static char ioBuf[1 << 20];
+    setvbuf(f, ioBuf, _IOFBF, sizeof(ioBuf));
+
+    SaveWriter w = { f, 0, 0 };
+    ByteBuf body = { 0 };
+    ByteBuf nested = { 0 };
+    ByteBuf scratch = { 0 };
+
+    unsigned char hdr[16];
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, SAVE_MAGIC, sizeof(SAVE_MAGIC));
+    putU32(hdr + 8, SAVE_VERSION);
+    saveWrite(&w, hdr, sizeof(hdr));
+
+    putFieldU32(&body, WF_ROOM_COUNT, (uint32_t)g_roomCount);
+    putFieldU64(&body, WF_SEQ, seq);
+    putFieldU64(&body, WF_SEED, g_seed);
+    saveRecord(&w, SREC_WORLD, &body);
+
+    /* Names, descriptions and exits come from the world image, so only
+     * rooms that have been touched carry any state. Evicted rooms are
+     * copied from the spill file as they are. */
+    for (int i = 0; i < g_roomCount; i++) {
+        body.len = 0;
+        if (g_roomFlags[i] & ROOM_LOADED) {
+            encodeRoomRecord(&body, i, &nested, &scratch);
+        } else if (g_roomSpill[i]) {
+            readSpillRecord(i, &body);
+        } else {
+            continue;
+        }
+        saveRecord(&w, SREC_ROOM, &body);
+    }
+
+    body.len = 0;
+    putFieldU32(&body, EF_CRC, w.crc);
+    saveRecord(&w, SREC_END, &body);
+    free(body.data);
+    free(nested.data);
+    free(scratch.data);
+
+    if (w.failed || fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        perror(tmpName);
+        fclose(f);
+        remove(tmpName);
+        return 0;
+    }
+    fclose(f);
+    if (rename(tmpName, SAVE_FILE_NAME) < 0) {
+        perror(SAVE_FILE_NAME);
+        return 0;
+    }
+    metricsCount(METRIC_CHECKPOINTS);
+    return 1;
+}
+
+/* One decoded field; `val` reads its value */
+typedef struct {
+    unsigned id;
+    Reader   val;
+} SaveField;
+
+/* Next field of a record body: 1 = got one, 0 = end, -1 = malformed */
+static int nextField(Reader *r, SaveField *f) {
+    if (r->pos == r->len) {
+        return 0;
+    }
+    f->id = readU8(r);
+    uint16_t n = readU16(r);
+    if (r->bad || r->len - r->pos < n) {
+        return -1;
+    }
+    f->val.p = r->p + r->pos;
+    f->val.len = n;
+    f->val.pos = 0;
+    f->val.bad = 0;
+    r->pos += n;
+    return 1;
+}
+
+static uint32_t fieldU32(SaveField *f) {
+    if (f->val.len != 4) {
+        f->val.bad = 1;
+        return 0;
+    }
+    return readU32(&f->val);
+}
+
+static uint64_t fieldU64(SaveField *f) {
+    if (f->val.len != 8) {
+        f->val.bad = 1;
+        return 0;
+    }
+    return readU64(&f->val);
+}
+
+static void fieldStr(SaveField *f, char *out, size_t outSize) {
+    if (f->val.len >= outSize) {
+        f->val.bad = 1;
+        out[0] = '\0';
+        return;
+    }
+    memcpy(out, f->val.p, f->val.len);
+    out[f->val.len] = '\0';
+}
+
+/* Decode nested item fields; 0 if invalid */
+static int decodeItem(Reader *r, ItemId *out) {
+    SaveField f;
+    int rc;
+    char name[MAX_NAME_LEN] = "";
+    Item item = { name, ITEM_MISC, 0, 0, 0 };
+    while ((rc = nextField(r, &f)) > 0) {
+        switch (f.id) {
+            case IF_NAME:  fieldStr(&f, name, sizeof(name)); break;
+            case IF_TYPE:  item.type = (ItemType)fieldU32(&f); break;
+            case IF_POWER: item.power = (int32_t)fieldU32(&f); break;
+            case IF_VALUE: item.value = (int32_t)fieldU32(&f); break;
+            default: break; /* field from a newer version */
+        }
+        if (f.val.bad) {
+            return 0;
+        }
+    }
+    if (rc != 0 || name[0] == '\0' || (unsigned)item.type > ITEM_MISC) {
+        return 0;
+    }
+    int id = internItem(&item, 1);
+    *out = (ItemId)id;
+    return id >= 0;
+}
+
+/* Decode the fields of a PLAYER record */
+static int parsePlayerRecord(Reader *r, Player *out) {
+    Player p;
+    int32_t stats[PLAYER_STAT_COUNT];
+    SaveField f;
+    int rc;
+
+    initPlayer(&p, "");
+    getPlayerStats(&p, stats);
+    while ((rc = nextField(r, &f)) > 0) {
+        if (f.id == PF_NAME) {
+            fieldStr(&f, p.name, sizeof(p.name));
+        } else if (f.id >= PF_LEVEL && f.id <= PF_ROOM) {
+            stats[f.id - PF_LEVEL] = (int32_t)fieldU32(&f);
+        } else if (f.id == PF_ITEM) {
+            ItemId item;
+            if (!decodeItem(&f.val, &item) || !addItemToInventory(&p.inventory, item)) {
+                return 0;
+            }
+        }
+        if (f.val.bad) {
+            return 0;
+        }
+    }
+    if (rc < 0 || p.name[0] == '\0' || stats[9] < 0 || stats[9] >= g_roomCount) {
+        return 0;
+    }
+    setPlayerStats(&p, stats);
+    *out = p;
+    return 1;
+}
+
+/* Decode a PLAYER record from a checkpoint of save format v2 into the
+ * player table; it moves to the player store from there */
+static int decodePlayerRecord(Reader *r) {
+    Player p;
+    if (!parsePlayerRecord(r, &p)) {
+        return 0;
+    }
+    uint64_t key;
+    int index = playerFindName(p.name, &key);
+    if (index < 0) {
+        index = playerTableAdd(key, p.name);
+    }
+    *playerAt(index) = p;
+    return 1;
+}
+
+/* The state a ROOM record holds */
+typedef struct {
+    uint32_t index;
+    int      itemCount;
+    ItemId   items[MAX_INVENTORY_SIZE];
+    uint32_t monsterCount;              /* 0 in old saves with no monster */
+    int      monstersRead;
+    Monster  monsters[MAX_ROOM_MONSTERS];
+} RoomRecord;
+
+/* Decode the fields of a ROOM record */
+static int parseRoomRecord(Reader *r, RoomRecord *rec) {
+    SaveField f;
+    int rc;
+
+    rec->index = UINT32_MAX;
+    rec->itemCount = 0;
+    rec->monsterCount = 0;
+    rec->monstersRead = 0;
+    while ((rc = nextField(r, &f)) > 0) {
+        switch (f.id) {
+            case RF_INDEX:
+                rec->index = fieldU32(&f);
+                break;
+            case RF_ITEM:
+                if (rec->itemCount >= MAX_INVENTORY_SIZE ||
+                    !decodeItem(&f.val, &rec->items[rec->itemCount++])) {
+                    return 0;
+                }
+                break;
+            case RF_MONSTER_COUNT:
+                rec->monsterCount = fieldU32(&f);
+                break;
+            case RF_MONSTER: {
+                if (rec->monstersRead >= MAX_ROOM_MONSTERS) {
+                    return 0;
+                }
+                Monster *m = &rec->monsters[rec->monstersRead++];
+                char monsterName[MAX_NAME_LEN] = "";
+                SaveField mf;
+                int mrc;
+                memset(m, 0, sizeof(*m));
+                m->state = MONSTER_DEAD;
+                while ((mrc = nextField(&f.val, &mf)) > 0) {
+                    switch (mf.id) {
+                        case MF_NAME:   fieldStr(&mf, monsterName, sizeof(monsterName)); break;
+                        case MF_LEVEL:  m->level = (int32_t)fieldU32(&mf); break;
+                        case MF_HP:     m->hp = (int32_t)fieldU32(&mf); break;
+                        case MF_MAX_HP: m->maxHp = (int32_t)fieldU32(&mf); break;
+                        case MF_ATTACK: m->attackPower = (int32_t)fieldU32(&mf); break;
+                        case MF_STATE:  m->state = (MonsterState)fieldU32(&mf); break;
+                        default: break;
+                    }
+                    if (mf.val.bad) {
+                        return 0;
+                    }
+                }
+                if (mrc < 0 || (unsigned)m->state > MONSTER_DEAD) {
+                    return 0;
+                }
+                m->name = internName(monsterName);
+                break;
+            }
+            default:
+                break;
+        }
+        if (f.val.bad) {
+            return 0;
+        }
+    }
+    return rc == 0 && rec->index < (uint32_t)g_roomCount;
+}
+
+/* Put a decoded ROOM record's items and monsters into its room */
+static void applyRoomRecord(Room *room, const RoomRecord *rec) {
+    room->ground.count = 0;
+    reindexInventory(&room->ground);
+    for (int i = 0; i < rec->itemCount; i++) {
+        addItemToInventory(&room->ground, rec->items[i]);
+    }
+    /* Saves before packs wrote a present flag and at most one monster */
+    setRoomMonsters((int)rec->index, rec->monsters, rec->monsterCount ? rec->monstersRead : 0);
+}
+
+/* Decode a ROOM record onto its room */
+static int decodeRoomRecord(Reader *r) {
+    RoomRecord rec;
+    if (!parseRoomRecord(r, &rec)) {
+        return 0;
+    }
+    applyRoomRecord(getRoom((int)rec.index), &rec);
+    return 1;
+}
+
+/* Load a v2 save image in one pass: every record is checksummed, decoded,
+ * validated and applied as it is reached. */
+static int loadSaveImage(const unsigned char *data, size_t size, uint64_t *seq) {
+    if (size < 16 || getU32(data + 8) > SAVE_VERSION) {
+        fprintf(stderr, "%s was written by a newer version.\n", SAVE_FILE_NAME);
+        return -1;
+    }
+
+    Reader file = { data, size, 16, 0 };
+    uint32_t crc = crc32Update(0, data, 16);
+    int sawWorld = 0;
+    while (1) {
+        size_t start = file.pos;
+        unsigned kind = readU8(&file);
+        uint32_t len = readU32(&file);
+        if (file.bad || file.len - file.pos < len) {
+            break;
+        }
+        Reader body = { data + file.pos, len, 0, 0 };
+        file.pos += len;
+
+        if (kind == SREC_END) {
+            SaveField f;
+            if (nextField(&body, &f) != 1 || f.id != EF_CRC || fieldU32(&f) != crc ||
+                file.pos != size || !sawWorld) {
+                break;
+            }
+            return 1;
+        }
+        crc = crc32Update(crc, data + start, file.pos - start);
+
+        if (kind == SREC_WORLD) {
+            SaveField f;
+            int rc;
+            uint32_t roomCount = 0;
+            while ((rc = nextField(&body, &f)) > 0) {
+                if (f.id == WF_ROOM_COUNT) roomCount = fieldU32(&f);
+                if (f.id == WF_SEQ)        *seq = fieldU64(&f);
+                if (f.id == WF_SEED) {
+                    g_journal.lastSeed = fieldU64(&f);
+                    g_journal.hasLastSeed = 1;
+                }
+            }
+            if (rc < 0 || f.val.bad) {
+                break;
+            }
+            if (roomCount != (uint32_t)g_roomCount) {
+                fprintf(stderr, "%s was saved with a different world.\n", SAVE_FILE_NAME);
+                return -1;
+            }
+            sawWorld = 1;
+        } else if (!sawWorld) {
+            break;
+        } else if (kind == SREC_PLAYER) {
+            if (!decodePlayerRecord(&body)) {
+                break;
+            }
+        } else if (kind == SREC_ROOM) {
+            if (!decodeRoomRecord(&body)) {
+                break;
+            }
+        }
+        /* other kinds come from a newer version and are skipped */
+    }
+
+    fprintf(stderr, "%s is corrupt.\n", SAVE_FILE_NAME);
+    return -1;
+}
+
+/* Set a room's monster from a legacy by-value monster */
+static void legacyMonster(int room, int present, LegacyMonster *lm) {
+    lm->name[MAX_NAME_LEN - 1] = '\0';
+    Monster m = { .name = internName(lm->name), .level = lm->level, .hp = lm->hp,
+                  .maxHp = lm->maxHp, .attackPower = lm->attackPower,
+                  .state = (unsigned)lm->state <= MONSTER_DEAD ? lm->state : MONSTER_DEAD };
+    setRoomMonsters(room, &m, present ? 1 : 0);
+}
+
+/* Register legacy by-value items; 0 if any is invalid */
+static int legacyItems(LegacyItem *in, int count, Inventory *out) {
+    if (count < 0 || count > MAX_INVENTORY_SIZE) {
+        return 0;
+    }
+    out->count = 0;
+    reindexInventory(out);
+    for (int i = 0; i < count; i++) {
+        in[i].name[MAX_NAME_LEN - 1] = '\0';
+        Item item = { in[i].name, in[i].type, in[i].power, in[i].value, 0 };
+        int id = (unsigned)item.type <= ITEM_MISC ? internItem(&item, 1) : -1;
+        if (id < 0) {
+            return 0;
+        }
+        addItemToInventory(out, (ItemId)id);
+    }
+    return 1;
+}
+
+/* Check a legacy player record and add it to the player table */
+static int addLegacyPlayer(LegacyPlayer *lp) {
+    Player p;
+    initPlayer(&p, "");
+    lp->name[MAX_NAME_LEN - 1] = '\0';
+    snprintf(p.name, sizeof(p.name), "%s", lp->name);
+    setPlayerStats(&p, lp->stats);
+    if (p.currentRoom < 0 || p.currentRoom >= g_roomCount ||
+        !legacyItems(lp->items, lp->itemCount, &p.inventory)) {
+        return 0;
+    }
+    uint64_t key;
+    int index = playerFindName(p.name, &key);
+    if (index < 0) {
+        index = playerTableAdd(key, p.name);
+    }
+    *playerAt(index) = p;
+    return 1;
+}
+
+/* Save format v1: LegacyCheckpointHeader | LegacyPlayer[playerCount] |
+ * (int index | int itemCount | LegacyItem[itemCount] | int present | Monster)* | -1 */
+static int loadLegacyCheckpoint(FILE *f, uint64_t *seq) {
+    LegacyCheckpointHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.version != 1) {
+        return -1;
+    }
+    if (hdr.roomCount != (uint32_t)g_roomCount) {
+        fprintf(stderr, "%s was saved with a different world.\n", SAVE_FILE_NAME);
+        return -1;
+    }
+    for (uint32_t i = 0; i < hdr.playerCount; i++) {
+        LegacyPlayer lp;
+        if (fread(&lp, sizeof(lp), 1, f) != 1 || !addLegacyPlayer(&lp)) {
+            return -1;
+        }
+    }
+
+    int index;
+    while (fread(&index, sizeof(int), 1, f) == 1 && index >= 0) {
+        if (index >= g_roomCount) {
+            return -1;
+        }
+        Room *room = getRoom(index);
+        LegacyItem items[LEGACY_INVENTORY_SIZE];
+        LegacyMonster lm;
+        int itemCount, present;
+        if (fread(&itemCount, sizeof(int), 1, f) != 1 ||
+            itemCount < 0 || itemCount > LEGACY_INVENTORY_SIZE ||
+            fread(items, sizeof(LegacyItem), itemCount, f) != (size_t)itemCount ||
+            !legacyItems(items, itemCount, &room->ground) ||
+            fread(&present, sizeof(int), 1, f) != 1 ||
+            fread(&lm, sizeof(lm), 1, f) != 1) {
+            return -1;
+        }
+        legacyMonster(index, present, &lm);
+    }
+    *seq = hdr.seq;
+    return 1;
+}
+
+/* Save format v0: the original LegacyPlayer | int roomCount | LegacyRoom[]
+ * dump. Its rooms must line up with the current world by index and name. */
+static int loadLegacyRawSave(FILE *f, long size) {
+    LegacyPlayer lp;
+    int roomCount;
+    if (fread(&lp, sizeof(lp), 1, f) != 1 || fread(&roomCount, sizeof(int), 1, f) != 1 ||
+        roomCount <= 0 ||
+        size != (long)(sizeof(lp) + sizeof(int) + (size_t)roomCount * sizeof(LegacyRoom))) {
+        return -1;
+    }
+    if (roomCount > g_roomCount || !addLegacyPlayer(&lp)) {
+        fprintf(stderr, "%s was saved with a different world.\n", SAVE_FILE_NAME);
+        return -1;
+    }
+
+    for (int i = 0; i < roomCount; i++) {
+        LegacyRoom lr;
+        if (fread(&lr, sizeof(lr), 1, f) != 1) {
+            return -1;
+        }
+        lr.name[MAX_NAME_LEN - 1] = '\0';
+        Room *room = getRoom(i);
+        if (strcmp(lr.name, room->name) != 0) {
+            fprintf(stderr, "%s was saved with a different world.\n", SAVE_FILE_NAME);
+            return -1;
+        }
+        if (!legacyItems(lr.itemsInRoom, lr.itemCount, &room->ground)) {
+            return -1;
+        }
+        legacyMonster(i, lr.monsterPresent, &lr.monster);
+    }
+    return 1;
+}
+
+/* Load the checkpoint into the rooms, and from formats before v3 into the
+ * player table as well; `version` is set to the format it was in. Returns
+ * 1 if loaded, 0 if there is none, -1 if it exists but cannot be used. */
+static int loadCheckpoint(uint64_t *seq, int *version) {
+    int fd = open(SAVE_FILE_NAME, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    char magic[8] = { 0 };
+    if (fstat(fd, &st) < 0 || read(fd, magic, sizeof(magic)) != (ssize_t)sizeof(magic)) {
+        close(fd);
+        fprintf(stderr, "%s is corrupt.\n", SAVE_FILE_NAME);
+        return -1;
+    }
+
+    if (memcmp(magic, SAVE_MAGIC, sizeof(SAVE_MAGIC)) == 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            perror(SAVE_FILE_NAME);
+            return -1;
+        }
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        *version = st.st_size >= 16 ? (int)getU32((const unsigned char *)data + 8) : 0;
+        int rc = loadSaveImage(data, (size_t)st.st_size, seq);
+        munmap(data, (size_t)st.st_size);
+        return rc;
+    }
+
+    /* An older format; journalRecover rewrites it as the current one */
+    FILE *f = lseek(fd, 0, SEEK_SET) == 0 ? fdopen(fd, "rb") : NULL;
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+    *version = memcmp(magic, LEGACY_CKPT_MAGIC, sizeof(LEGACY_CKPT_MAGIC)) == 0 ? 1 : 0;
+    int rc = *version == 1 ? loadLegacyCheckpoint(f, seq) : loadLegacyRawSave(f, (long)st.st_size);
+    fclose(f);
+    if (rc < 0) {
+        fprintf(stderr, "%s is corrupt or not a save file.\n", SAVE_FILE_NAME);
+        return -1;
+    }
+    return 1;
+}
+
+/* Replay the journal in `fd` if it follows the checkpoint with `seq`,
+ * cutting off a torn record at its end. Returns 1 if it was replayed, 0 if
+ * it belongs to another checkpoint (or is empty), -1 on error. */
+static int replayJournal(int fd, const char *name, uint64_t seq, long *records) {
+    size_t len = 0;
+    unsigned char *data = (unsigned char *)readWholeFile(name, &len);
+    int replay = data && len >= JOURNAL_HEADER_SIZE &&
+                 memcmp(data, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0 &&
+                 getU32(data + 8) >= 1 && getU32(data + 8) <= JOURNAL_VERSION &&
+                 getU64(data + 16) == seq;
+    if (!replay) {
+        free(data);
+        return 0;
+    }
+    g_journal.version = getU32(data + 8);
+    g_journal.seq = seq;
+    size_t good = JOURNAL_HEADER_SIZE;
+    size_t head = g_journal.version < 4 ? 2 : 3;   /* type and length */
+    while (len - good >= head + 4) {
+        unsigned type = data[good];
+        size_t plen = head == 2 ? data[good + 1] : getU16(data + good + 1);
+        if (len - good < head + plen + 4 ||
+            crc32Update(0, data + good, head + plen) != getU32(data + good + head + plen)) {
+            break;
+        }
+        Reader r = { data + good + head, plen, 0, 0 };
+        if (!applyJournalRecord(type, &r)) {
+            break;
+        }
+        good += head + plen + 4;
+        (*records)++;
+    }
+    free(data);
+    if (good < len && ftruncate(fd, (off_t)good) < 0) {
+        perror(name);
+        return -1;
+    }
+    g_journal.size = good;
+    return 1;
+}
+
+/* Rebuild the last durable state at startup: the checkpoint plus every
+ * intact journal record after it. A torn record at the end of the journal
+ * (crash mid-write) is cut off. Returns 0 if the saved state is unusable. */
+int journalRecover() {
+    uint64_t seq = 0;
+    int version = SAVE_VERSION;
+    g_journal.replaying = 1;
+    int ck = loadCheckpoint(&seq, &version);
+    if (ck < 0 || !playerStoreOpen(seq)) {
+        g_journal.replaying = 0;
+        fprintf(stderr, "Move %s, %s and %s aside to start a new world.\n",
+                SAVE_FILE_NAME, JOURNAL_FILE_NAME, PLAYER_STORE_NAME);
+        return 0;
+    }
+    g_journal.checkpointSeq = seq;
+    /* Characters from an older checkpoint move to the player store */
+    g_journal.seq = seq;
+    for (int i = 0; i < g_playerTable.count; i++) {
+        playerChanged(i);
+    }
+    int upgrade = ck > 0 && version < SAVE_VERSION;
+
+    g_journal.fd = open(JOURNAL_FILE_NAME, O_RDWR | O_CREAT, 0644);
+    if (g_journal.fd < 0) {
+        g_journal.replaying = 0;
+        perror(JOURNAL_FILE_NAME);
+        return 0;
+    }
+    long records = 0;
+    int replay = replayJournal(g_journal.fd, JOURNAL_FILE_NAME, seq, &records);
+
+    /* A background checkpoint was under way: its journal follows either
+     * the old journal or, if the checkpoint got written, the checkpoint */
+    int next = 0;
+    int nextFd = replay >= 0 ? open(JOURNAL_NEXT_NAME, O_RDWR) : -1;
+    if (nextFd >= 0) {
+        next = replayJournal(nextFd, JOURNAL_NEXT_NAME, replay ? seq + 1 : seq, &records);
+        close(nextFd);
+    }
+    g_journal.replaying = 0;
+    if (replay < 0 || next < 0) {
+        return 0;
+    }
+
+    if (next || upgrade) {
+        /* Fold both journals into one checkpoint, then the new one can go;
+         * or rewrite an older checkpoint as the current format */
+        if (!journalCompact()) {
+            return 0;
+        }
+        if (upgrade) {
+            printf("Upgraded %s from save format v%d to v%d.\n", SAVE_FILE_NAME, version, SAVE_VERSION);
+        }
+    } else if (!replay) {
+        if (!journalReset(seq)) {
+            return 0;
+        }
+    } else if (g_journal.version < JOURNAL_VERSION && !journalCompact()) {
+        /* Fold an older journal into a checkpoint; new records use the
+         * current version's rules. */
+        return 0;
+    }
+    g_journal.version = JOURNAL_VERSION;
+    unlink(JOURNAL_NEXT_NAME);
+
+    if (ck > 0 || records > 0) {
+        uint64_t characters = g_playerStore.cur.count;
+        for (int i = 0; i < g_playerTable.count; i++) {
+            characters += !g_playerTable.stored[i];
+        }
+        printf("Recovered saved game: %llu character(s), %s, %ld journal record(s).\n",
+               (unsigned long long)characters, ck > 0 ? "checkpoint" : "no checkpoint", records);
+        if (g_journal.hasLastSeed) {
+            printf("It was last played with --seed %llu.\n",
+                   (unsigned long long)g_journal.lastSeed);
+        }
+    }
+
+    /* Log this run's seed, so that it can be played again with --seed */
+    unsigned char buf[8];
+    putU64(buf, g_seed);
+    journalAppend(JR_RUN_SEED, buf, sizeof(buf));
+    return 1;
+}
+
+/* Start playing as `requested`: an existing living character is restored,
+ * otherwise a new one is created. Returns 0 if that character is already
+ * being played by another session. */
+int loginPlayer(Session *s, const char *requested) {
+    char name[MAX_NAME_LEN];
+    snprintf(name, sizeof(name), "%s", requested);
+    uint64_t key;
+
+    /* Claim the character; once it is online no other session touches it */
+    pthread_mutex_lock(&g_playerLock);
+    int index = playerFindName(name, &key);
+    if (index >= 0 && g_playerTable.online[index]) {
+        pthread_mutex_unlock(&g_playerLock);
+        return 0;
+    }
+    int isNew = index < 0;
+    if (isNew) {
+        index = playerTableAdd(key, name);
+    }
+    g_playerTable.online[index] = 1;
+    pthread_mutex_unlock(&g_playerLock);
+
+    s->playerKey = key;
+    s->playerIndex = index;
+    s->state = SESSION_PLAYING;
+    rngSeed(&s->rng, g_seed, key); /* same seed and commands, same rolls */
+    if (!isNew && playerAt(index)->hp > 0) {
+        s->player = *playerAt(index);
+        sessPrintf(s, "Welcome back, %s! Type 'help' for a list of commands.\n", s->player.name);
+    } else {
+        /* New (or fallen) character */
+        initPlayer(&s->player, name);
+        journalPlayerName(key, name);
+        sessPrintf(s, "Hello, %s! Type 'help' for a list of commands.\n", s->player.name);
+    }
+    getPlayerStats(&s->player, s->journaledStats);
+    memcpy(s->savedStats, s->journaledStats, sizeof(s->savedStats));
+    journalPlayer(s);
+
+    /* Step into the starting room, in whichever region owns it */
+    s->arriving = ARRIVE_QUIET;
+    if (ownsRoom(s->player.currentRoom)) {
+        sessionArrive(s);
+    }
+    return 1;
+}
+
+/* Leaving the game: record the final state of the character */
+void logoutPlayer(Session *s) {
+    if (s->state == SESSION_NAME) {
+        return;
+    }
+    journalPlayer(s);
+    if (!s->arriving) {
+        sessionLeaveRoom(s);
+    }
+    pthread_mutex_lock(&g_playerLock);
+    g_playerTable.online[s->playerIndex] = 0;
+    pthread_mutex_unlock(&g_playerLock);
+}
+
+/*****************************************************************************
+ * PLAYER STORE
+ *
+ * Characters live in a file of their own, apart from the world state, so
+ * a game can keep millions of them without reading them all in: one is
+ * read when it logs in (or the journal names it), and written back with
+ * the next checkpoint after it changes.
+ *
+ * The file is a log-structured hash store:
+ *     header page | slot table | record*
+ *     slot   := u64 key | u64 record offset << 16 | record length
+ *     record := u32 CRC-32 of the rest | u64 key | u64 previous slot | PLAYER fields
+ * Slots are open-addressed on the character's key, the hash of its name
+ * made unique by playerFindName (key 0 = empty, a slot with no record = no
+ * such character), so a login costs a probe or two and one record read. Records are only ever appended.
+ *
+ * A commit goes with a checkpoint and has its seq. It appends the new
+ * records and syncs them, points the slots at them, then rewrites the
+ * header, whose end offset says which records count. The header keeps the
+ * commit before as well. If the game stops between a commit and its
+ * checkpoint, startup rolls the store back to the checkpoint's commit:
+ * slots past the end follow each record's previous slot back. Once the
+ * slots are half full, or old record versions outweigh the live ones,
+ * the store is copied to a new file and renamed over the old one.
+ *
+ * Only checkpoints write the store, with the world paused or in the
+ * snapshot child. Everything else reads characters that are not in the
+ * player table, which no commit under way touches.
+ *****************************************************************************/
+
+#define STORE_SLOT_SIZE   16
+#define STORE_RECORD_HEAD 20      /* CRC, key, previous slot */
+#define STORE_HEADER_USED 92
+
+/* Write all of `len` bytes at `off` */
+static int pwriteAll(int fd, const void *data, size_t len, uint64_t off) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 1;
+}
+
+static uint64_t storeDataStart(uint64_t slotCount) {
+    return PLAYER_STORE_HEADER + slotCount * STORE_SLOT_SIZE;
+}
+
+static unsigned char *putCommit(unsigned char *p, const StoreCommit *c) {
+    p = putU64(p, c->seq);
+    p = putU64(p, c->end);
+    p = putU64(p, c->count);
+    return putU64(p, c->live);
+}
+
+static void getCommit(const unsigned char *p, StoreCommit *c) {
+    c->seq = getU64(p);
+    c->end = getU64(p + 8);
+    c->count = getU64(p + 16);
+    c->live = getU64(p + 24);
+}
+
+/* Commit: write the header and make it and everything before it durable */
+static int storeWriteHeader() {
+    unsigned char hdr[STORE_HEADER_USED], *p = hdr;
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(p, PLAYER_STORE_MAGIC, sizeof(PLAYER_STORE_MAGIC));
+    p = putU32(p + 8, PLAYER_STORE_VERSION);
+    p = putU32(p, 0);
+    p = putU64(p, g_playerStore.slotCount);
+    p = putCommit(p, &g_playerStore.cur);
+    p = putCommit(p, &g_playerStore.prev);
+    putU32(p, crc32Update(0, hdr, (size_t)(p - hdr)));
+    if (!pwriteAll(g_playerStore.fd, hdr, sizeof(hdr), 0) || fdatasync(g_playerStore.fd) < 0) {
+        perror(PLAYER_STORE_NAME);
+        return 0;
+    }
+    return 1;
+}
+
+/* Read the header of the open store; 0 if it is not a valid one */
+static int storeReadHeader() {
+    unsigned char hdr[STORE_HEADER_USED];
+    if (pread(g_playerStore.fd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr, PLAYER_STORE_MAGIC, sizeof(PLAYER_STORE_MAGIC)) != 0 ||
+        getU32(hdr + 8) != PLAYER_STORE_VERSION ||
+        crc32Update(0, hdr, sizeof(hdr) - 4) != getU32(hdr + sizeof(hdr) - 4)) {
+        return 0;
+    }
+    uint64_t slotCount = getU64(hdr + 16);
+    if (slotCount < PLAYER_STORE_MIN_SLOTS || (slotCount & (slotCount - 1)) != 0) {
+        return 0;
+    }
+    g_playerStore.slotCount = slotCount;
+    getCommit(hdr + 24, &g_playerStore.cur);
+    getCommit(hdr + 56, &g_playerStore.prev);
+    return g_playerStore.cur.end >= storeDataStart(slotCount);
+}
+
+static int storeReadSlot(uint64_t i, uint64_t *key, uint64_t *loc) {
+    unsigned char slot[STORE_SLOT_SIZE];
+    if (pread(g_playerStore.fd, slot, sizeof(slot),
+              (off_t)(PLAYER_STORE_HEADER + i * STORE_SLOT_SIZE)) != (ssize_t)sizeof(slot)) {
+        return 0;
+    }
+    *key = getU64(slot);
+    *loc = getU64(slot + 8);
+    return 1;
+}
+
+static int storeWriteSlot(uint64_t i, uint64_t key, uint64_t loc) {
+    unsigned char slot[STORE_SLOT_SIZE];
+    putU64(slot, key);
+    putU64(slot + 8, loc);
+    return pwriteAll(g_playerStore.fd, slot, sizeof(slot), PLAYER_STORE_HEADER + i * STORE_SLOT_SIZE);
+}
+
+/* Slot keys are never 0, which marks an empty slot */
+static uint64_t storeKey(uint64_t key) {
+    return key ? key : 1;
+}
+
+/* Find the slot of `key`, or the empty slot where it would go. Returns
+ * the slot index and sets `loc` (0 if there is no record), or -1 on a
+ * read error. */
+static int64_t storeProbe(uint64_t key, uint64_t *loc) {
+    uint64_t mask = g_playerStore.slotCount - 1;
+    key = storeKey(key);
+    for (uint64_t i = key & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        uint64_t k;
+        if (!storeReadSlot(i, &k, loc)) {
+            return -1;
+        }
+        if (k == key) {
+            return (int64_t)i;
+        }
+        if (k == 0) {
+            *loc = 0;
+            return (int64_t)i;
+        }
+    }
+    return -1; /* full; rewrites keep it at most half full */
+}
+
+/* Read the record at `loc` into `out`; 0 if it is unreadable or damaged */
+static int storeReadRecord(uint64_t loc, ByteBuf *out) {
+    size_t len = (size_t)(loc & 0xffff);
+    out->len = 0;
+    if (len < STORE_RECORD_HEAD || !bufReserve(out, len)) {
+        return 0;
+    }
+    if (pread(g_playerStore.fd, out->data, len, (off_t)(loc >> 16)) != (ssize_t)len ||
+        crc32Update(0, out->data + 4, len - 4) != getU32(out->data)) {
+        return 0;
+    }
+    out->len = len;
+    return 1;
+}
+
+/* Copy the store as of its current commit into a new file with
+ * `slotCount` slots, dropping old record versions, and rename it over the
+ * old one. With no store open, this creates an empty one. */
+static int storeRewrite(uint64_t slotCount) {
+    char tmpName[64];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", PLAYER_STORE_NAME);
+    int fd = open(tmpName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    unsigned char *slots = calloc(slotCount, STORE_SLOT_SIZE);
+    if (fd < 0 || !slots) {
+        perror(tmpName);
+        free(slots);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    StoreCommit c = { g_playerStore.cur.seq, storeDataStart(slotCount), 0, 0 };
+    ByteBuf out = { 0 };
+    ByteBuf record = { 0 };
+    unsigned char chunk[4096 * STORE_SLOT_SIZE];
+    int ok = 1;
+    uint64_t oldSlots = g_playerStore.fd >= 0 ? g_playerStore.slotCount : 0;
+    for (uint64_t base = 0; ok && base < oldSlots; base += 4096) {
+        size_t n = (size_t)(oldSlots - base < 4096 ? oldSlots - base : 4096) * STORE_SLOT_SIZE;
+        if (pread(g_playerStore.fd, chunk, n, (off_t)(PLAYER_STORE_HEADER + base * STORE_SLOT_SIZE)) !=
+            (ssize_t)n) {
+            ok = 0;
+            break;
+        }
+        for (size_t i = 0; i < n; i += STORE_SLOT_SIZE) {
+            uint64_t key = getU64(chunk + i);
+            uint64_t loc = getU64(chunk + i + 8);
+            if (key == 0 || loc == 0) {
+                continue;
+            }
+            if (!storeReadRecord(loc, &record)) {
+                fprintf(stderr, "%s is corrupt.\n", PLAYER_STORE_NAME);
+                ok = 0;
+                break;
+            }
+            /* The old versions stay behind */
+            putU64(record.data + 12, 0);
+            putU32(record.data, crc32Update(0, record.data + 4, record.len - 4));
+            uint64_t j = key & (slotCount - 1);
+            while (getU64(slots + j * STORE_SLOT_SIZE) != 0) {
+                j = (j + 1) & (slotCount - 1);
+            }
+            putU64(slots + j * STORE_SLOT_SIZE, key);
+            putU64(slots + j * STORE_SLOT_SIZE + 8, c.end << 16 | record.len);
+            c.end += record.len;
+            c.count++;
+            c.live += record.len;
+            if (!bufAppend(&out, record.data, record.len)) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+            if (out.len >= (1 << 20)) {
+                ok = pwriteAll(fd, out.data, out.len, c.end - out.len);
+                out.len = 0;
+            }
+        }
+    }
+    ok = ok && pwriteAll(fd, out.data, out.len, c.end - out.len) &&
+         pwriteAll(fd, slots, slotCount * STORE_SLOT_SIZE, PLAYER_STORE_HEADER) &&
+         ftruncate(fd, (off_t)c.end) == 0;
+    free(out.data);
+    free(record.data);
+    free(slots);
+
+    int oldFd = g_playerStore.fd;
+    g_playerStore.fd = fd;
+    g_playerStore.slotCount = slotCount;
+    g_playerStore.cur = c;
+    g_playerStore.prev = c;
+    if (!ok || !storeWriteHeader() || rename(tmpName, PLAYER_STORE_NAME) < 0) {
+        if (!ok) {
+            perror(tmpName);
+        }
+        close(fd);
+        remove(tmpName);
+        g_playerStore.fd = oldFd;
+        if (oldFd >= 0) {
+            storeReadHeader();
+        }
+        return 0;
+    }
+    if (oldFd >= 0) {
+        close(oldFd);
+    }
+    return 1;
+}
+
+/* Undo whatever came after commit `to`: slots past its end go back along
+ * their records' previous slots, and the records are cut off */
+static int storeRollBack(const StoreCommit *to) {
+    unsigned char chunk[4096 * STORE_SLOT_SIZE];
+    unsigned char head[STORE_RECORD_HEAD];
+    uint64_t slotCount = g_playerStore.slotCount;
+    for (uint64_t base = 0; base < slotCount; base += 4096) {
+        size_t n = (size_t)(slotCount - base < 4096 ? slotCount - base : 4096) * STORE_SLOT_SIZE;
+        if (pread(g_playerStore.fd, chunk, n, (off_t)(PLAYER_STORE_HEADER + base * STORE_SLOT_SIZE)) !=
+            (ssize_t)n) {
+            perror(PLAYER_STORE_NAME);
+            return 0;
+        }
+        for (size_t i = 0; i < n; i += STORE_SLOT_SIZE) {
+            uint64_t key = getU64(chunk + i);
+            uint64_t loc = getU64(chunk + i + 8);
+            if (key == 0 || (loc >> 16) < to->end) {
+                continue;
+            }
+            /* Records were synced before any slot pointed at them */
+            while (loc && (loc >> 16) >= to->end) {
+                if (pread(g_playerStore.fd, head, sizeof(head), (off_t)(loc >> 16)) != (ssize_t)sizeof(head)) {
+                    perror(PLAYER_STORE_NAME);
+                    return 0;
+                }
+                loc = getU64(head + 12);
+            }
+            if (!storeWriteSlot(base + i / STORE_SLOT_SIZE, key, loc)) {
+                perror(PLAYER_STORE_NAME);
+                return 0;
+            }
+        }
+    }
+    g_playerStore.cur = *to;
+    g_playerStore.prev = *to;
+    if (ftruncate(g_playerStore.fd, (off_t)to->end) < 0) {
+        perror(PLAYER_STORE_NAME);
+        return 0;
+    }
+    return storeWriteHeader();
+}
+
+/* Open the player store at startup and bring it to the commit that goes
+ * with the checkpoint `seq`, creating it if there is none. Returns 0 if it
+ * cannot be used. */
+int playerStoreOpen(uint64_t seq) {
+    g_playerStore.fd = open(PLAYER_STORE_NAME, O_RDWR);
+    if (g_playerStore.fd < 0) {
+        if (errno != ENOENT) {
+            perror(PLAYER_STORE_NAME);
+            return 0;
+        }
+        g_playerStore.cur.seq = seq;
+        return storeRewrite(PLAYER_STORE_MIN_SLOTS);
+    }
+    struct stat st;
+    if (fstat(g_playerStore.fd, &st) < 0 || !storeReadHeader()) {
+        fprintf(stderr, "%s is corrupt.\n", PLAYER_STORE_NAME);
+        return 0;
+    }
+    if (g_playerStore.cur.seq == seq) {
+        /* Records past the end are from a commit that never finished */
+        StoreCommit cur = g_playerStore.cur;
+        return (uint64_t)st.st_size <= cur.end || storeRollBack(&cur);
+    }
+    if (g_playerStore.prev.seq == seq) {
+        StoreCommit prev = g_playerStore.prev;
+        return storeRollBack(&prev);
+    }
+    fprintf(stderr, "%s does not go with %s.\n", PLAYER_STORE_NAME, SAVE_FILE_NAME);
+    return 0;
+}
+
+/* Read the header again after a snapshot child wrote the store, reopening
+ * it in case the child replaced the file */
+void playerStoreReload() {
+    int fd = open(PLAYER_STORE_NAME, O_RDWR);
+    if (fd < 0) {
+        perror(PLAYER_STORE_NAME);
+        return;
+    }
+    int oldFd = g_playerStore.fd;
+    g_playerStore.fd = fd;
+    if (!storeReadHeader()) {
+        fprintf(stderr, "%s is corrupt.\n", PLAYER_STORE_NAME);
+        close(fd);
+        g_playerStore.fd = oldFd;
+        storeReadHeader();
+        return;
+    }
+    close(oldFd);
+}
+
+/* Read a character into the player table. Returns its index, or -1 if
+ * the store has no such character. */
+int playerStoreLoad(uint64_t key) {
+    static __thread ByteBuf record;
+    uint64_t loc;
+    if (g_playerStore.fd < 0) {
+        return -1;
+    }
+    /* The only copy of the character: there is no way on without it */
+    if (storeProbe(key, &loc) < 0) {
+        perror(PLAYER_STORE_NAME);
+        exit(1);
+    }
+    if (loc == 0) {
+        return -1;
+    }
+    Player p;
+    Reader r = { NULL, 0, 0, 0 };
+    if (storeReadRecord(loc, &record)) {
+        r.p = record.data + STORE_RECORD_HEAD;
+        r.len = record.len - STORE_RECORD_HEAD;
+    }
+    if (!r.p || storeKey(getU64(record.data + 4)) != storeKey(key) || !parsePlayerRecord(&r, &p)) {
+        fprintf(stderr, "%s is corrupt.\n", PLAYER_STORE_NAME);
+        exit(1);
+    }
+    int index = playerTableAdd(key, p.name);
+    *playerAt(index) = p;
+    *playerChangedSeq(index) = 0;
+    g_playerTable.stored[index] = 1;
+    return index;
+}
+
+/* Write every character that changed since the checkpoint `base` to the
+ * store, as the commit for checkpoint `seq`. World paused. */
+int playerStoreCommit(uint64_t seq, uint64_t base) {
+    /* A snapshot child may have committed since the header was read */
+    if (!storeReadHeader()) {
+        fprintf(stderr, "%s is corrupt.\n", PLAYER_STORE_NAME);
+        return 0;
+    }
+    if (g_playerStore.cur.seq != base) {
+        /* A commit whose checkpoint failed; this one replaces it */
+        StoreCommit prev = g_playerStore.prev;
+        if (prev.seq != base || !storeRollBack(&prev)) {
+            fprintf(stderr, "%s does not go with %s.\n", PLAYER_STORE_NAME, SAVE_FILE_NAME);
+            return 0;
+        }
+    }
+
+    uint64_t changed = 0, fresh = 0;
+    for (int i = 0; i < g_playerTable.count; i++) {
+        if (*playerChangedSeq(i) > base) {
+            changed++;
+            fresh += !g_playerTable.stored[i];
+        }
+    }
+    StoreCommit c = g_playerStore.cur;
+    uint64_t slotCount = g_playerStore.slotCount;
+    while ((c.count + fresh) * 2 > slotCount) {
+        slotCount *= 2;
+    }
+    uint64_t dead = c.end - storeDataStart(g_playerStore.slotCount) - c.live;
+    if ((slotCount != g_playerStore.slotCount || (dead > c.live && dead > PLAYER_STORE_SLACK)) &&
+        !storeRewrite(slotCount)) {
+        return 0;
+    }
+    if (changed == 0) {
+        g_playerStore.prev = g_playerStore.cur;
+        g_playerStore.cur.seq = seq;
+        return storeWriteHeader();
+    }
+
+    /* Append the new records, each pointing back at the slot it replaces */
+    c = g_playerStore.cur;
+    ByteBuf out = { 0 };
+    ByteBuf scratch = { 0 };
+    uint64_t *locs = malloc(changed * sizeof(uint64_t));
+    if (!locs) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    uint64_t k = 0;
+    int ok = 1;
+    for (int i = 0; ok && i < g_playerTable.count; i++) {
+        if (*playerChangedSeq(i) <= base) {
+            continue;
+        }
+        uint64_t old;
+        if (storeProbe(g_playerTable.keys[i], &old) < 0) {
+            ok = 0;
+            break;
+        }
+        size_t start = out.len;
+        unsigned char head[STORE_RECORD_HEAD];
+        memset(head, 0, sizeof(head));
+        putU64(head + 4, storeKey(g_playerTable.keys[i]));
+        putU64(head + 12, old);
+        if (!bufAppend(&out, head, sizeof(head))) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        encodePlayerRecord(&out, playerAt(i), &scratch);
+        size_t len = out.len - start;
+        if (len > UINT16_MAX) {
+            ok = 0;
+            break;
+        }
+        putU32(out.data + start, crc32Update(0, out.data + start + 4, len - 4));
+        locs[k++] = (c.end + start) << 16 | len;
+        c.live += len - (old & 0xffff);
+        c.count += old == 0;
+    }
+    ok = ok && pwriteAll(g_playerStore.fd, out.data, out.len, c.end) &&
+         fdatasync(g_playerStore.fd) == 0;
+    c.end += out.len;
+
+    /* Then the slots; probing again finds the ones taken just now */
+    k = 0;
+    for (int i = 0; ok && i < g_playerTable.count; i++) {
+        if (*playerChangedSeq(i) <= base) {
+            continue;
+        }
+        uint64_t old;
+        int64_t slot = storeProbe(g_playerTable.keys[i], &old);
+        ok = slot >= 0 && storeWriteSlot((uint64_t)slot, storeKey(g_playerTable.keys[i]), locs[k++]);
+        g_playerTable.stored[i] = 1;
+    }
+    free(out.data);
+    free(scratch.data);
+    free(locs);
+    if (!ok) {
+        perror(PLAYER_STORE_NAME);
+        return 0;
+    }
+    g_playerStore.prev = g_playerStore.cur;
+    c.seq = seq;
+    g_playerStore.cur = c;
+    return storeWriteHeader();
+}
+
+/*****************************************************************************
+ * ROOM PAGING
+ *
+ * With --room-memory, only as many rooms as the budget allows stay
+ * materialized; the others wait in a spill file. A room comes back the
+ * first time it is used again (getRoom), and cold rooms go with the CLOCK
+ * policy: getRoom marks a room referenced, a region's clock hand clears
+ * the mark on one pass and evicts the room if it is still clear on the
+ * next. A room that changed since it was last written (ROOM_DIRTY, set by
+ * roomChanged) is written back first, as the same ROOM record checkpoints
+ * use; an unchanged one is just dropped.
+ *
+ * Rooms are evicted by the worker running their region, on the clock
+ * ticks the world clock sends while the store is over budget, so eviction
+ * never races with a command. Rooms with players in them or a respawn
+ * pending are kept. When a player enters a room, the spill records of
+ * the rooms next to it are read ahead in the background, so walking on
+ * finds them in the page cache rather than waiting for the disk.
+ *
+ * The spill file is scratch space, unlinked as soon as it is created; the
+ * journal and checkpoints remain the durable copy of every room.
+ *****************************************************************************/
+
+static uint64_t g_spillEnd = 0;            /* bytes handed out so far */
+static pthread_once_t g_spillOnce = PTHREAD_ONCE_INIT;
+
+static void openSpillFile() {
+    char name[] = ROOM_SPILL_TEMPLATE;
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        perror(name);
+        return;
+    }
+    unlink(name);
+    __atomic_store_n(&g_spillFd, fd, __ATOMIC_RELEASE);
+}
+
+/* Space a spill record of `len` bytes takes up */
+static uint64_t spillSpace(uint64_t len) {
+    return (len + ROOM_SPILL_ALIGN - 1) & ~(uint64_t)(ROOM_SPILL_ALIGN - 1);
+}
+
+/* Write a materialized room's state to the spill file; 0 if it could not
+ * be written (it then stays materialized) */
+static int spillRoom(int index) {
+    static __thread ByteBuf body, nested, scratch;
+    pthread_once(&g_spillOnce, openSpillFile);
+    if (g_spillFd < 0) {
+        return 0;
+    }
+    body.len = 0;
+    encodeRoomRecord(&body, index, &nested, &scratch);
+    if (body.len > UINT16_MAX) {
+        return 0;
+    }
+    /* Rewritten in place if the record still fits where it was, unless a
+     * background checkpoint may still read the old one */
+    uint64_t old = g_roomSpill[index];
+    uint64_t off = old && spillSpace(old & 0xffff) >= body.len &&
+                   !__atomic_load_n(&g_spillAppendOnly, __ATOMIC_RELAXED)
+                 ? old >> 16
+                 : __atomic_fetch_add(&g_spillEnd, spillSpace(body.len), __ATOMIC_RELAXED);
+    if (pwrite(g_spillFd, body.data, body.len, (off_t)off) != (ssize_t)body.len) {
+        perror("room spill file");
+        return 0;
+    }
+    __atomic_store_n(&g_roomSpill[index], off << 16 | body.len, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Read an evicted room's ROOM record from the spill file into `out` */
+void readSpillRecord(int index, ByteBuf *out) {
+    uint64_t loc = g_roomSpill[index];
+    size_t len = (size_t)(loc & 0xffff);
+    out->len = 0;
+    if (!bufReserve(out, len)) {
+        fprintf(stderr, "Out of memory.\n");
+        journalCommitAndExit();
+    }
+    /* The only copy of the room: there is no way on without it */
+    if (pread(g_spillFd, out->data, len, (off_t)(loc >> 16)) != (ssize_t)len) {
+        perror("room spill file");
+        journalCommitAndExit();
+    }
+    out->len = len;
+}
+
+/* Restore an evicted room into its new slot */
+void unspillRoom(Room *room, int index) {
+    static __thread ByteBuf record;
+    readSpillRecord(index, &record);
+    Reader r = { record.data, record.len, 0, 0 };
+    RoomRecord rec;
+    if (!parseRoomRecord(&r, &rec) || rec.index != (uint32_t)index) {
+        fprintf(stderr, "Room spill file is corrupt.\n");
+        journalCommitAndExit();
+    }
+    applyRoomRecord(room, &rec);
+    g_roomFlags[index] &= (uint8_t)~ROOM_DIRTY; /* same as its spill record */
+    metricsCount(METRIC_ROOMS_PAGED_IN);
+}
+
+/* Drop a materialized room, writing it back first if it changed. Returns
+ * 0 if it has to stay. */
+static int evictRoom(int index) {
+    if ((g_roomFlags[index] & ROOM_DIRTY) && !spillRoom(index)) {
+        return 0;
+    }
+    Room *room = roomSlotPtr(g_roomSlot[index]);
+    free(room->view);
+    MonsterPool *pool = &regionOf(index)->monsters;
+    Monster *m = firstMonster(index);
+    while (m) {
+        Monster *next = nextMonster(m);
+        poolFree(pool, m);
+        m = next;
+    }
+    g_roomMonsterHead[index] = 0;
+    g_roomFlags[index] &= (uint8_t)~(ROOM_LOADED | ROOM_DIRTY | ROOM_VIEW | ROOM_REFERENCED);
+    roomFree(index);
+    metricsCount(METRIC_ROOMS_EVICTED);
+    return 1;
+}
+
+/* Start reading the spill records of the rooms around `room` */
+void prefetchNeighbours(int room) {
+    int fd = __atomic_load_n(&g_spillFd, __ATOMIC_ACQUIRE);
+    if (fd < 0) {
+        return;
+    }
+    for (int dir = 0; dir < DIR_COUNT; dir++) {
+        int next = roomExit(room, dir);
+        if (next < 0 || __atomic_load_n(&g_roomSlot[next], __ATOMIC_RELAXED)) {
+            continue;
+        }
+        uint64_t loc = __atomic_load_n(&g_roomSpill[next], __ATOMIC_RELAXED);
+        if (loc) {
+            posix_fadvise(fd, (off_t)(loc >> 16), (off_t)(loc & 0xffff), POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+/* More rooms are materialized than --room-memory allows */
+int roomStoreOverBudget() {
+    uint32_t budget = g_roomBudget;
+    return budget && __atomic_load_n(&g_roomStore.resident, __ATOMIC_RELAXED) > budget;
+}
+
+/* Evict this region's share of the rooms over budget, coldest first. The
+ * store is brought 1/16 below budget so that trimming is not needed again
+ * right away. Must run where the region's rooms may be touched. */
+void regionTrim(Region *r) {
+    uint32_t resident = __atomic_load_n(&g_roomStore.resident, __ATOMIC_RELAXED);
+    uint32_t budget = g_roomBudget;
+    if (!budget || resident <= budget) {
+        return;
+    }
+    uint32_t target = budget - budget / 16;
+    uint64_t want = ((uint64_t)(resident - target) * r->rooms + resident - 1) / resident;
+
+    int first = (int)(r - g_regions) << REGION_SHIFT;
+    int count = g_roomCount - first < (1 << REGION_SHIFT) ? g_roomCount - first : 1 << REGION_SHIFT;
+    /* Two rounds of the hand: a referenced room gets a second chance */
+    for (int step = 0; step < 2 * count && want > 0; step++) {
+        int i = first + (int)r->clockHand;
+        r->clockHand = r->clockHand + 1 < (uint32_t)count ? r->clockHand + 1 : 0;
+        uint8_t flags = g_roomFlags[i];
+        if (!(flags & ROOM_LOADED) || (flags & ROOM_RESPAWN) || g_roomPlayers[i]) {
+            continue;
+        }
+        if (flags & ROOM_REFERENCED) {
+            g_roomFlags[i] = flags & (uint8_t)~ROOM_REFERENCED;
+        } else if (evictRoom(i)) {
+            want--;
+        }
+    }
+}
+
+/* Single-threaded: trim every region */
+void roomStoreTrim() {
+    for (int i = 0; i < g_regionCount && roomStoreOverBudget(); i++) {
+        regionTrim(&g_regions[i]);
+    }
+}
+
+/*****************************************************************************
+ * WORLD CLOCK & TIMERS
+ *
+ * The world moves on in ticks of TICK_MS, following the wall clock, even
+ * when nobody types anything. Everything that happens later (respawns,
+ * regeneration, timed effects) is a timer in a hierarchical timing wheel:
+ * WHEEL_LEVELS rings of WHEEL_SLOTS buckets, where a bucket on level L
+ * spans WHEEL_SLOTS^L ticks. A timer goes into the lowest level whose range
+ * covers its delay; each time a level wraps around, the next bucket of the
+ * level above is redistributed to the levels below. Scheduling, cancelling
+ * and firing a timer are O(1) and never depend on the size of the world,
+ * and a tick with nothing due costs one empty bucket.
+ *
+ * Every region has its own wheel, holding the respawns of its rooms and
+ * the regeneration of the players standing in them, so a region's timers
+ * run on whichever worker runs the region.
+ *
+ * Monster AI runs on the same wheels. A monster never has a timer of its
+ * own: a player who is in a room with hostile monsters has one, and when
+ * it fires those monsters strike or flee. It lapses once none are left
+ * hostile there, so the AI costs nothing in rooms nobody is in, however
+ * many monsters they hold, and a region without players only wakes for
+ * its respawns.
+ *****************************************************************************/
+
+static uint64_t g_clockStartNs;
+static uint64_t g_clockTick;         /* latest tick handed out to regions */
+static uint32_t g_timersPending;     /* over all wheels */
+
+/* Start the clock at tick 0 */
+void initWorldClock() {
+    g_clockStartNs = nowNs();
+    g_clockTick = 0;
+}
+
+/* Ticks since the clock started */
+static uint64_t clockNow() {
+    return (nowNs() - g_clockStartNs) / (TICK_MS * 1000000ull);
+}
+
+static void countPending(TimerWheel *w, int delta) {
+    __atomic_add_fetch(&w->pending, (uint32_t)delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_timersPending, (uint32_t)delta, __ATOMIC_RELAXED);
+}
+
+/* Link a timer into the bucket for its due tick */
+static void wheelInsert(TimerWheel *w, uint32_t id) {
+    Timer *t = &w->pool[id];
+    uint64_t delta = t->due > w->tick ? t->due - w->tick : 0;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    uint64_t maxDue = w->tick + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (t->due > maxDue) {
+        t->due = maxDue;   /* beyond the top level: clamp */
+    }
+    int slot = (int)((t->due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    int bucket = level * WHEEL_SLOTS + slot;
+
+    t->bucket = bucket;
+    t->prev = 0;
+    t->next = w->buckets[bucket];
+    if (t->next) {
+        w->pool[t->next].prev = id;
+    }
+    w->buckets[bucket] = id;
+}
+
+/* Unlink a timer from its bucket */
+static void wheelUnlink(TimerWheel *w, uint32_t id) {
+    Timer *t = &w->pool[id];
+    if (t->prev) {
+        w->pool[t->prev].next = t->next;
+    } else {
+        w->buckets[t->bucket] = t->next;
+    }
+    if (t->next) {
+        w->pool[t->next].prev = t->prev;
+    }
+    t->bucket = -1;
+}
+
+/* Arrange for `kind` to fire on room `target` or session `s` after
+ * `delayTicks` (at least one). The timer lives in the wheel of the room's
+ * region (the session's room for session timers). Returns the timer id,
+ * for timerCancel. */
+uint32_t timerSchedule(TimerKind kind, int target, Session *s, uint32_t delayTicks) {
+    TimerWheel *w = &regionOf(s ? s->player.currentRoom : target)->wheel;
+    if (!w->freeList) {
+        uint32_t cap = w->poolCap ? w->poolCap * 2 : 64;
+        Timer *pool = realloc(w->pool, cap * sizeof(Timer));
+        if (!pool) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        /* Entry 0 stays reserved; chain the new entries into the free list */
+        for (uint32_t i = cap - 1; i >= (w->poolCap ? w->poolCap : 1); i--) {
+            pool[i].bucket = -1;
+            pool[i].next = w->freeList;
+            w->freeList = i;
+        }
+        w->pool = pool;
+        w->poolCap = cap;
+    }
+
+    uint32_t id = w->freeList;
+    Timer *t = &w->pool[id];
+    w->freeList = t->next;
+    t->due = w->tick + (delayTicks ? delayTicks : 1);
+    t->kind = kind;
+    t->target = target;
+    t->session = s;
+    wheelInsert(w, id);
+    countPending(w, 1);
+    return id;
+}
+
+/* Drop a timer that has not fired yet, given the room whose region holds
+ * it; id 0 is ignored */
+void timerCancel(int room, uint32_t id) {
+    TimerWheel *w = &regionOf(room)->wheel;
+    if (id == 0 || id >= w->poolCap || w->pool[id].bucket < 0) {
+        return;
+    }
+    wheelUnlink(w, id);
+    w->pool[id].next = w->freeList;
+    w->freeList = id;
+    countPending(w, -1);
+}
+
+/* Killed monsters come back after a while. At most one respawn is pending
+ * per room; it brings back every monster that died there. */
+void scheduleRespawn(int room) {
+    if (g_roomFlags[room] & ROOM_RESPAWN) {
+        return;
+    }
+    g_roomFlags[room] |= ROOM_RESPAWN;
+    timerSchedule(TIMER_RESPAWN, room, NULL,
+                  (uint32_t)randomInRange(&regionOf(room)->rng,
+                                            RESPAWN_MIN_TICKS, RESPAWN_MAX_TICKS));
+}
+
+/* TIMER: each dead monster in the room is replaced by a new one. New
+ * monsters stay idle until someone attacks them. */
+static void fireRespawn(int room) {
+    g_roomFlags[room] &= (uint8_t)~ROOM_RESPAWN;
+    int dead = 0;
+    for (Monster *m = firstMonster(room), *next; m; m = next) {
+        next = nextMonster(m);
+        if (m->state == MONSTER_DEAD) {
+            removeRoomMonster(m);
+            dead++;
+        }
+    }
+    if (!dead) {
+        return;
+    }
+    while (dead-- > 0) {
+        Monster *m = spawnMonster(room);
+        if (m) {
+            m->state = MONSTER_IDLE;
+        }
+    }
+    journalRoomMonsters(room);
+}
+
+/* TIMER: a living player regains a little HP and MP. Returns 1 to
+ * stay armed; the timer is cancelled when the player leaves the region. */
+static int fireRegen(Session *s) {
+    Player *p = &s->player;
+    if (p->hp <= 0) {
+        return 1;
+    }
+    if (p->hp < p->maxHp) {
+        p->hp += p->maxHp / 20 + 1;
+        if (p->hp > p->maxHp) {
+            p->hp = p->maxHp;
+        }
+    }
+    if (p->mp < p->maxMp) {
+        p->mp += p->maxMp / 20 + 1;
+        if (p->mp > p->maxMp) {
+            p->mp = p->maxMp;
+        }
+    }
+    journalPlayer(s);
+    return 1;
+}
+
+/* Run a due timer. Recurring timers are put back with the same id. */
+static void fireTimer(TimerWheel *w, uint32_t id) {
+    Timer *t = &w->pool[id];
+    wheelUnlink(w, id);
+    uint32_t rearm = 0;   /* ticks until it fires again, 0 = done */
+    switch (t->kind) {
+        case TIMER_RESPAWN:
+            fireRespawn(t->target);
+            break;
+        case TIMER_REGEN:
+            rearm = fireRegen(t->session) ? REGEN_TICKS : 0;
+            break;
+        case TIMER_MONSTER_AI:
+            rearm = monstersAct(t->session) ? MONSTER_AI_TICKS : 0;
+            break;
+    }
+
+    t = &w->pool[id]; /* the pool may have grown */
+    if (rearm) {
+        t->due = w->tick + rearm;
+        wheelInsert(w, id);
+    } else {
+        t->next = w->freeList;
+        w->freeList = id;
+        countPending(w, -1);
+    }
+}
+
+/* Move every timer in a bucket down to where it now belongs */
+static void wheelCascade(TimerWheel *w, int bucket) {
+    uint32_t id = w->buckets[bucket];
+    w->buckets[bucket] = 0;
+    while (id) {
+        uint32_t next = w->pool[id].next;
+        wheelInsert(w, id);
+        id = next;
+    }
+}
+
+/* Process one tick: cascade the levels that wrapped, then fire the
+ * timers due now. Timers scheduled while firing are never due this tick. */
+static void wheelStep(TimerWheel *w) {
+    uint64_t tick = ++w->tick;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (tick & ((1ull << (WHEEL_BITS * level)) - 1)) {
+            break;
+        }
+        wheelCascade(w, level * WHEEL_SLOTS + (int)((tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)));
+    }
+
+    uint32_t *head = &w->buckets[tick & (WHEEL_SLOTS - 1)];
+    while (*head) {
+        fireTimer(w, *head);
+    }
+}
+
+/* Run a wheel's ticks up to `now` */
+static void wheelAdvance(TimerWheel *w, uint64_t now) {
+    if (w->pending == 0) {
+        w->tick = now > w->tick ? now : w->tick;
+        return;
+    }
+    while (w->tick < now) {
+        wheelStep(w);
+    }
+}
+
+/* Single-threaded: catch every region up with the wall clock */
+void worldClockAdvance() {
+    uint64_t now = clockNow();
+    g_clockTick = now;
+    for (int i = 0; i < g_regionCount; i++) {
+        wheelAdvance(&g_regions[i].wheel, now);
+    }
+    roomStoreTrim();
+}
+
+/* Server: when a tick has passed, ask every region with timers to run
+ * its wheel, and while the room store is over budget every region with
+ * rooms materialized to trim them */
+void worldClockPost() {
+    uint64_t now = clockNow();
+    if (now <= g_clockTick) {
+        return;
+    }
+    __atomic_store_n(&g_clockTick, now, __ATOMIC_RELAXED);
+    int trim = roomStoreOverBudget();
+    if (!trim && __atomic_load_n(&g_timersPending, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    for (int i = 0; i < g_regionCount; i++) {
+        Region *r = &g_regions[i];
+        if (__atomic_load_n(&r->wheel.pending, __ATOMIC_RELAXED) > 0 ||
+            (trim && __atomic_load_n(&r->rooms, __ATOMIC_RELAXED) > 0)) {
+            regionPost(r, NULL);
+        }
+    }
+}
+
+/* Milliseconds until the next tick, or -1 if nothing is waiting for one */
+int worldClockTimeoutMs() {
+    if (__atomic_load_n(&g_timersPending, __ATOMIC_RELAXED) == 0 && !roomStoreOverBudget()) {
+        return -1;
+    }
+    uint64_t next = g_clockStartNs + (g_clockTick + 1) * TICK_MS * 1000000ull;
+    uint64_t now = nowNs();
+    return now >= next ? 0 : (int)((next - now + 999999) / 1000000ull);
+}
+
+/*****************************************************************************
+ * REGIONS & WORKER THREADS
+ *
+ * The server runs game logic on a pool of worker threads. Rooms are split
+ * into regions of 1 << REGION_SHIFT consecutive rooms, and a region is
+ * only ever run by one worker at a time, so everything inside it (room
+ * items, monsters, occupancy, its timing wheel, and the sessions of the
+ * players standing there) is used without locks.
+ *
+ * Work reaches a region as a message in its mailbox: a session with input
+ * lines to run, or a clock tick. Posting to an idle region puts it on a
+ * worker's deque. Each worker pops its own deque from the bottom and, when
+ * that is empty, steals regions from the top of the others' deques, so
+ * busy regions spread over every core.
+ *
+ * A player walking into another region's room leaves the old room, and the
+ * session is posted to the new region, which finishes the move and runs
+ * the rest of its lines (sessionArrive). Finished sessions go back to the
+ * main thread, which owns the sockets, through a done list and an eventfd.
+ *
+ * Shared state outside regions has its own locks: the journal buffer, the
+ * player table index, the item registry and the name pool.
+ *****************************************************************************/
+
+/* Worker: a thread and its deque of runnable regions */
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;       /* guards the deque */
+    Region        **deque;      /* ring, mask + 1 entries; never overflows */
+    size_t          mask;
+    size_t          top;        /* thieves take from here */
+    size_t          bottom;     /* the owner pushes and pops here */
+    int             active;     /* running a region (see schedulerPause) */
+    int             index;
+} __attribute__((aligned(64))) Worker;
+
+static struct {
+    Worker         *workers;
+    int             count;
+    int             stop;
+    int             pause;
+    int             queued;      /* regions waiting on deques */
+    int             sleepers;
+    pthread_mutex_t idleLock;
+    pthread_cond_t  idleCond;
+    pthread_mutex_t doneLock;
+    Session        *doneHead;    /* finished sessions, for the main thread */
+    Session        *noticeHead;  /* sessions with notices, for the main thread */
+    int             wakeFd;      /* eventfd: either list became non-empty */
+} g_sched = { .idleLock = PTHREAD_MUTEX_INITIALIZER,
+              .idleCond = PTHREAD_COND_INITIALIZER,
+              .doneLock = PTHREAD_MUTEX_INITIALIZER,
+              .wakeFd = -1 };
+
+static __thread Worker *t_worker = NULL;
+static __thread Region *t_region = NULL;   /* region this thread is running */
+
+/* True on a worker thread */
+int onWorkerThread() {
+    return t_worker != NULL;
+}
+
+/* True if this thread may touch `room`: single-threaded, or running the
+ * room's region */
+int ownsRoom(int room) {
+    return t_region == NULL || t_region == regionOf(room);
+}
+
+/* Queue a runnable region: on this worker's deque, or on a worker picked
+ * by region number when posted from the main thread */
+static void schedulerPush(Region *r, int atTop) {
+    Worker *w = t_worker ? t_worker
+                         : &g_sched.workers[(size_t)(r - g_regions) % (size_t)g_sched.count];
+    /* top and bottom change under the lock, but thieves peek at them
+     * without it */
+    pthread_mutex_lock(&w->lock);
+    if (atTop) {
+        size_t top = w->top - 1;
+        w->deque[top & w->mask] = r;
+        __atomic_store_n(&w->top, top, __ATOMIC_RELAXED);
+    } else {
+        w->deque[w->bottom & w->mask] = r;
+        __atomic_store_n(&w->bottom, w->bottom + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    __atomic_add_fetch(&g_sched.queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_sched.sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&g_sched.idleLock);
+        pthread_cond_signal(&g_sched.idleCond);
+        pthread_mutex_unlock(&g_sched.idleLock);
+    }
+}
+
+/* Next region for a worker: its own newest, else the oldest of another */
+static Region *schedulerTake(Worker *w) {
+    Region *r = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom != w->top) {
+        size_t bottom = w->bottom - 1;
+        r = w->deque[bottom & w->mask];
+        __atomic_store_n(&w->bottom, bottom, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 1; !r && i < g_sched.count; i++) {
+        Worker *victim = &g_sched.workers[(w->index + i) % g_sched.count];
+        if (__atomic_load_n(&victim->bottom, __ATOMIC_RELAXED) ==
+            __atomic_load_n(&victim->top, __ATOMIC_RELAXED)) {
+            continue; /* quick peek; the locked check below decides */
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom != victim->top) {
+            r = victim->deque[victim->top & victim->mask];
+            __atomic_store_n(&victim->top, victim->top + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (r) {
+        __atomic_sub_fetch(&g_sched.queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return r;
+}
+
+/* Send a session (or, with s == NULL, a clock tick) to a region. The
+ * session must not be in any other mailbox. */
+void regionPost(Region *r, Session *s) {
+    pthread_mutex_lock(&r->lock);
+    if (s) {
+        s->mailNext = NULL;
+        if (r->mailTail) {
+            r->mailTail->mailNext = s;
+        } else {
+            r->mailHead = s;
+        }
+        r->mailTail = s;
+    } else {
+        r->tickDue = 1;
+    }
+    int wake = !r->scheduled;
+    r->scheduled = 1;
+    pthread_mutex_unlock(&r->lock);
+    if (wake) {
+        schedulerPush(r, 0);
+    }
+}
+
+/* Mail an event to a region, for the players in one of its rooms */
+void regionPostEvent(Region *r, RoomEvent *ev) {
+    pthread_mutex_lock(&r->lock);
+    ev->next = NULL;
+    if (r->eventTail) {
+        r->eventTail->next = ev;
+    } else {
+        r->eventHead = ev;
+    }
+    r->eventTail = ev;
+    int wake = !r->scheduled;
+    r->scheduled = 1;
+    pthread_mutex_unlock(&r->lock);
+    if (wake) {
+        schedulerPush(r, 0);
+    }
+}
+
+/* Give a finished session back to the main thread */
+static void sessionDone(Session *s) {
+    pthread_mutex_lock(&g_sched.doneLock);
+    int wasEmpty = g_sched.doneHead == NULL;
+    s->mailNext = g_sched.doneHead;
+    g_sched.doneHead = s;
+    pthread_mutex_unlock(&g_sched.doneLock);
+    if (wasEmpty) {
+        uint64_t one = 1;
+        if (write(g_sched.wakeFd, &one, sizeof(one)) < 0) {
+            /* the counter is already non-zero: a wakeup is pending */
+        }
+    }
+}
+
+/* Main thread: take every finished session (linked through mailNext) */
+Session *schedulerTakeDone() {
+    uint64_t count;
+    if (read(g_sched.wakeFd, &count, sizeof(count)) < 0) {
+        /* nothing signalled; the list may still have entries */
+    }
+    pthread_mutex_lock(&g_sched.doneLock);
+    Session *list = g_sched.doneHead;
+    g_sched.doneHead = NULL;
+    pthread_mutex_unlock(&g_sched.doneLock);
+    return list;
+}
+
+/* Queue a notice (copied text, or a shared one) for sessionNotify */
+static void sessionNotifyQueue(Session *s, const char *text, size_t len,
+                               SharedText *shared, int died) {
+    pthread_mutex_lock(&s->noticeLock);
+    if (shared ? !queueShare(&s->notices, &s->noticeSpareRef, shared)
+               : !queueAppend(&s->notices, &s->noticeSpare, text, len)) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    s->noticePromptLen = formatPrompt(s->noticePrompt, sizeof(s->noticePrompt), &s->player);
+    s->noticeDied |= (uint8_t)died;
+    int post = !s->noticePosted;
+    s->noticePosted = 1;
+    pthread_mutex_unlock(&s->noticeLock);
+    if (!post) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_sched.doneLock);
+    int wasEmpty = g_sched.noticeHead == NULL;
+    s->noticeNext = g_sched.noticeHead;
+    g_sched.noticeHead = s;
+    pthread_mutex_unlock(&g_sched.doneLock);
+    if (wasEmpty) {
+        uint64_t one = 1;
+        if (write(g_sched.wakeFd, &one, sizeof(one)) < 0) {
+            /* the counter is already non-zero: a wakeup is pending */
+        }
+    }
+}
+
+/* Send text to a session whose output this thread may not own: a worker
+ * running a timer for a session that the main thread may be writing to.
+ * The text waits in the session until the thread that owns its output
+ * next takes it (sessionTakeNotices): the worker before running the
+ * session's next command, or the main thread, woken here, if none comes.
+ * Without workers (the console) it is written straight away. `died`
+ * means the text ends the character and the session should log out. */
+void sessionNotify(Session *s, const char *text, size_t len, int died) {
+    if (!g_sched.count) {
+        sessWrite(s, text, len);
+    } else {
+        sessionNotifyQueue(s, text, len, NULL, died);
+    }
+}
+
+/* sessionNotify for a text many sessions are sent: each queues a
+ * reference to it, and the text itself is never copied */
+void sessionNotifyShared(Session *s, SharedText *text) {
+    if (!g_sched.count) {
+        sessWriteShared(s, text);
+    } else {
+        sessionNotifyQueue(s, NULL, 0, text, 0);
+    }
+}
+
+/* Move a session's notices into its output; only the thread that owns
+ * the output may call this. Between commands the text starts on a line
+ * of its own and `withPrompt` ends it with a prompt. The chunks move
+ * over whole, so nothing is copied. Returns 1 if the notices ended the
+ * character. */
+int sessionTakeNotices(Session *s, int withPrompt) {
+    pthread_mutex_lock(&s->noticeLock);
+    int died = s->noticeDied;
+    if (s->notices.len > 0) {
+        if (withPrompt) {
+            sessWrite(s, "\n", 1);
+        }
+        queueSplice(&s->out, &s->notices);
+        if (withPrompt && !died) {
+            sessWrite(s, s->noticePrompt, (size_t)s->noticePromptLen);
+        }
+    }
+    /* Lend the notices the output's spare chunks, which come back once
+     * the notices are sent, so a steady stream allocates nothing */
+    if (!s->noticeSpare) {
+        s->noticeSpare = s->outSpare;
+        s->outSpare = NULL;
+    }
+    if (!s->noticeSpareRef) {
+        s->noticeSpareRef = s->outSpareRef;
+        s->outSpareRef = NULL;
+    }
+    pthread_mutex_unlock(&s->noticeLock);
+    return died;
+}
+
+/* Main thread: take every session that was sent notices. Call it after
+ * schedulerTakeDone: a session's notices are sent before it is done, so
+ * none of these can be closed yet. */
+Session *schedulerTakeNotices() {
+    pthread_mutex_lock(&g_sched.doneLock);
+    Session *list = g_sched.noticeHead;
+    g_sched.noticeHead = NULL;
+    pthread_mutex_unlock(&g_sched.doneLock);
+    return list;
+}
+
+/* Send text to every player in `room` but `skip`. Must run where the
+ * room may be touched. */
+static void roomDeliver(int room, const Session *skip, SharedText *text) {
+    for (Session *o = g_roomPlayers[room]; o; o = o->roomNext) {
+        if (o != skip) {
+            sessionNotifyShared(o, text);
+        }
+    }
+}
+
+/* Tell the players in `room`, except `skip` (the one who did it), about
+ * something that happened there. The line is formatted once and shared
+ * by all of them; it costs one notice per player in the room and
+ * nothing for anyone elsewhere. */
+void roomTell(int room, const Session *skip, const char *fmt, ...) {
+    Session *first = g_roomPlayers[room];
+    if (!first || (first == skip && !first->roomNext)) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    SharedText *text = sharedTextFormat(fmt, ap);
+    va_end(ap);
+    roomDeliver(room, skip, text);
+    sharedTextDrop(text);
+}
+
+/* Mail a shared text to another region's worker */
+static void regionPostText(Region *r, int room, uint64_t channel, SharedText *text) {
+    RoomEvent *ev = malloc(sizeof(RoomEvent));
+    if (!ev) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    ev->room = room;
+    ev->channel = channel;
+    ev->text = text;
+    sharedTextHold(text);
+    regionPostEvent(r, ev);
+}
+
+/* Tell the players in the rooms next to `room` about something heard
+ * through the exits. A neighbour in another region belongs to another
+ * worker: the text is mailed to that region, and only if someone seems
+ * to be there (its list head is read without the region's say-so, so a
+ * player arriving right now may miss it). */
+void roomTellNearby(int room, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    SharedText *text = sharedTextFormat(fmt, ap);
+    va_end(ap);
+    for (int d = 0; d < DIR_COUNT; d++) {
+        int next = roomExit(room, d);
+        int seen = next == room;
+        for (int e = 0; e < d && !seen; e++) {
+            seen = roomExit(room, e) == next;
+        }
+        if (next < 0 || seen) {
+            continue;
+        }
+        if (ownsRoom(next)) {
+            roomDeliver(next, NULL, text);
+        } else if (__atomic_load_n(&g_roomPlayers[next], __ATOMIC_RELAXED)) {
+            regionPostText(regionOf(next), next, 0, text);
+        }
+    }
+    sharedTextDrop(text);
+}
+
+/* Send text to the players of a region on `channel` (0 = all of them)
+ * but `skip`. Must run where the region may be touched. */
+static void regionDeliver(Region *r, const Session *skip, uint64_t channel, SharedText *text) {
+    for (Session *o = r->players; o; o = o->regionNext) {
+        if (o != skip && (channel == 0 || o->channel == channel)) {
+            sessionNotifyShared(o, text);
+        }
+    }
+}
+
+/* Send text to every player in the game on `channel` (0 = everyone) but
+ * `skip`. Regions this thread does not run get one mailed reference each,
+ * if anyone seems to be there (as in roomTellNearby), and their workers
+ * hand it on; a player between regions right now misses it. */
+void worldTell(const Session *skip, uint64_t channel, SharedText *text) {
+    for (int i = 0; i < g_regionCount; i++) {
+        Region *r = &g_regions[i];
+        if (t_region == NULL || t_region == r) {
+            regionDeliver(r, skip, channel, text);
+        } else if (__atomic_load_n(&r->players, __ATOMIC_RELAXED)) {
+            regionPostText(r, -1, channel, text);
+        }
+    }
+}
+
+/* The character leaves its room: out of the occupancy count, and its
+ * regeneration and monster timers are dropped from the region's wheel */
+void sessionLeaveRoom(Session *s) {
+    moveOccupant(s, s->player.currentRoom, -1);
+    timerCancel(s->player.currentRoom, s->regenTimer);
+    timerCancel(s->player.currentRoom, s->aiTimer);
+    s->regenTimer = 0;
+    s->aiTimer = 0;
+}
+
+/* The character enters player.currentRoom */
+void sessionEnterRoom(Session *s) {
+    moveOccupant(s, -1, s->player.currentRoom);
+    s->regenTimer = timerSchedule(TIMER_REGEN, 0, s, REGEN_TICKS);
+}
+
+/* Finish a move into player.currentRoom, on the thread that owns it */
+void sessionArrive(Session *s) {
+    int mode = s->arriving;
+    s->arriving = ARRIVE_NONE;
+    sessionEnterRoom(s);
+    if (mode == ARRIVE_LOOK) {
+        /* Walked in: hostile monsters notice. Logging in or loading a save
+         * (ARRIVE_QUIET) leaves them be until the character acts. */
+        roomTell(s->player.currentRoom, s, "%s arrives.\n", s->player.name);
+        doLook(s);
+        monsterAIArm(s);
+    }
+}
+
+/* Run a session's queued lines in the region that owns its room. Stops
+ * early if the character walks into another region: the session is then
+ * posted there and carries on with the remaining lines. */
+static void runSession(Session *s) {
+    if (s->arriving) {
+        sessionArrive(s);
+        if (s->state == SESSION_PLAYING) {
+            printPrompt(s);
+        }
+    }
+    while (s->workPos < s->work.len && s->state != SESSION_CLOSING &&
+           s->out.len < OUTPUT_HIGH_WATER) {
+        char *line = (char *)s->work.data + s->workPos;
+        size_t len = strlen(line);
+        s->workPos += len + 1;
+        sessionTakeNotices(s, 0); /* what happened before this command */
+        if (line[0] == LINE_TOO_LONG) {
+            sessPrintf(s, "Input line too long.\n");
+        } else if (!handleLine(s, line, len)) {
+            s->state = SESSION_CLOSING;
+        }
+        if (s->arriving && s->state != SESSION_CLOSING) {
+            regionPost(regionOf(s->player.currentRoom), s);
+            return;
+        }
+        if (s->state == SESSION_PLAYING) {
+            printPrompt(s);
+        }
+    }
+
+    if (s->workPos < s->work.len && s->state != SESSION_CLOSING) {
+        /* Too much unsent output: the rest waits until the client reads */
+        sessionDone(s);
+        return;
+    }
+    if ((s->hangup || s->state == SESSION_CLOSING) && !s->loggedOut) {
+        if (s->arriving) {
+            sessionArrive(s); /* died or quit on the way in */
+        }
+        logoutPlayer(s);
+        s->loggedOut = 1;
+        s->state = SESSION_CLOSING;
+    }
+    s->work.len = 0;
+    s->workPos = 0;
+    sessionDone(s);
+}
+
+/* Run one region's mailbox for up to REGION_BATCH messages */
+static void runRegion(Region *r) {
+    t_region = r;
+    for (int budget = REGION_BATCH; ; budget--) {
+        pthread_mutex_lock(&r->lock);
+        if (!r->tickDue && !r->mailHead && !r->eventHead) {
+            r->scheduled = 0;
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        if (budget == 0) {
+            /* Still busy: go to the back so other regions get a turn */
+            pthread_mutex_unlock(&r->lock);
+            schedulerPush(r, 1);
+            break;
+        }
+        Session *s = NULL;
+        RoomEvent *ev = NULL;
+        int tick = r->tickDue;
+        r->tickDue = 0;
+        if (!tick && r->eventHead) {
+            ev = r->eventHead;
+            r->eventHead = ev->next;
+            if (!r->eventHead) {
+                r->eventTail = NULL;
+            }
+        } else if (!tick) {
+            s = r->mailHead;
+            r->mailHead = s->mailNext;
+            if (!r->mailHead) {
+                r->mailTail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        if (tick) {
+            wheelAdvance(&r->wheel, __atomic_load_n(&g_clockTick, __ATOMIC_RELAXED));
+            regionTrim(r);
+        } else if (ev) {
+            if (ev->room >= 0) {
+                roomDeliver(ev->room, NULL, ev->text);
+            } else {
+                regionDeliver(r, NULL, ev->channel, ev->text);
+            }
+            sharedTextDrop(ev->text);
+            free(ev);
+        } else {
+            runSession(s);
+        }
+    }
+    t_region = NULL;
+}
+
+static void *workerMain(void *arg) {
+    Worker *w = arg;
+    t_worker = w;
+    while (1) {
+        /* `active` is raised before looking at `pause`, and schedulerPause
+         * raises `pause` before looking at `active`, so one of the two
+         * always sees the other */
+        __atomic_store_n(&w->active, 1, __ATOMIC_SEQ_CST);
+        Region *r = NULL;
+        if (!__atomic_load_n(&g_sched.pause, __ATOMIC_SEQ_CST)) {
+            r = schedulerTake(w);
+            if (r) {
+                runRegion(r);
+            }
+        }
+        __atomic_store_n(&w->active, 0, __ATOMIC_SEQ_CST);
+        if (r) {
+            continue;
+        }
+
+        pthread_mutex_lock(&g_sched.idleLock);
+        __atomic_add_fetch(&g_sched.sleepers, 1, __ATOMIC_SEQ_CST);
+        while (!g_sched.stop &&
+               (__atomic_load_n(&g_sched.pause, __ATOMIC_SEQ_CST) ||
+                __atomic_load_n(&g_sched.queued, __ATOMIC_SEQ_CST) == 0)) {
+            pthread_cond_wait(&g_sched.idleCond, &g_sched.idleLock);
+        }
+        __atomic_sub_fetch(&g_sched.sleepers, 1, __ATOMIC_SEQ_CST);
+        int stop = g_sched.stop;
+        pthread_mutex_unlock(&g_sched.idleLock);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Start `threads` workers. Returns 0 on failure. */
+int schedulerStart(int threads) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_WORKERS) {
+        threads = MAX_WORKERS;
+    }
+    if (g_sched.wakeFd < 0) {
+        g_sched.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (g_sched.wakeFd < 0) {
+            perror("eventfd");
+            return 0;
+        }
+    }
+    size_t slots = 1;
+    while (slots < (size_t)g_regionCount) {
+        slots <<= 1;
+    }
+    g_sched.workers = calloc((size_t)threads, sizeof(Worker));
+    if (!g_sched.workers) {
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    g_sched.stop = 0;
+    g_sched.count = threads;
+    for (int i = 0; i < threads; i++) {
+        Worker *w = &g_sched.workers[i];
+        w->index = i;
+        w->mask = slots - 1;
+        w->deque = calloc(slots, sizeof(Region *));
+        pthread_mutex_init(&w->lock, NULL);
+        if (!w->deque) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&g_sched.workers[i].thread, NULL, workerMain, &g_sched.workers[i]) != 0) {
+            fprintf(stderr, "Could not start worker thread %d.\n", i);
+            exit(1);
+        }
+    }
+    return 1;
+}
+
+/* Stop the workers once they have nothing left to run */
+void schedulerStop() {
+    if (!g_sched.count) {
+        return;
+    }
+    pthread_mutex_lock(&g_sched.idleLock);
+    g_sched.stop = 1;
+    pthread_cond_broadcast(&g_sched.idleCond);
+    pthread_mutex_unlock(&g_sched.idleLock);
+    for (int i = 0; i < g_sched.count; i++) {
+        pthread_join(g_sched.workers[i].thread, NULL);
+        pthread_mutex_destroy(&g_sched.workers[i].lock);
+        free(g_sched.workers[i].deque);
+    }
+    free(g_sched.workers);
+    g_sched.workers = NULL;
+    g_sched.count = 0;
+}
+
+/* Main thread: wait until no worker is inside a region, and keep them out
+ * until schedulerResume. Used to see the whole world consistently. */
+void schedulerPause() {
+    if (!g_sched.count) {
+        return;
+    }
+    __atomic_store_n(&g_sched.pause, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < g_sched.count; i++) {
+        while (__atomic_load_n(&g_sched.workers[i].active, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+    }
+}
+
+void schedulerResume() {
+    if (!g_sched.count) {
+        return;
+    }
+    pthread_mutex_lock(&g_sched.idleLock);
+    __atomic_store_n(&g_sched.pause, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&g_sched.idleCond);
+    pthread_mutex_unlock(&g_sched.idleLock);
+}
+
+/*****************************************************************************
+ * COMMAND TABLE
+ *****************************************************************************/
+
+/* Every verb the parser understands. Directions double as verbs so that
+ * "north" or just "n" works like "go north". */
+static const CommandDef g_commands[] = {
+    { "look",      { "l" },        doLook,      NULL,     NULL,    0 },
+    { "go",        { NULL },       NULL,        doGo,     NULL,    0 },
+    { "north",     { "n" },        NULL,        doGo,     "north", 0 },
+    { "south",     { "s" },        NULL,        doGo,     "south", 0 },
+    { "east",      { "e" },        NULL,        doGo,     "east",  0 },
+    { "west",      { "w" },        NULL,        doGo,     "west",  0 },
+    { "up",        { "u" },        NULL,        doGo,     "up",    0 },
+    { "down",      { "d" },        NULL,        doGo,     "down",  0 },
+    { "travel",    { NULL },       NULL,        doTravel, NULL,    0 },
+    { "take",      { "get" },      NULL,        doTake,   NULL,    0 },
+    { "drop",      { NULL },       NULL,        doDrop,   NULL,    0 },
+    { "inventory", { "inv", "i" }, doInventory, NULL,     NULL,    0 },
+    { "stats",     { NULL },       doStats,     NULL,     NULL,    0 },
+    { "attack",    { "kill" },     NULL,        doAttack, NULL,    0 },
+    { "use",       { NULL },       NULL,        doUse,    NULL,    0 },
+    { "say",       { NULL },       NULL,        doSay,    NULL,    CMD_KEEP_CASE },
+    { "shout",     { "yell" },     NULL,        doShout,  NULL,    CMD_KEEP_CASE },
+    { "channel",   { NULL },       NULL,        doChannel, NULL,   0 },
+    { "chat",      { NULL },       NULL,        doChat,   NULL,    CMD_KEEP_CASE },
+    { "help",      { "?" },        doHelp,      NULL,     NULL,    0 },
+    /* Typed in full only: save/load touch the save file, quit ends the
+     * session and metrics is for the console */
+    { "save",      { NULL },       doSave,      NULL,     NULL,    CMD_EXACT_ONLY },
+    { "load",      { NULL },       doLoad,      NULL,     NULL,    CMD_EXACT_ONLY },
+    { "quit",      { "exit" },     doQuit,      NULL,     NULL,    CMD_EXACT_ONLY },
+    { "metrics",   { NULL },       doMetrics,   NULL,     NULL,    CMD_EXACT_ONLY },
+};
+#define COMMAND_COUNT ((int)(sizeof(g_commands) / sizeof(g_commands[0])))
+
+static CmdTrieNode g_cmdTrie[MAX_CMD_TRIE_NODES];
+static int         g_cmdTrieCount = 0;
+static int16_t     g_cmdHelpIndex = -1;  /* "?" is not a letter */
+static char        g_cmdExactNames[128];  /* for help: "save, load ... and metrics" */
+
+static int16_t newTrieNode() {
+    if (g_cmdTrieCount >= MAX_CMD_TRIE_NODES) {
+        fprintf(stderr, "Command trie is full; raise MAX_CMD_TRIE_NODES.\n");
+        exit(1);
+    }
+    CmdTrieNode *node = &g_cmdTrie[g_cmdTrieCount];
+    memset(node->child, -1, sizeof(node->child));
+    node->exact = -1;
+    node->unique = -1;
+    return (int16_t)g_cmdTrieCount++;
+}
+
+/* Insert one verb for command `cmd`, updating the unique-prefix marks of
+ * every node on the path. */
+static void insertCommandName(const char *name, int16_t cmd) {
+    if (name[0] == '?') {
+        g_cmdHelpIndex = cmd;
+        return;
+    }
+
+    int16_t node = 0;
+    for (const char *c = name; *c; c++) {
+        int16_t next = g_cmdTrie[node].child[*c - 'a'];
+        if (next == -1) {
+            next = newTrieNode();
+            g_cmdTrie[node].child[*c - 'a'] = next;
+        }
+        node = next;
+
+        if (!(g_commands[cmd].flags & CMD_EXACT_ONLY)) {
+            int16_t u = g_cmdTrie[node].unique;
+            g_cmdTrie[node].unique = (u == -1 || u == cmd) ? cmd : -2;
+        }
+    }
+    g_cmdTrie[node].exact = cmd;
+}
+
+/* Build the command trie from the command table */
+void initCommands() {
+    g_cmdTrieCount = 0;
+    newTrieNode(); /* root */
+    const char *exact[COMMAND_COUNT * 4];
+    int exactCount = 0;
+    for (int16_t i = 0; i < COMMAND_COUNT; i++) {
+        insertCommandName(g_commands[i].name, i);
+        if (g_commands[i].flags & CMD_EXACT_ONLY) {
+            exact[exactCount++] = g_commands[i].name;
+        }
+        for (int a = 0; a < 3 && g_commands[i].aliases[a]; a++) {
+            insertCommandName(g_commands[i].aliases[a], i);
+            if (g_commands[i].flags & CMD_EXACT_ONLY) {
+                exact[exactCount++] = g_commands[i].aliases[a];
+            }
+        }
+    }
+
+    /* The names help lists as not abbreviable */
+    size_t len = 0;
+    g_cmdExactNames[0] = '\0';
+    for (int i = 0; i < exactCount; i++) {
+        const char *sep = i == 0 ? "" : i == exactCount - 1 ? " and " : ", ";
+        len += (size_t)snprintf(g_cmdExactNames + len, sizeof(g_cmdExactNames) - len,
+                                "%s%s", sep, exact[i]);
+        if (len >= sizeof(g_cmdExactNames)) {
+            fprintf(stderr, "Too many exact-only commands for help.\n");
+            exit(1);
+        }
+    }
+}
+
+/* Resolve a verb (exact name, alias or unique prefix) to its index in
+ * g_commands. Returns -1 if unknown and -2 if the prefix is ambiguous. */
+int findCommand(const char *verb, size_t len) {
+    if (len == 1 && verb[0] == '?') {
+        return g_cmdHelpIndex;
+    }
+
+    int16_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned idx = (unsigned char)verb[i] - 'a';
+        if (idx >= 26 || (node = g_cmdTrie[node].child[idx]) == -1) {
+            return -1;
+        }
+    }
+    if (len == 0) {
+        return -1;
+    }
+    if (g_cmdTrie[node].exact != -1) {
+        return g_cmdTrie[node].exact;
+    }
+    return g_cmdTrie[node].unique;
+}
+
+/*****************************************************************************
+ * METRICS
+ *
+ * Every thread that runs commands has its own ThreadMetrics block: per
+ * command a latency histogram and the bytes of output, plus the event
+ * counters. Only the owning thread writes a block, with plain relaxed
+ * stores, so recording a command costs two clock reads and a few adds.
+ * Readers (the `metrics` command, the snapshot file) sum all blocks.
+ *
+ * Latency histograms: values below 16 ns get a bucket each; above that,
+ * every power of two is split into 16 equal buckets, so a bucket is never
+ * wider than 1/16 of the values in it. 1024 buckets cover all of uint64.
+ *
+ * Allocation counts: building with -DMUD_ALLOC_STATS (glibc only) wraps
+ * malloc, calloc and realloc to count calls per thread. Without it the
+ * count is always 0.
+ *****************************************************************************/
+
+typedef struct ThreadMetrics {
+    struct ThreadMetrics *next;
+    uint64_t counters[METRIC_COUNT];
+    struct {
+        uint64_t    bytes;
+        LatencyHist latency;
+    } commands[COMMAND_COUNT];
+} ThreadMetrics;
+
+static const char *const g_metricNames[METRIC_COUNT] = {
+    "save commands", "load commands", "journal commits", "checkpoints",
+    "monsters spawned", "monsters killed", "items moved", "rooms paged in",
+    "rooms evicted"
+};
+
+static ThreadMetrics *g_metricsList = NULL;   /* every thread's block */
+static pthread_mutex_t g_metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadMetrics *t_metrics = NULL;
+static uint64_t g_metricsStartNs;
+static uint64_t g_metricsDumpNs;             /* next snapshot is due */
+static const char *g_metricsFile = NULL;     /* server: METRICS_FILE_NAME */
+
+/* Add to a value only this thread writes but any thread may read */
+static inline void counterAdd(uint64_t *v, uint64_t n) {
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int histBucket(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS)) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           (int)((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/* Highest value that lands in a bucket */
+static uint64_t histBucketTop(int b) {
+    if (b < (1 << HIST_SUB_BITS)) {
+        return (uint64_t)b;
+    }
+    int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t low = (uint64_t)((1 << HIST_SUB_BITS) | (b & ((1 << HIST_SUB_BITS) - 1)))
+                   << (e - HIST_SUB_BITS);
+    return low + (1ull << (e - HIST_SUB_BITS)) - 1;
+}
+
+/* Record a value. A histogram has one writer; others may read it. */
+void histRecord(LatencyHist *h, uint64_t ns) {
+    counterAdd(&h->count, 1);
+    counterAdd(&h->buckets[histBucket(ns)], 1);
+    if (ns > h->max) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+/* Add another thread's histogram into `into` */
+static void histMerge(LatencyHist *into, const LatencyHist *from) {
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) {
+        into->max = max;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        into->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+/* The value below which a fraction q of the recorded values fall */
+uint64_t histPercentile(const LatencyHist *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            uint64_t top = histBucketTop(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+#if defined(MUD_ALLOC_STATS)
+static __thread uint64_t t_allocations;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    t_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    t_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    t_allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+/* Allocations made by this thread so far */
+uint64_t allocationCount() {
+    return t_allocations;
+}
+#else
+uint64_t allocationCount() {
+    return 0;
+}
+#endif
+
+/* This thread's block, registered on first use and kept for good */
+static ThreadMetrics *threadMetrics() {
+    ThreadMetrics *m = t_metrics;
+    if (!m) {
+        m = calloc(1, sizeof(ThreadMetrics));
+        if (!m) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        pthread_mutex_lock(&g_metricsLock);
+        m->next = g_metricsList;
+        g_metricsList = m;
+        pthread_mutex_unlock(&g_metricsLock);
+        t_metrics = m;
+    }
+    return m;
+}
+
+/* Start the uptime clock; snapshots go to `file` (NULL = none) */
+void initMetrics(const char *file) {
+    g_metricsStartNs = nowNs();
+    g_metricsFile = file;
+    g_metricsDumpNs = g_metricsStartNs + METRICS_DUMP_MS * 1000000ull;
+}
+
+/* Count one event */
+void metricsCount(MetricCounter c) {
+    counterAdd(&threadMetrics()->counters[c], 1);
+}
+
+/* Record one run of command `cmd` (an index into g_commands) */
+static void metricsCommand(int cmd, uint64_t ns, size_t bytes) {
+    ThreadMetrics *m = threadMetrics();
+    counterAdd(&m->commands[cmd].bytes, bytes);
+    histRecord(&m->commands[cmd].latency, ns);
+}
+
+/* Sum every thread's metrics and write them out as text */
+void metricsRender(ByteBuf *b) {
+    ThreadMetrics *sum = calloc(1, sizeof(ThreadMetrics));
+    if (!sum) {
+        return;
+    }
+    pthread_mutex_lock(&g_metricsLock);
+    for (const ThreadMetrics *m = g_metricsList; m; m = m->next) {
+        for (int c = 0; c < METRIC_COUNT; c++) {
+            sum->counters[c] += __atomic_load_n(&m->counters[c], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < COMMAND_COUNT; i++) {
+            sum->commands[i].bytes += __atomic_load_n(&m->commands[i].bytes, __ATOMIC_RELAXED);
+            histMerge(&sum->commands[i].latency, &m->commands[i].latency);
+        }
+    }
+    pthread_mutex_unlock(&g_metricsLock);
+
+    bufPrintf(b, "Metrics after %.1f s:\n", (double)(nowNs() - g_metricsStartNs) / 1e9);
+    bufPrintf(b, "  %-10s %10s %9s %9s %9s %9s %9s\n",
+              "command", "count", "bytes/cmd", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int i = 0; i < COMMAND_COUNT; i++) {
+        const LatencyHist *h = &sum->commands[i].latency;
+        if (h->count == 0) {
+            continue;
+        }
+        bufPrintf(b, "  %-10s %10llu %9.1f %9.2f %9.2f %9.2f %9.2f\n",
+                  g_commands[i].name, (unsigned long long)h->count,
+                  (double)sum->commands[i].bytes / (double)h->count,
+                  histPercentile(h, 0.50) / 1e3, histPercentile(h, 0.99) / 1e3,
+                  histPercentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+    for (int c = 0; c < METRIC_COUNT; c++) {
+        bufPrintf(b, "  %-17s %10llu\n", g_metricNames[c], (unsigned long long)sum->counters[c]);
+    }
+    free(sum);
+}
+
+/* Milliseconds until the next snapshot is due, or -1 if there is none */
+int metricsTimeoutMs() {
+    if (!g_metricsFile) {
+        return -1;
+    }
+    uint64_t now = nowNs();
+    return now >= g_metricsDumpNs ? 0 : (int)((g_metricsDumpNs - now + 999999) / 1000000);
+}
+
+/* Replace the snapshot file if it is due. The new text is written to a
+ * temporary file and renamed over the old one, so readers never see a
+ * half-written snapshot. */
+void metricsMaybeDump() {
+    if (metricsTimeoutMs() != 0) {
+        return;
+    }
+    g_metricsDumpNs = nowNs() + METRICS_DUMP_MS * 1000000ull;
+
+    ByteBuf text = { 0 };
+    metricsRender(&text);
+    char tmpName[1024];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", g_metricsFile);
+    FILE *f = fopen(tmpName, "w");
+    int ok = f != NULL;
+    if (f) {
+        ok = fwrite(text.data, 1, text.len, f) == text.len;
+        ok = fclose(f) == 0 && ok;
+    }
+    if (!ok || rename(tmpName, g_metricsFile) < 0) {
+        perror(g_metricsFile);
+        g_metricsFile = NULL; /* don't keep failing every few seconds */
+    }
+    free(text.data);
+}
+
+/*****************************************************************************
+ * GAME LOOP & COMMANDS
+ *****************************************************************************/
+
+/* Console game loop: a single session reading from stdin */
+void gameLoop() {
+    char inputBuf[MAX_INPUT_LEN];
+    Session *s = &g_console;
+    
+    while (1) {
+        printPrompt(s);
+        consoleFlush();
+        journalCommit(); /* nothing else to batch with while we wait */
+        
+        if (fgets(inputBuf, MAX_INPUT_LEN, stdin) == NULL) {
+            printf("Error reading command.\n");
+            if (feof(stdin)) {
+                break;
+            }
+            continue;
+        }
+        worldClockAdvance(); /* the world moved on while we waited */
+
+        if (!handleLine(s, inputBuf, strlen(inputBuf))) {
+            break;
+        }
+    }
+}
+
+/* Process one line of input for a session. `line` must have room for a
+ * terminator at line[len]. Returns 0 once the session ends. */
+int handleLine(Session *s, char *line, size_t len) {
+    /* The first line on a network session is the character name */
+    if (s->state == SESSION_NAME) {
+        char *input = trimWhitespace(line);
+        if (strlen(input) == 0) {
+            input = "Hero";
+        }
+        if (!loginPlayer(s, input)) {
+            sessPrintf(s, "%s is already playing. Enter another name: ", input);
+        }
+        return 1;
+    }
+
+    if (s->player.hp <= 0) {
+        return 0; /* killed by a monster since the last command */
+    }
+    parseCommand(s, line, len);
+    journalPlayer(s);
+    if (s->state == SESSION_CLOSING) {
+        return 0;
+    }
+    
+    /* Check if player is dead */
+    if (s->player.hp <= 0) {
+        sessPrintf(s, "You have died. Game Over.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Print the status prompt shown before each command */
+void printPrompt(Session *s) {
+    char prompt[MAX_PROMPT_LEN];
+    sessWrite(s, prompt, (size_t)formatPrompt(prompt, sizeof(prompt), &s->player));
+}
+
+/* Format the status prompt into buf. Returns its length. */
+int formatPrompt(char *buf, size_t size, const Player *p) {
+    int n = snprintf(buf, size, "\n[%s, L%d, HP:%d/%d, MP:%d/%d, Gold:%d] > ",
+                     p->name,
+                     p->level,
+                     p->hp,
+                     p->maxHp,
+                     p->mp,
+                     p->maxMp,
+                     p->gold);
+    return n < 0 ? 0 : (size_t)n >= size ? (int)size - 1 : n;
+}
+
+/* Handle user input commands. The line is case-folded and split in place. */
+void parseCommand(Session *s, char *input, size_t len) {
+    /* Chat passes on the words as typed, so keep them before folding */
+    char raw[MAX_INPUT_LEN + 1];
+    size_t kept = len < sizeof(raw) ? len : 0;
+    memcpy(raw, input, kept);
+
+    CommandLine cl;
+    tokenizeLine(input, len, &cl);
+    if (kept && cl.tokenCount > 0) {
+        size_t at = (size_t)(cl.args.ptr - input);
+        raw[at + cl.args.len] = '\0';
+        cl.rawArgs = raw + at;
+    }
+    dispatchCommand(s, &cl);
+}
+
+/* Run a tokenized command line */
+void dispatchCommand(Session *s, const CommandLine *cl) {
+    if (cl->verb.len == 0) {
+        return;
+    }
+
+    int index = findCommand(cl->verb.ptr, cl->verb.len);
+    if (index == -2) {
+        sessPrintf(s, "Ambiguous command: %.*s\n", (int)cl->verb.len, cl->verb.ptr);
+        sessPrintf(s, "Type more letters, or 'help' to see available commands.\n");
+        return;
+    }
+    if (index < 0) {
+        sessPrintf(s, "Unknown command: %.*s\n", (int)cl->verb.len, cl->verb.ptr);
+        sessPrintf(s, "Type 'help' to see available commands.\n");
+        return;
+    }
+
+    /* args is NUL-terminated in place by tokenizeLine */
+    const CommandDef *def = &g_commands[index];
+    size_t outBefore = s->out.len;
+    uint64_t t0 = nowNs();
+    if (def->run) {
+        def->run(s);
+    } else if (def->fixedArg) {
+        def->runArg(s, def->fixedArg);
+    } else {
+        def->runArg(s, (def->flags & CMD_KEEP_CASE) && cl->rawArgs ? cl->rawArgs : cl->args.ptr);
+    }
+    metricsCommand(index, nowNs() - t0, s->out.len - outBefore);
+}
+
+/* How `look` lists each exit, and how commands and messages name it */
+static const char *const g_dirLabels[DIR_COUNT] = {
+    "North", "South", "East", "West", "Up", "Down"
+};
+static const char *const g_dirNames[DIR_COUNT] = {
+    "north", "south", "east", "west", "up", "down"
+};
+
+/* Render what `look` shows in a room into room->view */
+static void renderRoomView(Room *room) {
+    static __thread ByteBuf scratch;
+    ByteBuf *b = &scratch;
+    b->len = 0;
+
+    int ok = bufPrintf(b, "=== %s ===\n%s\n", room->name, room->description);
+    
+    /* Items on the ground */
+    if (room->ground.count > 0) {
+        ok &= bufPrintf(b, "You see the following items on the ground:\n");
+        for (int i = 0; i < room->ground.count; i++) {
+            ok &= bufPrintf(b, "  - %s\n", itemProto(room->ground.items[i])->name);
+        }
+    } else {
+        ok &= bufPrintf(b, "There are no items here.\n");
+    }
+    
+    /* Living monsters; numbered when there are several to pick from */
+    int living = 0;
+    for (const Monster *m = firstMonster(room->id); m; m = nextMonster(m)) {
+        living += m->state != MONSTER_DEAD;
+    }
+    if (living > 1) {
+        ok &= bufPrintf(b, "Monsters here (attack <number> picks one):\n");
+    }
+    int shown = 0;
+    for (const Monster *m = firstMonster(room->id); m; m = nextMonster(m)) {
+        if (m->state == MONSTER_DEAD) {
+            continue;
+        }
+        if (living > 1) {
+            ok &= bufPrintf(b, "  %d) ", ++shown);
+        }
+        ok &= bufPrintf(b, "A %s %s here (Lvl %d, HP %d/%d).\n",
+                        m->name,
+                        m->state == MONSTER_IDLE ? "wanders" : "lurks",
+                        m->level,
+                        m->hp,
+                        m->maxHp);
+    }
+    
+    uint32_t exits = (uint32_t)b->len;
+    ok &= bufPrintf(b, "Exits:\n");
+    for (int i = 0; i < DIR_COUNT; i++) {
+        if (roomExit(room->id, i) != -1) {
+            ok &= bufPrintf(b, "  %s\n", g_dirLabels[i]);
+        }
+    }
+
+    char *view = ok ? realloc(room->view, b->len) : NULL;
+    if (!view) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(view, b->data, b->len);
+    room->view = view;
+    room->viewLen = (uint32_t)b->len;
+    room->viewExits = exits;
+    g_roomFlags[room->id] |= ROOM_VIEW;
+}
+
+/* COMMAND: look. The room's text is rendered once and then copied out
+ * until something in the room changes. The other players here are named
+ * just before the exits, up to LOOK_PLAYERS_SHOWN of them. */
+void doLook(Session *s) {
+    Room *room = getRoom(s->player.currentRoom);
+    if (!(g_roomFlags[room->id] & ROOM_VIEW)) {
+        renderRoomView(room);
+    }
+    sessWrite(s, room->view, room->viewExits);
+    int shown = 0;
+    for (const Session *o = g_roomPlayers[room->id]; o && shown < LOOK_PLAYERS_SHOWN; o = o->roomNext) {
+        if (o != s) {
+            sessPrintf(s, "%s%s", shown++ ? ", " : "Players here: ", o->player.name);
+        }
+    }
+    int more = (int)g_roomOccupants[room->id] - 1 - shown;
+    if (shown && more > 0) {
+        sessPrintf(s, " and %d more", more);
+    }
+    if (shown) {
+        sessWrite(s, ".\n", 2);
+    }
+    sessWrite(s, room->view + room->viewExits, room->viewLen - room->viewExits);
+}
+
+/* COMMAND: go <direction> */
+void doGo(Session *s, const char *direction) {
+    Player *p = &s->player;
+    if (strlen(direction) == 0) {
+        sessPrintf(s, "Go where?\n");
+        return;
+    }
+    
+    int dirIndex = getExitIndexByName(direction);
+    if (dirIndex == -1) {
+        sessPrintf(s, "Invalid direction. Try north, south, east, west, up, down.\n");
+        return;
+    }
+    
+    int nextRoom = roomExit(p->currentRoom, dirIndex);
+    if (nextRoom == -1) {
+        sessPrintf(s, "You can't go that way.\n");
+        return;
+    }
+    moveTo(s, nextRoom);
+}
+
+/* Move the player to another room and look around there */
+void moveTo(Session *s, int nextRoom) {
+    Player *p = &s->player;
+    int dir = 0;
+    while (dir < DIR_COUNT && roomExit(p->currentRoom, dir) != nextRoom) {
+        dir++;
+    }
+    if (dir < DIR_COUNT) {
+        roomTell(p->currentRoom, s, "%s leaves %s.\n", p->name, g_dirNames[dir]);
+    } else {
+        roomTell(p->currentRoom, s, "%s leaves.\n", p->name);
+    }
+    if (regionOf(nextRoom) != regionOf(p->currentRoom)) {
+        /* Another region's room: leave this one, and arrive over there */
+        sessionLeaveRoom(s);
+        p->currentRoom = nextRoom;
+        s->arriving = ARRIVE_LOOK;
+        if (ownsRoom(nextRoom)) {
+            sessionArrive(s);
+        }
+        return;
+    }
+    int from = p->currentRoom;
+    moveOccupant(s, from, nextRoom);
+    p->currentRoom = nextRoom;
+    roomTell(nextRoom, s, "%s arrives.\n", p->name);
+    int chased = monsterPursue(s, from);
+    doLook(s);
+    if (chased) {
+        sessPrintf(s, "The %s follows you!\n", monsterFromRef(nextRoom, s->target)->name);
+    }
+    monsterAIArm(s);
+}
+
+/* COMMAND: travel <room name> */
+void doTravel(Session *s, const char *roomName) {
+    Player *p = &s->player;
+    if (strlen(roomName) == 0) {
+        sessPrintf(s, "Travel where?\n");
+        return;
+    }
+
+    int dest = getRoomIndexByName(roomName);
+    if (dest == -1) {
+        sessPrintf(s, "There is no place called %s.\n", roomName);
+        return;
+    }
+    if (dest == p->currentRoom) {
+        sessPrintf(s, "You are already there.\n");
+        return;
+    }
+    uint8_t *dirs;
+    int len = findRoute(p->currentRoom, dest, &dirs);
+    if (len < 0) {
+        sessPrintf(s, "You can't find a way to %s from here.\n",
+                   worldString(g_worldRooms[dest].nameOff));
+        return;
+    }
+
+    /* Describe the route as runs of one direction: "north x12, east x3" */
+    char summary[TRAVEL_LEGS_SHOWN * 16 + 16];
+    size_t used = 0;
+    int legs = 0;
+    for (int i = 0; i < len && legs < TRAVEL_LEGS_SHOWN; legs++) {
+        int run = i;
+        while (run < len && dirs[run] == dirs[i]) {
+            run++;
+        }
+        used += (size_t)snprintf(summary + used, sizeof(summary) - used, "%s%s x%d",
+                                 legs ? ", " : "", g_dirNames[dirs[i]], run - i);
+        i = run;
+        if (i < len && legs + 1 == TRAVEL_LEGS_SHOWN) {
+            snprintf(summary + used, sizeof(summary) - used, ", ...");
+        }
+    }
+    free(dirs);
+    sessPrintf(s, "You travel %s (%d room%s).\n", summary, len, len == 1 ? "" : "s");
+    moveTo(s, dest);
+}
+
+/* COMMAND: take <item> */
+void doTake(Session *s, const char *itemName) {
+    Player *p = &s->player;
+    if (strlen(itemName) == 0) {
+        sessPrintf(s, "Take what?\n");
+        return;
+    }
+    
+    Room *room = getRoom(p->currentRoom);
+    int index = findItemInRoom(room, itemName);
+    if (index == -2) {
+        sessPrintf(s, "Which %s do you mean? Be more specific.\n", itemName);
+        return;
+    }
+    if (index == -1) {
+        sessPrintf(s, "There is no %s here.\n", itemName);
+        return;
+    }
+    
+    if (p->inventory.count >= MAX_INVENTORY_SIZE) {
+        sessPrintf(s, "Your inventory is full!\n");
+        return;
+    }
+    
+    ItemId item = room->ground.items[index];
+    journalItemMove(HOLDER_ROOM, (uint64_t)room->id, index, HOLDER_PLAYER, s->playerKey);
+    addItemToInventory(&p->inventory, item);
+    removeItemFromRoom(room, index);
+    metricsCount(METRIC_ITEM_MOVES);
+    sessPrintf(s, "You picked up %s.\n", itemProto(item)->name);
+    roomTell(room->id, s, "%s picks up %s.\n", p->name, itemProto(item)->name);
+}
+
+/* COMMAND: drop <item> */
+void doDrop(Session *s, const char *itemName) {
+    Player *p = &s->player;
+    if (strlen(itemName) == 0) {
+        sessPrintf(s, "Drop what?\n");
+        return;
+    }
+    
+    Inventory *inv = &p->inventory;
+    int index = findItemInInventory(inv, itemName);
+    if (index == -2) {
+        sessPrintf(s, "Which %s do you mean? Be more specific.\n", itemName);
+        return;
+    }
+    if (index == -1) {
+        sessPrintf(s, "You don't have %s.\n", itemName);
+        return;
+    }
+    
+    /* Drop item in current room */
+    Room *room = getRoom(p->currentRoom);
+    if (room->ground.count >= MAX_INVENTORY_SIZE) {
+        sessPrintf(s, "There's no space to drop this here.\n");
+        return;
+    }
+    
+    ItemId item = inv->items[index];
+    journalItemMove(HOLDER_PLAYER, s->playerKey, index, HOLDER_ROOM, (uint64_t)room->id);
+    addItemToRoom(room, item);
+    removeItemFromInventory(inv, index);
+    metricsCount(METRIC_ITEM_MOVES);
+    sessPrintf(s, "You dropped %s.\n", itemProto(item)->name);
+    roomTell(room->id, s, "%s drops %s.\n", p->name, itemProto(item)->name);
+}
+
+/* COMMAND: inventory */
+void doInventory(Session *s) {
+    Player *p = &s->player;
+    Inventory *inv = &p->inventory;
+    if (inv->count == 0) {
+        sessPrintf(s, "Your inventory is empty.\n");
+        return;
+    }
+    
+    sessPrintf(s, "You are carrying:\n");
+    for (int i = 0; i < inv->count; i++) {
+        sessPrintf(s, "  - %s\n", itemProto(inv->items[i])->name);
+    }
+}
+
+/* COMMAND: stats */
+void doStats(Session *s) {
+    Player *p = &s->player;
+    sessPrintf(s, "=== %s ===\n", p->name);
+    sessPrintf(s, "Level: %d\n", p->level);
+    sessPrintf(s, "EXP: %d / %d\n", p->exp, p->expToNextLevel);
+    sessPrintf(s, "HP: %d / %d\n", p->hp, p->maxHp);
+    sessPrintf(s, "MP: %d / %d\n", p->mp, p->maxMp);
+    sessPrintf(s, "Attack Power: %d\n", p->attackPower);
+    sessPrintf(s, "Gold: %d\n", p->gold);
+}
+
+/* The living monster `attack <target>` means: the n-th one `look` lists,
+ * the first whose name starts with `target`, or with no target the one
+ * last attacked if it is still here, else the first */
+static Monster *attackTarget(Session *s, int room, const char *target) {
+    if (*target == '\0') {
+        Monster *m = monsterFromRef(room, s->target);
+        if (m && m->state != MONSTER_DEAD) {
+            return m;
+        }
+    }
+    char *end;
+    long number = strtol(target, &end, 10);
+    int byNumber = *target != '\0' && *end == '\0';
+    size_t len = strlen(target);
+    long seen = 0;
+    for (Monster *m = firstMonster(room); m; m = nextMonster(m)) {
+        if (m->state == MONSTER_DEAD) {
+            continue;
+        }
+        seen++;
+        if (byNumber ? seen == number : strncasecmp(m->name, target, len) == 0) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+/* COMMAND: attack [number | name] */
+void doAttack(Session *s, const char *target) {
+    Player *p = &s->player;
+    Room *room = getRoom(p->currentRoom);
+    Monster *monster = attackTarget(s, room->id, target);
+    if (!monster) {
+        if (isdigit((unsigned char)*target) && firstMonster(room->id)) {
+            sessPrintf(s, "There is no monster %s here.\n", target);
+        } else if (*target && firstMonster(room->id)) {
+            sessPrintf(s, "There is no %s here to attack.\n", target);
+        } else {
+            sessPrintf(s, "There's nothing here to attack.\n");
+        }
+        return;
+    }
+    
+    s->target = monsterRef(monster);
+    monster->state = MONSTER_AGGRESSIVE; /* provoked, if it was idle */
+    combatWithMonster(s, monster);
+    monsterAIArm(s);
+    roomChanged(room->id);
+    /* If monster was killed, reward the player */
+    if (monster->state == MONSTER_DEAD) {
+        sessPrintf(s, "You defeated the %s!\n", monster->name);
+        roomTell(room->id, s, "%s defeated the %s!\n", p->name, monster->name);
+        roomTellNearby(room->id, "You hear the death cry of a %s nearby.\n", monster->name);
+        int gold, exp;
+        int levelled = awardKill(&s->rng, p, monster->level, &gold, &exp);
+        sessPrintf(s, "You gained %d gold and %d exp.\n", gold, exp);
+        
+        if (levelled) {
+            sessPrintf(s, "Congratulations! You are now level %d!\n", p->level);
+        }
+        
+        /* Another monster turns up here after a while */
+        scheduleRespawn(room->id);
+    }
+    journalRoomMonsters(room->id);
+}
+
+/* COMMAND: use <item> */
+void doUse(Session *s, const char *itemName) {
+    Player *p = &s->player;
+    if (strlen(itemName) == 0) {
+        sessPrintf(s, "Use what?\n");
+        return;
+    }
+    
+    Inventory *inv = &p->inventory;
+    int index = findItemInInventory(inv, itemName);
+    if (index == -2) {
+        sessPrintf(s, "Which %s do you mean? Be more specific.\n", itemName);
+        return;
+    }
+    if (index == -1) {
+        sessPrintf(s, "You don't have %s.\n", itemName);
+        return;
+    }
+    
+    const Item *item = itemProto(inv->items[index]);
+    if (item->type == ITEM_POTION) {
+        /* Use it to restore HP or MP */
+        if (strstr(item->name, "health") || strstr(item->name, "Health")) {
+            p->hp += item->power;
+            if (p->hp > p->maxHp) {
+                p->hp = p->maxHp;
+            }
+            sessPrintf(s, "You used %s. Your HP is now %d/%d.\n",
+                       item->name,
+                       p->hp,
+                       p->maxHp);
+        } else if (strstr(item->name, "mana") || strstr(item->name, "Mana")) {
+            p->mp += item->power;
+            if (p->mp > p->maxMp) {
+                p->mp = p->maxMp;
+            }
+            sessPrintf(s, "You used %s. Your MP is now %d/%d.\n",
+                       item->name,
+                       p->mp,
+                       p->maxMp);
+        } else {
+            /* Generic potion effect: restore HP or do something else */
+            p->hp += item->power;
+            if (p->hp > p->maxHp) {
+                p->hp = p->maxHp;
+            }
+            sessPrintf(s, "You used %s. It restored %d HP. HP is now %d/%d.\n",
+                       item->name,
+                       item->power,
+                       p->hp,
+                       p->maxHp);
+        }
+        
+        journalItemConsume(HOLDER_PLAYER, s->playerKey, index);
+        removeItemFromInventory(inv, index);
+    } else {
+        sessPrintf(s, "You can't 'use' that item directly.\n");
+    }
+}
+
+/* COMMAND: say <message>. Heard by everyone in the room. */
+void doSay(Session *s, const char *message) {
+    if (message[0] == '\0') {
+        sessPrintf(s, "Say what?\n");
+        return;
+    }
+    sessPrintf(s, "You say: %s\n", message);
+    roomTell(s->player.currentRoom, s, "%s says: %s\n", s->player.name, message);
+}
+
+/* COMMAND: shout <message>. Heard by everyone in the game. */
+void doShout(Session *s, const char *message) {
+    if (message[0] == '\0') {
+        sessPrintf(s, "Shout what?\n");
+        return;
+    }
+    sessPrintf(s, "You shout: %s\n", message);
+    SharedText *text = sharedTextPrintf("%s shouts: %s\n", s->player.name, message);
+    worldTell(s, 0, text);
+    sharedTextDrop(text);
+}
+
+/* COMMAND: channel [name | off]. Tune in to a chat channel, or out. */
+void doChannel(Session *s, const char *name) {
+    if (name[0] == '\0') {
+        if (s->channel) {
+            sessPrintf(s, "You are on channel %s.\n", s->channelName);
+        } else {
+            sessPrintf(s, "You are not on a channel. Type 'channel <name>' to join one.\n");
+        }
+        return;
+    }
+    if (strcmp(name, "off") == 0) {
+        if (s->channel) {
+            sessPrintf(s, "You leave channel %s.\n", s->channelName);
+        }
+        s->channel = 0;
+        s->channelName[0] = '\0';
+        return;
+    }
+    size_t len = strlen(name);
+    int valid = len < MAX_CHANNEL_LEN;
+    for (size_t i = 0; valid && i < len; i++) {
+        valid = isalnum((unsigned char)name[i]);
+    }
+    if (!valid) {
+        sessPrintf(s, "A channel name is up to %d letters and digits.\n", MAX_CHANNEL_LEN - 1);
+        return;
+    }
+    memcpy(s->channelName, name, len + 1);
+    s->channel = hashBytes(name, len) | 1; /* never 0, which means none */
+    sessPrintf(s, "You join channel %s.\n", s->channelName);
+}
+
+/* COMMAND: chat <message>. Heard by everyone on the same channel. */
+void doChat(Session *s, const char *message) {
+    if (!s->channel) {
+        sessPrintf(s, "You are not on a channel. Type 'channel <name>' to join one.\n");
+        return;
+    }
+    if (message[0] == '\0') {
+        sessPrintf(s, "Chat what?\n");
+        return;
+    }
+    sessPrintf(s, "[%s] You: %s\n", s->channelName, message);
+    SharedText *text = sharedTextPrintf("[%s] %s: %s\n", s->channelName, s->player.name, message);
+    worldTell(s, s->channel, text);
+    sharedTextDrop(text);
+}
+
+/* COMMAND: help */
+void doHelp(Session *s) {
+    sessPrintf(s, "Available commands:\n");
+    sessPrintf(s, "  look (l)           - Look around the room\n");
+    sessPrintf(s, "  go <direction>     - Move to another room (north, south, east, west, up, down)\n");
+    sessPrintf(s, "  n/s/e/w/u/d        - Shorthand for go <direction>\n");
+    sessPrintf(s, "  travel <room>      - Walk the shortest way to a room you name\n");
+    sessPrintf(s, "  take <item>        - Pick up an item from the ground\n");
+    sessPrintf(s, "  drop <item>        - Drop an item onto the ground\n");
+    sessPrintf(s, "  inventory (inv, i) - Show your inventory\n");
+    sessPrintf(s, "  stats              - Show player stats\n");
+    sessPrintf(s, "  attack [n | name]  - Attack a monster (the n-th one look lists)\n");
+    sessPrintf(s, "  use <item>         - Use an item (e.g., potion)\n");
+    sessPrintf(s, "  say <message>      - Talk to the players in the room\n");
+    sessPrintf(s, "  shout <message>    - Talk to every player in the game\n");
+    sessPrintf(s, "  channel [name|off] - Join or leave a chat channel\n");
+    sessPrintf(s, "  chat <message>     - Talk to the players on your channel\n");
+    sessPrintf(s, "  save               - Save the game\n");
+    sessPrintf(s, "  load               - Back to your last save (console only)\n");
+    sessPrintf(s, "  help               - Show this help text\n");
+    sessPrintf(s, "  quit / exit        - Quit the game\n");
+    sessPrintf(s, "  metrics            - Server statistics (console only)\n");
+    if (g_cmdExactNames[0]) {
+        sessPrintf(s, "Commands may be abbreviated (e.g. 'att'), except %s.\n", g_cmdExactNames);
+    } else {
+        sessPrintf(s, "Commands may be abbreviated (e.g. 'att').\n");
+    }
+}
+
+/* COMMAND: save */
+void doSave(Session *s) {
+    /* Every change is already in the journal; saving just makes it durable */
+    metricsCount(METRIC_SAVES);
+    journalPlayer(s);
+    if (!journalCommit()) {
+        sessPrintf(s, "Failed to save the game.\n");
+        return;
+    }
+    getPlayerStats(&s->player, s->savedStats);
+    sessPrintf(s, "Game saved.\n");
+}
+
+/* A hostile monster is in the character's room, or the one it attacked
+ * last is still there and alive */
+static int inFight(Session *s) {
+    int room = getRoom(s->player.currentRoom)->id;
+    const Monster *target = monsterFromRef(room, s->target);
+    if (target && target->state != MONSTER_DEAD) {
+        return 1;
+    }
+    for (const Monster *m = firstMonster(room); m; m = nextMonster(m)) {
+        if (m->state == MONSTER_AGGRESSIVE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* COMMAND: load */
+void doLoad(Session *s) {
+    /* Go back to the room and progress of the last save (or login). The
+     * world does not go back with the character: items stay wherever they
+     * are now and monsters keep their wounds, so neither do the
+     * character's wounds heal. On a server other players have moved on
+     * too, so there it is not offered at all. */
+    if (s->fd >= 0) {
+        sessPrintf(s, "The world is shared, so there is no going back; it is saved as you play.\n");
+        return;
+    }
+    if (inFight(s)) {
+        sessPrintf(s, "You can't load a game in the middle of a fight.\n");
+        return;
+    }
+    metricsCount(METRIC_LOADS);
+    Player saved = s->player;
+    setPlayerStats(&saved, s->savedStats);
+    saved.hp = saved.hp < s->player.hp ? saved.hp : s->player.hp;
+    saved.mp = saved.mp < s->player.mp ? saved.mp : s->player.mp;
+    if (regionOf(saved.currentRoom) != regionOf(s->player.currentRoom)) {
+        sessionLeaveRoom(s);
+        s->player = saved;
+        s->arriving = ARRIVE_QUIET;
+    } else {
+        moveOccupant(s, s->player.currentRoom, saved.currentRoom);
+        s->player = saved;
+    }
+    sessPrintf(s, "Game loaded. Items and wounds since your save stay as they are.\n");
+    if (s->arriving && ownsRoom(s->player.currentRoom)) {
+        sessionArrive(s);
+    }
+}
+
+/* COMMAND: metrics. For the console only: a character name proves nothing,
+ * since anyone may log in as any character not online. A server's metrics
+ * are in its metrics file. */
+void doMetrics(Session *s) {
+    if (s != &g_console) {
+        sessPrintf(s, "Server metrics are only shown on the console.\n");
+        return;
+    }
+    ByteBuf text = { 0 };
+    metricsRender(&text);
+    sessWrite(s, (const char *)text.data, text.len);
+    free(text.data);
+}
+
+/* COMMAND: quit / exit */
+void doQuit(Session *s) {
+    sessPrintf(s, "Goodbye!\n");
+    s->state = SESSION_CLOSING;
+}
+
+/*****************************************************************************
+ * SESSIONS & NETWORK SERVER
+ *****************************************************************************/
+
+/* Text to send to many sessions. It starts with one reference, the
+ * caller's, to be dropped once it has been handed out. */
+static SharedText *sharedTextNew(const char *text, size_t len) {
+    SharedText *t = malloc(sizeof(SharedText) + len);
+    if (!t) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    t->refs = 1;
+    t->len = (uint32_t)len;
+    memcpy(t->data, text, len);
+    return t;
+}
+
+/* Format a line of at most MAX_EVENT_LEN - 1 bytes into a shared text */
+SharedText *sharedTextFormat(const char *fmt, va_list ap) {
+    char text[MAX_EVENT_LEN];
+    int len = vsnprintf(text, sizeof(text), fmt, ap);
+    if (len < 0) {
+        len = 0;
+    }
+    return sharedTextNew(text, (size_t)len < sizeof(text) ? (size_t)len : sizeof(text) - 1);
+}
+
+SharedText *sharedTextPrintf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    SharedText *t = sharedTextFormat(fmt, ap);
+    va_end(ap);
+    return t;
+}
+
+void sharedTextHold(SharedText *t) {
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* The last one to drop a shared text frees it */
+void sharedTextDrop(SharedText *t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(t);
+    }
+}
+
+/* A chunk with free space at the end of an output queue. `spare`, if
+ * not NULL, may hold a sent chunk to use before allocating one. */
+static OutChunk *queueTail(OutQueue *q, OutChunk **spare) {
+    OutChunk *c = q->tail;
+    if (c && !c->shared && c->len < OUT_CHUNK_DATA) {
+        return c;
+    }
+    c = spare ? *spare : NULL;
+    if (c) {
+        *spare = NULL;
+    } else if (!(c = malloc(OUT_CHUNK_SIZE))) {
+        return NULL;
+    }
+    c->next = NULL;
+    c->shared = NULL;
+    c->len = 0;
+    if (q->tail) {
+        q->tail->next = c;
+    } else {
+        q->head = c;
+    }
+    q->tail = c;
+    return c;
+}
+
+/* Queue `n` bytes of output, spilling into new chunks as needed */
+int queueAppend(OutQueue *q, OutChunk **spare, const char *data, size_t n) {
+    while (n > 0) {
+        OutChunk *c = queueTail(q, spare);
+        if (!c) {
+            return 0;
+        }
+        size_t part = OUT_CHUNK_DATA - c->len;
+        if (part > n) {
+            part = n;
+        }
+        memcpy(c->data + c->len, data, part);
+        c->len += (uint32_t)part;
+        q->len += part;
+        data += part;
+        n -= part;
+    }
+    return 1;
+}
+
+/* Queue a reference to a shared text; nothing is copied. `spare` as for
+ * queueTail, holding a reference chunk. */
+int queueShare(OutQueue *q, OutChunk **spare, SharedText *t) {
+    OutChunk *c = spare ? *spare : NULL;
+    if (c) {
+        *spare = NULL;
+    } else if (!(c = malloc(sizeof(OutChunk)))) {
+        return 0;
+    }
+    sharedTextHold(t);
+    c->next = NULL;
+    c->shared = t;
+    c->len = t->len;
+    if (q->tail) {
+        q->tail->next = c;
+    } else {
+        q->head = c;
+    }
+    q->tail = c;
+    q->len += t->len;
+    return 1;
+}
+
+/* Move every chunk of `from` (nothing of which is sent) to the end of
+ * `into` */
+void queueSplice(OutQueue *into, OutQueue *from) {
+    if (!from->head) {
+        return;
+    }
+    if (into->tail) {
+        into->tail->next = from->head;
+    } else {
+        into->head = from->head;
+    }
+    into->tail = from->tail;
+    into->len += from->len;
+    from->head = from->tail = NULL;
+    from->len = 0;
+}
+
+/* The bytes a chunk holds */
+static inline const char *chunkBytes(const OutChunk *c) {
+    return c->shared ? c->shared->data : c->data;
+}
+
+/* Drop `n` sent bytes from the front of a queue. Finished chunks go to
+ * the spares (either may be NULL) or are freed. */
+static void queueConsume(OutQueue *q, size_t n, OutChunk **spare, OutChunk **spareRef) {
+    q->len -= n;
+    while (n > 0) {
+        OutChunk *c = q->head;
+        size_t left = c->len - q->pos;
+        if (n < left) {
+            q->pos += n;
+            return;
+        }
+        n -= left;
+        q->pos = 0;
+        q->head = c->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        OutChunk **keep = spare;
+        if (c->shared) {
+            sharedTextDrop(c->shared);
+            keep = spareRef;
+        }
+        if (keep && !*keep) {
+            *keep = c;
+        } else {
+            free(c);
+        }
+    }
+}
+
+/* Formatted output to a session. Nothing is written here: the output is
+ * queued and sent with one writev when the command is done (sessionFlush
+ * for a network session, consoleFlush for the console). */
+void sessPrintf(Session *s, const char *fmt, ...) {
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+
+    /* Usually the text fits in the tail chunk and is formatted in place */
+    OutChunk *c = queueTail(&s->out, &s->outSpare);
+    size_t room = c ? OUT_CHUNK_DATA - c->len : 0;
+    int n = c ? vsnprintf(c->data + c->len, room, fmt, ap) : -1;
+    va_end(ap);
+    if (n >= 0 && (size_t)n < room) {
+        c->len += (uint32_t)n;
+        s->out.len += (size_t)n;
+    } else if (n >= 0) {
+        char local[1024];
+        char *text = (size_t)n < sizeof(local) ? local : malloc((size_t)n + 1);
+        if (text) {
+            vsnprintf(text, (size_t)n + 1, fmt, ap2);
+        }
+        if (!text || !queueAppend(&s->out, &s->outSpare, text, (size_t)n)) {
+            s->state = SESSION_CLOSING;
+        }
+        if (text != local) {
+            free(text);
+        }
+    } else if (!c) {
+        s->state = SESSION_CLOSING;
+    }
+    va_end(ap2);
+}
+
+/* Unformatted output to a session */
+void sessWrite(Session *s, const char *data, size_t len) {
+    if (!queueAppend(&s->out, &s->outSpare, data, len)) {
+        s->state = SESSION_CLOSING;
+    }
+}
+
+/* Output to a session that other sessions are sent too: the session's
+ * queue refers to the text instead of copying it, and writev sends it
+ * from where it is */
+void sessWriteShared(Session *s, SharedText *text) {
+    if (!queueShare(&s->out, &s->outSpareRef, text)) {
+        s->state = SESSION_CLOSING;
+    }
+}
+
+/* Throw away all queued output */
+void outputDiscard(Session *s) {
+    queueConsume(&s->out, s->out.len, &s->outSpare, &s->outSpareRef);
+}
+
+/* Throw away everything queued for a session, and free its spare chunks */
+static void outputRelease(Session *s) {
+    outputDiscard(s);
+    queueConsume(&s->notices, s->notices.len, NULL, NULL);
+    free(s->outSpare);
+    free(s->outSpareRef);
+    free(s->noticeSpare);
+    free(s->noticeSpareRef);
+    s->outSpare = s->outSpareRef = s->noticeSpare = s->noticeSpareRef = NULL;
+}
+
+/* Send queued output to fd with as few writev calls as it takes. Returns
+ * 0 when done or the descriptor would block, -1 on a write error. */
+static int outputWritev(Session *s, int fd) {
+    while (s->out.len > 0) {
+        struct iovec iov[OUT_IOV_MAX];
+        int count = 0;
+        size_t total = 0;
+        size_t skip = s->out.pos;
+        for (OutChunk *c = s->out.head; c && count < OUT_IOV_MAX; c = c->next) {
+            iov[count].iov_base = (char *)chunkBytes(c) + skip;
+            iov[count].iov_len = c->len - skip;
+            total += iov[count].iov_len;
+            count++;
+            skip = 0;
+        }
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        queueConsume(&s->out, (size_t)n, &s->outSpare, &s->outSpareRef);
+        if ((size_t)n < total) {
+            return 0; /* the socket buffer is full */
+        }
+    }
+    return 0;
+}
+
+/* Write the console's queued output to stdout */
+void consoleFlush() {
+    fflush(stdout); /* anything printed outside a session comes first */
+    if (outputWritev(&g_console, STDOUT_FILENO) < 0) {
+        outputDiscard(&g_console);
+    }
+}
+
+/* Put a file descriptor into non-blocking mode */
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Allocate a session for a freshly accepted connection */
+Session *newSession(int fd) {
+    Session *s = calloc(1, sizeof(Session));
+    if (!s) {
+        return NULL;
+    }
+    s->fd = fd;
+    s->state = SESSION_NAME;
+    pthread_mutex_init(&s->noticeLock, NULL);
+    s->homeRegion = fd >= 0 ? fd % g_regionCount : 0;
+    return s;
+}
+
+/* Disconnect and free a session. Its player has already been logged out
+ * by the worker that ran it last. */
+void closeSession(Session *s) {
+    epoll_ctl(g_epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    outputRelease(s);
+    pthread_mutex_destroy(&s->noticeLock);
+    free(s->lines.data);
+    free(s->work.data);
+    free(s);
+}
+
+/* Update which events epoll reports for a session: input while it is
+ * wanted and neither queued input nor unsent output is piling up,
+ * writability only while output is pending and no worker owns the
+ * session. A client that stops reading thus stops being read from. */
+static void sessionWatch(Session *s) {
+    uint32_t events = 0;
+    if (!s->inputClosed && !s->peerGone && (s->busy || !s->loggedOut) &&
+        (s->busy || s->out.len < OUTPUT_HIGH_WATER) &&
+        s->lines.len < SESSION_INPUT_LIMIT) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (!s->busy && s->out.len > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == s->watchEvents) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(g_epollFd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->watchEvents = events;
+}
+
+/* Write as much queued output as the socket accepts. Anything left over
+ * is kept and sent when epoll reports the socket writable again. */
+void sessionFlush(Session *s) {
+    if (outputWritev(s, s->fd) < 0) {
+        /* Peer is gone; drop whatever is left */
+        s->peerGone = 1;
+        outputDiscard(s);
+    }
+    sessionWatch(s);
+}
+
+/* Read everything available on a session's socket and queue each
+ * complete line for the session's region */
+void sessionRead(Session *s) {
+    char buf[4096];
+
+    while (!s->inputClosed && !s->peerGone && s->lines.len < SESSION_INPUT_LIMIT) {
+        ssize_t n = read(s->fd, buf, sizeof(buf));
+        if (n == 0) {
+            s->inputClosed = 1;
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                s->peerGone = 1;
+            }
+            return;
+        }
+
+        for (ssize_t i = 0; i < n; i++) {
+            char c = buf[i];
+            if (c != '\n') {
+                if (s->inLen < MAX_INPUT_LEN - 1) {
+                    s->inBuf[s->inLen++] = c;
+                } else {
+                    s->inOverflow = 1;
+                }
+                continue;
+            }
+
+            /* A complete line: queue it unless it was too long to keep */
+            static const char tooLong[2] = { LINE_TOO_LONG, '\0' };
+            s->inBuf[s->inLen] = '\0';
+            if (!bufAppend(&s->lines, s->inOverflow ? tooLong : s->inBuf,
+                           s->inOverflow ? sizeof(tooLong) : (size_t)s->inLen + 1)) {
+                s->peerGone = 1;
+                return;
+            }
+            s->inLen = 0;
+            s->inOverflow = 0;
+        }
+    }
+}
+
+/* The region a session's next lines run in */
+static Region *sessionRegion(Session *s) {
+    if (s->state == SESSION_NAME) {
+        return &g_regions[s->homeRegion];
+    }
+    return regionOf(s->player.currentRoom);
+}
+
+/* Hand a session's queued lines to a worker. From here until it comes back
+ * through schedulerTakeDone, the session belongs to the worker. */
+static void sessionDispatch(Session *s) {
+    if (s->workPos < s->work.len) {
+        /* The last run stopped for backpressure: its lines go first */
+        memmove(s->work.data, s->work.data + s->workPos, s->work.len - s->workPos);
+        s->work.len -= s->workPos;
+        if (!bufAppend(&s->work, s->lines.data, s->lines.len)) {
+            s->peerGone = 1; /* out of memory: treat as a hangup */
+        }
+    } else {
+        ByteBuf spare = s->work;
+        s->work = s->lines;
+        s->lines = spare;
+    }
+    s->lines.len = 0;
+    s->workPos = 0;
+    s->hangup = s->inputClosed || s->peerGone;
+    s->busy = 1;
+    regionPost(sessionRegion(s), s);
+}
+
+/* Main thread: bring a session up to date once no worker owns it. Sends
+ * its output, hands over new input, and closes it when it is finished. */
+static void sessionSettle(Session *s) {
+    if (!s->busy) {
+        if (sessionTakeNotices(s, 1) && !s->loggedOut) {
+            s->inputClosed = 1; /* killed: take no more commands */
+        }
+        if (s->peerGone) {
+            outputDiscard(s);
+        } else if (s->out.len > 0) {
+            sessionFlush(s);
+        }
+        if (s->loggedOut) {
+            if (s->out.len == 0 || s->peerGone) {
+                closeSession(s);
+                return;
+            }
+        } else if (s->out.len < OUTPUT_HIGH_WATER &&
+                   (s->lines.len > 0 || s->workPos < s->work.len ||
+                    s->inputClosed || s->peerGone)) {
+            sessionDispatch(s);
+        }
+    }
+    sessionWatch(s);
+}
+
+/* Raise the open file limit so thousands of sessions can connect */
+static void raiseFileLimit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Accept every pending connection on the listening socket */
+static void acceptConnections(int listenFd) {
+    while (1) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; /* EAGAIN, or out of descriptors: try again next wakeup */
+        }
+
+        Session *s = NULL;
+        if (setNonBlocking(fd) == 0) {
+            s = newSession(fd);
+        }
+        if (!s) {
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = s;
+        s->watchEvents = ev.events;
+        if (epoll_ctl(g_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(s);
+            continue;
+        }
+
+        sessPrintf(s, "Welcome to the MUD-like Game!\n");
+        sessPrintf(s, "Enter your character's name: ");
+        sessionFlush(s);
+    }
+}
+
+/* Event-driven server: one epoll reactor thread owns the sockets, one
+ * Session per connection, and `threads` workers run the game */
+int runServer(int port, int threads) {
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit();
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, LISTEN_BACKLOG) < 0 ||
+        setNonBlocking(listenFd) < 0) {
+        perror("listen");
+        close(listenFd);
+        return 1;
+    }
+
+    g_epollFd = epoll_create1(0);
+    if (g_epollFd < 0) {
+        perror("epoll_create1");
+        close(listenFd);
+        return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; /* NULL marks the listening socket */
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+    if (!schedulerStart(threads)) {
+        close(g_epollFd);
+        close(listenFd);
+        return 1;
+    }
+    static char wakeMarker;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeMarker; /* workers handing sessions back */
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_sched.wakeFd, &ev);
+
+    printf("MUD server listening on port %d (%d worker thread%s, %d region%s, seed %llu)\n",
+           port, g_sched.count, g_sched.count == 1 ? "" : "s",
+           g_regionCount, g_regionCount == 1 ? "" : "s", (unsigned long long)g_seed);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (1) {
+        /* Wake for the next group commit or world tick, whichever is first */
+        int timeout = journalTimeoutMs();
+        int tickTimeout = worldClockTimeoutMs();
+        if (tickTimeout >= 0 && (timeout < 0 || tickTimeout < timeout)) {
+            timeout = tickTimeout;
+        }
+        int dumpTimeout = metricsTimeoutMs();
+        if (dumpTimeout >= 0 && (timeout < 0 || dumpTimeout < timeout)) {
+            timeout = dumpTimeout;
+        }
+        int n = epoll_wait(g_epollFd, events, MAX_EPOLL_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        int wake = 0;
+        for (int i = 0; i < n; i++) {
+            Session *s = events[i].data.ptr;
+            if (!s) {
+                acceptConnections(listenFd);
+                continue;
+            }
+            if ((void *)s == (void *)&wakeMarker) {
+                wake = 1; /* after the loop: it may close sessions listed here */
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                s->peerGone = 1;
+            } else if (events[i].events & EPOLLIN) {
+                sessionRead(s);
+            }
+            /* EPOLLRDHUP with no more data is picked up by read() == 0 */
+            sessionSettle(s);
+        }
+        if (wake) {
+            Session *s = schedulerTakeDone();
+            for (Session *noticed = schedulerTakeNotices(), *next; noticed; noticed = next) {
+                next = noticed->noticeNext;
+                pthread_mutex_lock(&noticed->noticeLock);
+                noticed->noticePosted = 0;
+                pthread_mutex_unlock(&noticed->noticeLock);
+                sessionSettle(noticed); /* a busy one gets them when it is back */
+            }
+            while (s) {
+                Session *next = s->mailNext;
+                s->busy = 0;
+                sessionSettle(s);
+                s = next;
+            }
+        }
+        worldClockPost();
+        journalMaybeCommit();
+        metricsMaybeDump();
+    }
+
+    schedulerStop();
+    journalSnapshotWait();
+    close(g_epollFd);
+    close(listenFd);
+    return 1;
+}
+
+/*****************************************************************************
+ * INPUT TOKENIZER
+ *****************************************************************************/
+
+/* Record one word found by tokenizeLine: the first is the verb, the rest
+ * make up the arguments. */
+static void addToken(CommandLine *cl, const char *ptr, size_t len) {
+    if (cl->verb.ptr == NULL) {
+        cl->verb.ptr = ptr;
+        cl->verb.len = len;
         return;
     }
-    
-    /* Save player data */
-    fwrite(&g_player, sizeof(Player), 1, f);
-    
-    /* Save room data */
-    fwrite(&g_roomCount, sizeof(int), 1, f);
-    fwrite(&g_rooms, sizeof(Room), g_roomCount, f);
-    
-    fclose(f);
-    printf("Game saved.\n");
+    if (cl->tokenCount == 0) {
+        cl->args.ptr = ptr;
+    }
+    cl->args.len = (size_t)(ptr + len - cl->args.ptr);
+    if (cl->tokenCount < MAX_TOKENS) {
+        cl->tokens[cl->tokenCount].ptr = ptr;
+        cl->tokens[cl->tokenCount].len = len;
+    }
+    cl->tokenCount++;
+}
+
+/* Split a command line into verb and argument words in a single pass,
+ * folding ASCII upper case to lower case in place as it goes. Nothing is
+ * copied: every view points into `line`. The argument text is also
+ * NUL-terminated in place, so line[len] must be writable. */
+void tokenizeLine(char *line, size_t len, CommandLine *cl) {
+    memset(cl, 0, sizeof(*cl));
+    size_t i = 0;
+    size_t start = 0;
+    int inToken = 0;
+
+#if defined(__SSE2__)
+    /* 16 bytes at a time: fold case, store back, then turn the whitespace
+     * mask into word boundaries. */
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i upA   = _mm_set1_epi8('A');
+    const __m128i up25  = _mm_set1_epi8(25);
+    const __m128i bit20 = _mm_set1_epi8(0x20);
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab   = _mm_set1_epi8('\t');
+    const __m128i ctl4  = _mm_set1_epi8(4);  /* '\t'..'\r' */
+    unsigned prevWs = 1;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+        __m128i isUpper = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, upA), up25), zero);
+        v = _mm_add_epi8(v, _mm_and_si128(isUpper, bit20));
+        _mm_storeu_si128((__m128i *)(line + i), v);
+
+        __m128i isWs = _mm_or_si128(
+            _mm_cmpeq_epi8(v, space),
+            _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, tab), ctl4), zero));
+        unsigned ws = (unsigned)_mm_movemask_epi8(isWs);
+        unsigned edges = (ws ^ ((ws << 1) | prevWs)) & 0xFFFFu;
+        prevWs = ws >> 15;
+
+        while (edges) {
+            unsigned bit = (unsigned)__builtin_ctz(edges);
+            edges &= edges - 1;
+            if ((ws >> bit) & 1) {
+                addToken(cl, line + start, i + bit - start);
+            } else {
+                start = i + bit;
+            }
+        }
+    }
+    inToken = !prevWs;
+#endif
+
+    for (; i < len; i++) {
+        unsigned char c = (unsigned char)line[i];
+        if ((unsigned)(c - 'A') < 26u) {
+            line[i] = (char)(c + 0x20);
+        }
+        int isWs = (c == ' ' || (unsigned)(c - '\t') <= 4u);
+        if (isWs && inToken) {
+            addToken(cl, line + start, i - start);
+            inToken = 0;
+        } else if (!isWs && !inToken) {
+            start = i;
+            inToken = 1;
+        }
+    }
+    if (inToken) {
+        addToken(cl, line + start, len - start);
+    }
+
+    if (cl->tokenCount > 0) {
+        line[cl->args.ptr - line + cl->args.len] = '\0';
+    } else {
+        cl->args.ptr = "";
+    }
+}
+
+/*****************************************************************************
+ * BENCHMARKS
+ *****************************************************************************/
+
+/* Representative command mix used when no command log is given */
+static const char *g_sampleCommands[] = {
+    "look", "go north", "go south", "  Take Health Potion  ", "drop rusty sword",
+    "inv", "stats", "attack", "use Mana Potion", "n", "s", "help",
+    "GO   EAST", "take   ancient   relic", "l", "\tuse health potion\r",
+};
+
+/* Compare the old trim + lower + sscanf input path against tokenizeLine on a
+ * command log (one command per line). */
+int runTokenizerBenchmark(const char *logPath) {
+    char **lines = NULL;
+    size_t *lens = NULL;
+    size_t count = 0, cap = 0;
+    char buf[MAX_INPUT_LEN];
+
+    FILE *f = NULL;
+    if (logPath) {
+        f = fopen(logPath, "r");
+        if (!f) {
+            perror(logPath);
+            return 1;
+        }
+    }
+    size_t sampleCount = sizeof(g_sampleCommands) / sizeof(g_sampleCommands[0]);
+    for (size_t n = 0; ; n++) {
+        if (f) {
+            if (!fgets(buf, sizeof(buf), f)) {
+                break;
+            }
+        } else if (n < sampleCount) {
+            snprintf(buf, sizeof(buf), "%s\n", g_sampleCommands[n]);
+        } else {
+            break;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            lines = realloc(lines, cap * sizeof(char *));
+            lens = realloc(lens, cap * sizeof(size_t));
+            if (!lines || !lens) {
+                fprintf(stderr, "Out of memory.\n");
+                return 1;
+            }
+        }
+        lens[count] = strlen(buf);
+        lines[count] = strdup(buf);
+        count++;
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (count == 0) {
+        fprintf(stderr, "Command log is empty.\n");
+        return 1;
+    }
+
+    /* Roughly ten million lines per path */
+    size_t rounds = 10000000 / count + 1;
+    unsigned long checksum = 0;
+    char work[MAX_INPUT_LEN];
+
+    uint64_t t0 = nowNs();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(work, lines[i], lens[i] + 1);
+            char *input = trimWhitespace(work);
+            strToLower(input);
+            if (strlen(input) == 0) {
+                continue;
+            }
+            char cmd[MAX_CMD_LEN];
+            char arg[MAX_CMD_LEN];
+            memset(cmd, 0, sizeof(cmd));
+            memset(arg, 0, sizeof(arg));
+            sscanf(input, "%99s %99[^\n]", cmd, arg);
+            checksum += (unsigned char)cmd[0] + (unsigned char)arg[0];
+        }
+    }
+    uint64_t t1 = nowNs();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(work, lines[i], lens[i] + 1);
+            CommandLine cl;
+            tokenizeLine(work, lens[i], &cl);
+            if (cl.verb.len == 0) {
+                continue;
+            }
+            checksum += (unsigned char)cl.verb.ptr[0] + (unsigned char)cl.args.ptr[0];
+        }
+    }
+    uint64_t t2 = nowNs();
+
+    double total = (double)(rounds * count);
+    printf("Tokenizer benchmark: %zu distinct lines, %.0f lines per path\n", count, total);
+    printf("  trim + lower + sscanf : %7.1f ns/line\n", (double)(t1 - t0) / total);
+    printf("  tokenizeLine          : %7.1f ns/line\n", (double)(t2 - t1) / total);
+    printf("  speedup               : %7.2fx  (checksum %lu)\n",
+           (double)(t1 - t0) / (double)(t2 - t1), checksum);
+
+    for (size_t i = 0; i < count; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(lens);
+    return 0;
+}
+
+/* Peak resident set size in bytes */
+static long peakRssBytes() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss * 1024L;
+}
+
+/* Materialize every room of a world image and report the memory each room
+ * and each player costs. With --room-memory, rooms are evicted as the
+ * budget fills up, and a second pass times bringing them back. */
+int runMemoryBenchmark(const char *worldPath) {
+    if (!mapWorldFile(worldPath)) {
+        return 1;
+    }
+    long rss0 = peakRssBytes();
+    uint64_t t0 = nowNs();
+    long placed = 0;
+    for (int i = 0; i < g_roomCount; i++) {
+        placed += getRoom(i)->ground.count;
+        if ((i & (ROOM_CHUNK_SIZE - 1)) == 0) {
+            roomStoreTrim();
+        }
+    }
+    uint64_t t1 = nowNs();
+    long rss1 = peakRssBytes();
+
+    printf("Memory benchmark: %d rooms, %ld items placed, %d distinct items\n",
+           g_roomCount, placed, g_itemCount);
+    printf("  sizeof(Room)     : %6zu bytes\n", sizeof(Room));
+    printf("  sizeof(Player)   : %6zu bytes\n", sizeof(Player));
+    printf("  sizeof(Session)  : %6zu bytes\n", sizeof(Session));
+    printf("  resident growth  : %6.1f MB (%.0f bytes/room)\n",
+           (double)(rss1 - rss0) / (1024.0 * 1024.0), (double)(rss1 - rss0) / g_roomCount);
+    printf("  materialize      : %6.1f ns/room\n", (double)(t1 - t0) / g_roomCount);
+    if (!g_roomBudget) {
+        return 0;
+    }
+
+    roomStoreTrim();
+    uint64_t t2 = nowNs();
+    for (int i = 0; i < g_roomCount; i++) {
+        getRoom(i);
+        if ((i & (ROOM_CHUNK_SIZE - 1)) == 0) {
+            roomStoreTrim();
+        }
+    }
+    uint64_t t3 = nowNs();
+    roomStoreTrim();
+    printf("  room budget      : %6u rooms (%u materialized, %.1f MB spill file)\n",
+           g_roomBudget, g_roomStore.resident, (double)g_spillEnd / (1024.0 * 1024.0));
+    printf("  page back in     : %6.1f ns/room\n", (double)(t3 - t2) / g_roomCount);
+    printf("  peak resident    : %6.1f MB\n", (double)peakRssBytes() / (1024.0 * 1024.0));
+    return 0;
+}
+
+/* Sweep every room of a world the way periodic game logic does: a monster
+ * regeneration tick, an occupancy scan and a breadth-first search over the
+ * whole exit graph. Only the hot arrays of the world store and the monster
+ * pools are touched. Also times monster churn: every monster in the world
+ * is removed and replaced by a new one, over and over. */
+int runSweepBenchmark(const char *worldPath) {
+    if (!mapWorldFile(worldPath)) {
+        return 1;
+    }
+    for (int i = 0; i < g_roomCount; i++) {
+        getRoom(i);
+    }
+
+    const int rounds = 20;
+    long live = 0;
+    uint64_t t0 = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        live = 0;
+        for (int g = 0; g < g_regionCount; g++) {
+            const MonsterPool *pool = &g_regions[g].monsters;
+            for (int k = 0; k < pool->slabCount; k++) {
+                Monster *slab = pool->slabs[k];
+                for (int i = 0; i < MONSTER_SLAB_SIZE; i++) {
+                    Monster *m = &slab[i];
+                    if (m->room >= 0 && m->state != MONSTER_DEAD) {
+                        live++;
+                        if (m->hp < m->maxHp) {
+                            m->hp++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    uint64_t t1 = nowNs();
+    long occupied = 0;
+    for (int r = 0; r < rounds; r++) {
+        occupied = 0;
+        for (int i = 0; i < g_roomCount; i++) {
+            occupied += g_roomOccupants[i] != 0;
+        }
+    }
+    uint64_t t2 = nowNs();
+
+    int *queue = malloc((size_t)g_roomCount * sizeof(int));
+    uint8_t *seen = calloc((size_t)g_roomCount, 1);
+    if (!queue || !seen) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    size_t head = 0, tail = 0;
+    queue[tail++] = 0;
+    seen[0] = 1;
+    while (head < tail) {
+        int room = queue[head++];
+        for (int d = 0; d < DIR_COUNT; d++) {
+            int next = roomExit(room, d);
+            if (next >= 0 && !seen[next]) {
+                seen[next] = 1;
+                queue[tail++] = next;
+            }
+        }
+    }
+    uint64_t t3 = nowNs();
+    free(queue);
+    free(seen);
+
+    long churned = 0;
+    uint64_t allocs0 = allocationCount();
+    uint64_t t4 = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < g_roomCount; i++) {
+            Monster *m = firstMonster(i);
+            if (m) {
+                removeRoomMonster(m);
+                spawnMonster(i);
+                churned++;
+            }
+        }
+    }
+    uint64_t t5 = nowNs();
+    uint64_t churnAllocs = allocationCount() - allocs0;
+
+    double sweeps = (double)rounds * g_roomCount;
+    printf("Sweep benchmark: %d rooms, %ld live monsters, %ld occupied rooms\n",
+           g_roomCount, live, occupied);
+    printf("  monster tick     : %6.2f ns/room\n", (double)(t1 - t0) / sweeps);
+    printf("  occupancy scan   : %6.2f ns/room\n", (double)(t2 - t1) / sweeps);
+    printf("  exit-graph BFS   : %6.2f ns/room (%zu reached)\n",
+           (double)(t3 - t2) / (double)tail, tail);
+    printf("  monster churn    : %6.2f ns/replacement", (double)(t5 - t4) / (double)(churned ? churned : 1));
+#if defined(MUD_ALLOC_STATS)
+    printf(" (%llu allocations)", (unsigned long long)churnAllocs);
+#else
+    (void)churnAllocs;
+#endif
+    printf("\n");
+    return 0;
+}
+
+/* Time `travel` route finding between random rooms of a world: building
+ * the name index and hub tables, a first search for each pair, and the
+ * same pairs again from the route cache. Some routes are checked against
+ * a plain breadth-first search. */
+int runTravelBenchmark(const char *worldPath, int queries) {
+    if (!mapWorldFile(worldPath)) {
+        return 1;
+    }
+    if (queries < 1) {
+        queries = 1;
+    }
+    int32_t *pairs = malloc((size_t)queries * 2 * sizeof(int32_t));
+    LatencyHist *hist = calloc(2, sizeof(LatencyHist));
+    if (!pairs || !hist) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    Rng rng;
+    rngSeed(&rng, g_seed, 0);
+    for (int q = 0; q < 2 * queries; q++) {
+        pairs[q] = (int32_t)(rngNext(&rng) % (uint64_t)g_roomCount);
+    }
+
+    uint64_t t0 = nowNs();
+    getRoomIndexByName(worldString(g_worldRooms[0].nameOff));
+    uint64_t t1 = nowNs();
+
+    long steps = 0, unreachable = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int q = 0; q < queries; q++) {
+            uint8_t *dirs;
+            uint64_t start = nowNs();
+            int len = findRoute(pairs[2 * q], pairs[2 * q + 1], &dirs);
+            histRecord(&hist[pass], nowNs() - start);
+            if (len < 0) {
+                unreachable += pass == 0;
+                continue;
+            }
+            steps += pass == 0 ? len : 0;
+            free(dirs);
+        }
+    }
+
+    /* Route lengths must match breadth-first search */
+    int checks = queries < 10 ? queries : 10, wrong = 0;
+    int32_t *dist = malloc((size_t)g_roomCount * sizeof(int32_t));
+    int32_t *queue = malloc((size_t)g_roomCount * sizeof(int32_t));
+    if (!dist || !queue) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (int q = 0; q < checks; q++) {
+        memset(dist, 0xff, (size_t)g_roomCount * sizeof(int32_t));
+        size_t head = 0, tail = 0;
+        dist[pairs[2 * q]] = 0;
+        queue[tail++] = pairs[2 * q];
+        while (head < tail) {
+            int room = queue[head++];
+            for (int d = 0; d < DIR_COUNT; d++) {
+                int next = roomExit(room, d);
+                if (next >= 0 && dist[next] < 0) {
+                    dist[next] = dist[room] + 1;
+                    queue[tail++] = next;
+                }
+            }
+        }
+        uint8_t *dirs;
+        int len = findRoute(pairs[2 * q], pairs[2 * q + 1], &dirs);
+        if (len >= 0) {
+            free(dirs);
+        }
+        wrong += len != dist[pairs[2 * q + 1]];
+    }
+
+    printf("Travel benchmark: %d rooms, %d routes, %.0f steps on average, %ld unreachable\n",
+           g_roomCount, queries, (double)steps / (double)(queries - unreachable ? queries - unreachable : 1),
+           unreachable);
+    printf("  index + hubs     : %8.1f ms\n", (double)(t1 - t0) / 1e6);
+    printf("  first search     : %8.2f us p50, %8.2f us p99\n",
+           histPercentile(&hist[0], 0.50) / 1e3, histPercentile(&hist[0], 0.99) / 1e3);
+    printf("  repeated (cache) : %8.2f us p50, %8.2f us p99\n",
+           histPercentile(&hist[1], 0.50) / 1e3, histPercentile(&hist[1], 0.99) / 1e3);
+    printf("  checked with BFS : %d of %d routes shortest\n", checks - wrong, checks);
+    free(dist);
+    free(queue);
+    free(pairs);
+    free(hist);
+    return wrong != 0;
+}
+
+/* Commands each benchmark bot sends per batch: no combat, so nobody dies */
+static const char *g_botCommands[] = {
+    "look", "n", "e", "stats", "s", "w", "inv", "look", "e", "n", "w", "s",
+};
+
+/* Log `bots` characters into random rooms of a world and have them send
+ * command batches through the worker pool for about a second per thread
+ * count, reporting commands per second and the speedup over one worker. */
+int runThreadBenchmark(const char *worldPath, int bots) {
+    if (!mapWorldFile(worldPath)) {
+        return 1;
+    }
+    initCommands();
+    initWorldClock();
+    if (bots < 1) {
+        bots = 1;
+    }
+
+    /* One batch: every bot command, NUL-terminated as sessionRead queues them */
+    ByteBuf batch = {0};
+    size_t batchLines = sizeof(g_botCommands) / sizeof(g_botCommands[0]);
+    for (size_t i = 0; i < batchLines; i++) {
+        if (!bufAppend(&batch, g_botCommands[i], strlen(g_botCommands[i]) + 1)) {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+    }
+
+    Session **sessions = calloc((size_t)bots, sizeof(Session *));
+    if (!sessions) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (int i = 0; i < bots; i++) {
+        Session *s = newSession(-1);
+        char name[MAX_NAME_LEN];
+        int len = snprintf(name, sizeof(name), "bot%d", i);
+        if (!s || !handleLine(s, name, (size_t)len) || s->state != SESSION_PLAYING) {
+            fprintf(stderr, "Could not log in bot %d.\n", i);
+            return 1;
+        }
+        sessionLeaveRoom(s);
+        s->player.currentRoom = randomInRange(&s->rng, 0, g_roomCount - 1);
+        sessionEnterRoom(s);
+        outputDiscard(s);
+        sessions[i] = s;
+    }
+
+    long maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 1) {
+        maxThreads = 1;
+    }
+    if (maxThreads > MAX_WORKERS) {
+        maxThreads = MAX_WORKERS;
+    }
+    printf("Thread benchmark: %d rooms in %d regions, %d bots, %ld cores\n",
+           g_roomCount, g_regionCount, bots, maxThreads);
+
+    double base = 0;
+    for (int threads = 1; ; threads = threads * 2 > maxThreads ? (int)maxThreads : threads * 2) {
+        if (!schedulerStart(threads)) {
+            return 1;
+        }
+        uint64_t t0 = nowNs();
+        uint64_t deadline = t0 + 1000000000ull;
+        long commands = 0;
+        int inFlight = 0;
+        for (int i = 0; i < bots; i++) {
+            Session *s = sessions[i];
+            if (!bufAppend(&s->work, batch.data, batch.len)) {
+                fprintf(stderr, "Out of memory.\n");
+                return 1;
+            }
+            s->busy = 1;
+            inFlight++;
+            regionPost(sessionRegion(s), s);
+        }
+        while (inFlight > 0) {
+            struct pollfd pfd = { .fd = g_sched.wakeFd, .events = POLLIN };
+            poll(&pfd, 1, 100);
+            int more = nowNs() < deadline;
+            for (Session *s = schedulerTakeDone(), *next; s; s = next) {
+                next = s->mailNext;
+                commands += (long)batchLines;
+                outputDiscard(s);
+                if (more) {
+                    bufAppend(&s->work, batch.data, batch.len);
+                    regionPost(sessionRegion(s), s);
+                } else {
+                    s->busy = 0;
+                    inFlight--;
+                }
+            }
+        }
+        uint64_t t1 = nowNs();
+        schedulerStop();
+
+        double rate = (double)commands * 1e9 / (double)(t1 - t0);
+        if (threads == 1) {
+            base = rate;
+        }
+        printf("  %3d worker%s : %10.0f commands/s  (%.2fx)\n",
+               threads, threads == 1 ? " " : "s", rate, rate / base);
+        if (threads >= maxThreads) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < bots; i++) {
+        outputRelease(sessions[i]);
+        free(sessions[i]->lines.data);
+        free(sessions[i]->work.data);
+        free(sessions[i]);
+    }
+    free(sessions);
+    free(batch.data);
+    return 0;
+}
+
+/* Load benchmark command categories */
+typedef enum {
+    LOAD_MOVE,
+    LOAD_LOOK,
+    LOAD_ITEM,              /* take what is on the floor, or drop what was taken */
+    LOAD_COMBAT,
+    LOAD_KINDS
+} LoadKind;
+
+static const char *const g_loadKindNames[LOAD_KINDS] = { "move", "look", "item", "combat" };
+static const char *const g_dirWords[DIR_COUNT] = { "n", "s", "e", "w", "u", "d" };
+
+/* One scripted player. It only knows what its own output told it. */
+typedef struct {
+    Session *s;                     /* in-process bot */
+    int      fd;                    /* network bot */
+    char     name[MAX_NAME_LEN];
+    int      loggedIn;
+    uint8_t  exits;                 /* of the last room seen, bit per Direction */
+    char     floorItem[MAX_NAME_LEN];
+    char     carried[MAX_NAME_LEN];
+    LoadKind kind;                  /* of the command in flight */
+    uint64_t sentNs;
+    ByteBuf  reply;                 /* network: output received so far */
+} LoadBot;
+
+/* "move=40,look=30,item=20,combat=10": relative weight of each category.
+ * Returns the sum of the weights, or 0 if the mix is malformed. */
+static int parseLoadMix(const char *mix, int weights[LOAD_KINDS]) {
+    memset(weights, 0, LOAD_KINDS * sizeof(int));
+    int total = 0;
+    const char *p = mix;
+    while (*p) {
+        const char *eq = strchr(p, '=');
+        if (!eq) {
+            return 0;
+        }
+        int kind = -1;
+        for (int k = 0; k < LOAD_KINDS; k++) {
+            if ((size_t)(eq - p) == strlen(g_loadKindNames[k]) &&
+                strncmp(p, g_loadKindNames[k], (size_t)(eq - p)) == 0) {
+                kind = k;
+            }
+        }
+        char *end;
+        long w = strtol(eq + 1, &end, 10);
+        if (kind < 0 || end == eq + 1 || w < 0 || w > 1000 || (*end && *end != ',')) {
+            return 0;
+        }
+        weights[kind] = (int)w;
+        total += (int)w;
+        p = *end ? end + 1 : end;
+    }
+    return total;
+}
+
+/* Copy text up to `stop` into a name buffer */
+static void copyUntil(char *dst, const char *src, const char *stop) {
+    const char *end = strstr(src, stop);
+    size_t len = end ? (size_t)(end - src) : strlen(src);
+    if (len >= MAX_NAME_LEN) {
+        len = MAX_NAME_LEN - 1;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/* Update what a bot knows from the output of its last command */
+static void loadBotObserve(LoadBot *b, const char *text) {
+    const char *p = strstr(text, "Exits:\n");
+    if (p) {
+        b->exits = 0;
+        b->floorItem[0] = '\0';
+        const char *floor = strstr(text, "on the ground:\n  - ");
+        if (floor) {
+            copyUntil(b->floorItem, floor + 19, "\n");
+        }
+        for (p += 7; p[0] == ' ' && p[1] == ' '; ) {
+            p += 2;
+            for (int d = 0; d < DIR_COUNT; d++) {
+                size_t len = strlen(g_dirLabels[d]);
+                if (strncmp(p, g_dirLabels[d], len) == 0 && p[len] == '\n') {
+                    b->exits |= (uint8_t)(1u << d);
+                }
+            }
+            p = strchr(p, '\n');
+            if (!p) {
+                break;
+            }
+            p++;
+        }
+    }
+    if ((p = strstr(text, "You picked up "))) {
+        copyUntil(b->carried, p + 14, ".\n");
+        b->floorItem[0] = '\0';
+    }
+    if ((p = strstr(text, "You dropped "))) {
+        copyUntil(b->floorItem, p + 12, ".\n");
+        b->carried[0] = '\0';
+    }
+}
+
+/* Pick a bot's next command from the mix. Returns its length. */
+static size_t loadBotCommand(LoadBot *b, Rng *rng, const int weights[LOAD_KINDS], int total,
+                             char *line, size_t cap) {
+    int roll = randomInRange(rng, 0, total - 1);
+    int kind = 0;
+    while (roll >= weights[kind]) {
+        roll -= weights[kind++];
+    }
+    b->kind = (LoadKind)kind;
+
+    const char *text = "look";
+    int n = -1;
+    if (kind == LOAD_MOVE && b->exits) {
+        int pick = randomInRange(rng, 1, __builtin_popcount(b->exits));
+        for (int d = 0; d < DIR_COUNT; d++) {
+            if ((b->exits & (1u << d)) && --pick == 0) {
+                text = g_dirWords[d];
+            }
+        }
+    } else if (kind == LOAD_ITEM) {
+        if (b->carried[0]) {
+            n = snprintf(line, cap, "drop %s", b->carried);
+        } else if (b->floorItem[0]) {
+            n = snprintf(line, cap, "take %s", b->floorItem);
+        } else {
+            text = "inventory";
+        }
+    } else if (kind == LOAD_COMBAT) {
+        text = "attack";
+    }
+    if (n < 0) {
+        n = snprintf(line, cap, "%s", text);
+    }
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+/* Print the latency table of a load run */
+static void printLoadResults(const LatencyHist *hist, double seconds, long deaths) {
+    const LatencyHist *all = &hist[LOAD_KINDS];
+    printf("  throughput : %.0f commands/s (%llu commands, %ld deaths)\n",
+           (double)all->count / seconds, (unsigned long long)all->count, deaths);
+    printf("  latency us   %10s %9s %9s %9s %9s\n", "commands", "p50", "p99", "p99.9", "max");
+    for (int k = 0; k <= LOAD_KINDS; k++) {
+        const LatencyHist *h = &hist[k];
+        if (h->count == 0) {
+            continue;
+        }
+        printf("    %-10s %10llu %9.1f %9.1f %9.1f %9.1f\n",
+               k < LOAD_KINDS ? g_loadKindNames[k] : "all", (unsigned long long)h->count,
+               histPercentile(h, 0.50) / 1e3, histPercentile(h, 0.99) / 1e3,
+               histPercentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+}
+
+/* Drive `bots` scripted players through handleLine in this process, one
+ * command at a time, round-robin, for `commands` commands. With the same
+ * seed and world the run is identical, down to the output checksum. */
+int runLoadBenchmark(const char *worldPath, int bots, long commands, const char *mix) {
+    int weights[LOAD_KINDS];
+    int total = parseLoadMix(mix, weights);
+    if (total <= 0 || bots < 1 || commands < 1) {
+        fprintf(stderr, "Invalid load benchmark settings (mix \"%s\").\n", mix);
+        return 1;
+    }
+    if (!mapWorldFile(worldPath)) {
+        return 1;
+    }
+    initCommands();
+    initWorldClock();
+
+    Rng rng;
+    rngSeed(&rng, g_seed, UINT64_MAX); /* the bots' own stream */
+    LoadBot *bb = calloc((size_t)bots, sizeof(LoadBot));
+    LatencyHist *hist = calloc(LOAD_KINDS + 1, sizeof(LatencyHist));
+    if (!bb || !hist) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (int i = 0; i < bots; i++) {
+        LoadBot *b = &bb[i];
+        b->s = newSession(-1);
+        int len = snprintf(b->name, sizeof(b->name), "loadbot%d", i);
+        if (!b->s || !handleLine(b->s, b->name, (size_t)len) || b->s->state != SESSION_PLAYING) {
+            fprintf(stderr, "Could not log in bot %d.\n", i);
+            return 1;
+        }
+        sessionLeaveRoom(b->s);
+        b->s->player.currentRoom = randomInRange(&rng, 0, g_roomCount - 1);
+        sessionEnterRoom(b->s);
+        outputDiscard(b->s);
+    }
+
+    ByteBuf text = { 0 };
+    uint32_t checksum = 0;
+    uint64_t busyNs = 0, allocations = 0;
+    long deaths = 0;
+    for (long n = 0; n < commands; n++) {
+        LoadBot *b = &bb[n % bots];
+        Session *s = b->s;
+        char line[MAX_INPUT_LEN];
+        size_t len = loadBotCommand(b, &rng, weights, total, line, sizeof(line));
+
+        uint64_t allocs0 = allocationCount();
+        uint64_t t0 = nowNs();
+        int alive = handleLine(s, line, len);
+        if (alive) {
+            printPrompt(s);
+        }
+        uint64_t ns = nowNs() - t0;
+        allocations += allocationCount() - allocs0;
+        busyNs += ns;
+        histRecord(&hist[b->kind], ns);
+        histRecord(&hist[LOAD_KINDS], ns);
+
+        text.len = 0;
+        size_t skip = s->out.pos;
+        for (OutChunk *c = s->out.head; c; c = c->next) {
+            bufAppend(&text, chunkBytes(c) + skip, c->len - skip);
+            skip = 0;
+        }
+        checksum = crc32Update(checksum, text.data, text.len);
+        bufAppend(&text, "", 1);
+        loadBotObserve(b, (const char *)text.data);
+        outputDiscard(s);
+
+        if (!alive) {
+            /* Died: come back as a new character, as a player would */
+            deaths++;
+            logoutPlayer(s);
+            s->state = SESSION_NAME;
+            handleLine(s, b->name, strlen(b->name));
+            outputDiscard(s);
+            b->exits = 0;
+            b->floorItem[0] = b->carried[0] = '\0';
+        }
+    }
+
+    printf("Load benchmark (in-process): %d rooms, %d bots, seed %llu, mix %s\n",
+           g_roomCount, bots, (unsigned long long)g_seed, mix);
+    printLoadResults(hist, (double)busyNs / 1e9, deaths);
+#if defined(MUD_ALLOC_STATS)
+    printf("  allocations: %.3f per command\n", (double)allocations / (double)commands);
+#else
+    printf("  allocations: not counted (build with -DMUD_ALLOC_STATS)\n");
+#endif
+    printf("  outcome    : %08x (same seed, world and settings: same value)\n", checksum);
+
+    for (int i = 0; i < bots; i++) {
+        outputRelease(bb[i].s);
+        free(bb[i].s);
+    }
+    free(bb);
+    free(hist);
+    free(text.data);
+    return 0;
+}
+
+/* Open a bot's connection to a local server */
+static int loadBotConnect(LoadBot *b, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+    b->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (b->fd < 0 || connect(b->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 0;
+    }
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    b->loggedIn = 0;
+    b->reply.len = 0;
+    b->exits = 0;
+    b->floorItem[0] = b->carried[0] = '\0';
+    return 1;
+}
+
+static int loadBotSend(LoadBot *b, const char *line, size_t len) {
+    char buf[MAX_INPUT_LEN + 1];
+    memcpy(buf, line, len);
+    buf[len] = '\n';
+    return send(b->fd, buf, len + 1, MSG_NOSIGNAL) == (ssize_t)(len + 1);
+}
+
+static int endsWith(const ByteBuf *b, const char *suffix) {
+    size_t n = strlen(suffix);
+    return b->len >= n && memcmp(b->data + b->len - n, suffix, n) == 0;
+}
+
+/* The same bots, over TCP against a server already listening on `port`.
+ * Each bot keeps one command in flight; latency runs from sending the
+ * command to receiving the prompt that ends its output. */
+int runNetLoadBenchmark(int port, int bots, long commands, const char *mix) {
+    int weights[LOAD_KINDS];
+    int total = parseLoadMix(mix, weights);
+    if (total <= 0 || bots < 1 || commands < 1) {
+        fprintf(stderr, "Invalid load benchmark settings (mix \"%s\").\n", mix);
+        return 1;
+    }
+    raiseFileLimit();
+
+    Rng rng;
+    rngSeed(&rng, g_seed, UINT64_MAX);
+    LoadBot *bb = calloc((size_t)bots, sizeof(LoadBot));
+    struct pollfd *pfds = calloc((size_t)bots, sizeof(struct pollfd));
+    LatencyHist *hist = calloc(LOAD_KINDS + 1, sizeof(LatencyHist));
+    if (!bb || !pfds || !hist) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (int i = 0; i < bots; i++) {
+        snprintf(bb[i].name, sizeof(bb[i].name), "netbot%d", i);
+        if (!loadBotConnect(&bb[i], port)) {
+            return 1;
+        }
+    }
+
+    long issued = 0, deaths = 0;
+    int failed = 0;
+    uint64_t t0 = nowNs();
+    while (hist[LOAD_KINDS].count < (uint64_t)commands && !failed) {
+        for (int i = 0; i < bots; i++) {
+            pfds[i].fd = bb[i].fd;
+            pfds[i].events = POLLIN;
+        }
+        int ready = poll(pfds, (nfds_t)bots, 10000);
+        if (ready <= 0) {
+            fprintf(stderr, "The server stopped answering.\n");
+            failed = 1;
+            break;
+        }
+        for (int i = 0; i < bots && !failed; i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            LoadBot *b = &bb[i];
+            char buf[16384];
+            ssize_t n = recv(b->fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                bufAppend(&b->reply, buf, (size_t)n);
+            }
+            int gone = n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN);
+            int prompt = endsWith(&b->reply, "] > ");
+            if (!gone && !prompt && !(!b->loggedIn && endsWith(&b->reply, "name: "))) {
+                continue; /* more output to come */
+            }
+
+            bufAppend(&b->reply, "", 1);
+            const char *text = (const char *)b->reply.data;
+            if (b->loggedIn && (prompt || gone)) {
+                uint64_t ns = nowNs() - b->sentNs;
+                histRecord(&hist[b->kind], ns);
+                histRecord(&hist[LOAD_KINDS], ns);
+            }
+            if (gone) {
+                if (!strstr(text, "You have died")) {
+                    fprintf(stderr, "Connection of %s closed unexpectedly.\n", b->name);
+                    failed = 1;
+                    break;
+                }
+                deaths++;
+                close(b->fd);
+                if (!loadBotConnect(b, port)) {
+                    failed = 1;
+                }
+                continue;
+            }
+            if (!b->loggedIn && !prompt) {
+                /* Name prompt; asked again if this name is in use */
+                if (strstr(text, "already playing")) {
+                    size_t len = strlen(b->name);
+                    if (len + 1 < sizeof(b->name)) {
+                        b->name[len] = 'x';
+                        b->name[len + 1] = '\0';
+                    }
+                }
+                b->reply.len = 0;
+                loadBotSend(b, b->name, strlen(b->name));
+                continue;
+            }
+            b->loggedIn = 1;
+            loadBotObserve(b, text);
+            b->reply.len = 0;
+            if (issued < commands) {
+                char line[MAX_INPUT_LEN];
+                size_t len = loadBotCommand(b, &rng, weights, total, line, sizeof(line));
+                b->sentNs = nowNs();
+                if (!loadBotSend(b, line, len)) {
+                    fprintf(stderr, "Could not send to the server.\n");
+                    failed = 1;
+                }
+                issued++;
+            }
+        }
+    }
+    double seconds = (double)(nowNs() - t0) / 1e9;
+
+    if (!failed) {
+        printf("Load benchmark (TCP, port %d): %d bots, seed %llu, mix %s\n",
+               port, bots, (unsigned long long)g_seed, mix);
+        printLoadResults(hist, seconds, deaths);
+    }
+    for (int i = 0; i < bots; i++) {
+        if (bb[i].fd >= 0) {
+            close(bb[i].fd);
+        }
+        free(bb[i].reply.data);
+    }
+    free(bb);
+    free(pfds);
+    free(hist);
+    return failed;
+}
+
+/* Chat benchmark message, said by the first session to all the others */
+static const char g_chatBenchLine[] =
+    "Meet at the fountain at dusk, and bring every health potion you can carry.";
+
+/* Fan one said line out to `count` in-process sessions standing in one
+ * room and send it to /dev/null, the line copied into each session's
+ * queue or shared by reference; straight into the output as the console
+ * does, and through the notice queues as a server with workers does.
+ * Reports the cost per recipient of queueing the line and of the writev
+ * that sends it. */
+int runChatBenchmark(const char *worldPath, int count) {
+    if (!mapWorldFile(worldPath)) {
+        return 1;
+    }
+    initCommands();
+    initWorldClock();
+    if (count < 1) {
+        count = 1;
+    }
+    int sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    Session **sessions = calloc((size_t)count + 1, sizeof(Session *));
+    if (sink < 0 || !sessions) {
+        fprintf(stderr, "Could not set up the chat benchmark.\n");
+        return 1;
+    }
+    const int room = 0;
+    for (int i = 0; i <= count; i++) {
+        Session *s = newSession(-1);
+        char name[MAX_NAME_LEN];
+        int len = snprintf(name, sizeof(name), "chatter%d", i);
+        if (!s || !handleLine(s, name, (size_t)len) || s->state != SESSION_PLAYING) {
+            fprintf(stderr, "Could not log in session %d.\n", i);
+            return 1;
+        }
+        sessionLeaveRoom(s);
+        s->player.currentRoom = room;
+        sessionEnterRoom(s);
+        outputDiscard(s);
+        sessions[i] = s;
+    }
+    Session *speaker = sessions[0];
+    char line[MAX_EVENT_LEN];
+    int lineLen = snprintf(line, sizeof(line), "%s says: %s\n", speaker->player.name, g_chatBenchLine);
+
+    printf("Chat benchmark: one %d-byte line to %d sessions in one room, %d rounds\n",
+           lineLen, count, CHAT_BENCH_ROUNDS);
+    printf("  %-16s %14s %14s %12s %10s\n",
+           "", "queue ns/sess", "send ns/sess", "bytes copied", "allocs");
+    static const char *const passNames[4] = {
+        "copied, direct", "shared, direct", "copied, notices", "shared, notices"
+    };
+    for (int pass = 0; pass < 4; pass++) {
+        int shared = pass & 1;
+        if (pass == 2 && !schedulerStart(1)) {
+            return 1; /* notices are queued only while there are workers */
+        }
+        uint64_t queueNs = 0, sendNs = 0, allocations = 0;
+        for (int round = -2; round < CHAT_BENCH_ROUNDS; round++) { /* two to warm up */
+            uint64_t allocs0 = allocationCount();
+            uint64_t t0 = nowNs();
+            if (shared) {
+                roomTell(room, speaker, "%s says: %s\n", speaker->player.name, g_chatBenchLine);
+            } else {
+                char text[MAX_EVENT_LEN];
+                int len = snprintf(text, sizeof(text), "%s says: %s\n",
+                                   speaker->player.name, g_chatBenchLine);
+                for (Session *o = g_roomPlayers[room]; o; o = o->roomNext) {
+                    if (o != speaker) {
+                        sessionNotify(o, text, (size_t)len, 0);
+                    }
+                }
+            }
+            if (pass >= 2) {
+                /* What the main thread does when woken: move the notices
+                 * of every session it was told about into its output */
+                for (Session *n = schedulerTakeNotices(), *next; n; n = next) {
+                    next = n->noticeNext;
+                    pthread_mutex_lock(&n->noticeLock);
+                    n->noticePosted = 0;
+                    pthread_mutex_unlock(&n->noticeLock);
+                    sessionTakeNotices(n, 0);
+                }
+            }
+            uint64_t t1 = nowNs();
+            for (int i = 1; i <= count; i++) {
+                if (outputWritev(sessions[i], sink) < 0 || sessions[i]->out.len > 0) {
+                    fprintf(stderr, "Could not send to session %d.\n", i);
+                    return 1;
+                }
+            }
+            uint64_t t2 = nowNs();
+            if (round < 0) {
+                continue;
+            }
+            allocations += allocationCount() - allocs0;
+            queueNs += t1 - t0;
+            sendNs += t2 - t1;
+        }
+        double sends = (double)count * CHAT_BENCH_ROUNDS;
+        printf("  %-16s %14.1f %14.1f %12ld %10.2f\n", passNames[pass],
+               (double)queueNs / sends, (double)sendNs / sends,
+               shared ? (long)lineLen : (long)lineLen * count, (double)allocations / sends);
+    }
+    schedulerStop();
+#if !defined(MUD_ALLOC_STATS)
+    printf("  allocations: not counted (build with -DMUD_ALLOC_STATS)\n");
+#endif
+
+    for (int i = 0; i <= count; i++) {
+        logoutPlayer(sessions[i]);
+        outputRelease(sessions[i]);
+        pthread_mutex_destroy(&sessions[i]->noticeLock);
+        free(sessions[i]);
+    }
+    free(sessions);
+    close(sink);
+    return 0;
+}
+
+#if defined(MUD_SELF_TEST)
+/*****************************************************************************
+ * SAVE CHECK
+ *
+ * Built only with -DMUD_SELF_TEST. `--check-saves` plays a character through saving, loading and restarts
+ * and checks that it comes back as it was left: its room, stats and
+ * inventory, and the items on the floor of every room. Each stage is a
+ * fresh process (forked, so nothing carries over in memory) working in a
+ * scratch directory; it checks what the previous stage left and reports
+ * what the next one should find through a pipe. Between them the stages
+ * cover load within a session, journal replay, a background checkpoint
+ * with the journal written while it ran, the player store after two
+ * checkpoints, and upgrading a raw save from the original version.
+ *****************************************************************************/
+
+#define SAVE_CHECK_ROOMS 5     /* the demo world's */
+
+/* What a stage expects of its character and the world */
+typedef struct {
+    int32_t stats[PLAYER_STAT_COUNT];
+    int     itemCount;
+    char    items[MAX_INVENTORY_SIZE][MAX_NAME_LEN];   /* sorted */
+    int     ground[SAVE_CHECK_ROOMS];                  /* items, per room */
+} SaveCheckState;
+
+static int compareItemNames(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+static void saveCheckAddItem(SaveCheckState *st, const char *name) {
+    snprintf(st->items[st->itemCount++], MAX_NAME_LEN, "%s", name);
+    qsort(st->items, (size_t)st->itemCount, MAX_NAME_LEN, compareItemNames);
+}
+
+static void saveCheckCapture(const Session *s, SaveCheckState *st) {
+    memset(st, 0, sizeof(*st));
+    getPlayerStats(&s->player, st->stats);
+    for (int i = 0; i < s->player.inventory.count; i++) {
+        saveCheckAddItem(st, itemProto(s->player.inventory.items[i])->name);
+    }
+    for (int i = 0; i < SAVE_CHECK_ROOMS; i++) {
+        st->ground[i] = getRoom(i)->ground.count;
+    }
 }
 
-/* COMMAND: load */
-void doLoad() {
-    FILE *f = fopen(SAVE_FILE_NAME, "rb");
-    if (!f) {
-        printf("No save file found or cannot open the file.\n");
-        return;
+/* Report every difference; 1 if there are none */
+static int saveCheckCompare(const char *when, const SaveCheckState *got, const SaveCheckState *want) {
+    static const char *statNames[PLAYER_STAT_COUNT] = {
+        "level", "exp", "exp to next level", "HP", "max HP", "MP", "max MP",
+        "attack power", "gold", "room"
+    };
+    int wrong = 0;
+    for (int i = 0; i < PLAYER_STAT_COUNT; i++) {
+        if (got->stats[i] != want->stats[i]) {
+            fprintf(stderr, "  %s: %s is %d, expected %d\n", when, statNames[i],
+                    (int)got->stats[i], (int)want->stats[i]);
+            wrong++;
+        }
     }
-    
-    /* Load player data */
-    fread(&g_player, sizeof(Player), 1, f);
-    
-    /* Load room data */
-    fread(&g_roomCount, sizeof(int), 1, f);
-    fread(&g_rooms, sizeof(Room), g_roomCount, f);
-    
-    fclose(f);
-    printf("Game loaded.\n");
+    if (got->itemCount != want->itemCount ||
+        memcmp(got->items, want->items, sizeof(got->items)) != 0) {
+        fprintf(stderr, "  %s: carrying %d item(s), expected %d:", when, got->itemCount, want->itemCount);
+        for (int i = 0; i < want->itemCount; i++) {
+            fprintf(stderr, "%s %s", i ? "," : "", want->items[i]);
+        }
+        fprintf(stderr, "\n");
+        wrong++;
+    }
+    for (int i = 0; i < SAVE_CHECK_ROOMS; i++) {
+        if (got->ground[i] != want->ground[i]) {
+            fprintf(stderr, "  %s: %d item(s) on the floor of room %d, expected %d\n",
+                    when, got->ground[i], i, want->ground[i]);
+            wrong++;
+        }
+    }
+    return wrong == 0;
+}
+
+static Session *saveCheckLogin(const char *name) {
+    char line[MAX_NAME_LEN];
+    int len = snprintf(line, sizeof(line), "%s", name);
+    Session *s = newSession(-1);
+    if (!s || !handleLine(s, line, (size_t)len) || s->state != SESSION_PLAYING) {
+        fprintf(stderr, "Could not log in %s.\n", name);
+        exit(1);
+    }
+    if (strcmp(s->player.name, name) != 0) {
+        fprintf(stderr, "  logging in as %s resumed %s\n", name, s->player.name);
+        exit(1);
+    }
+    outputDiscard(s);
+    return s;
+}
+
+/* Run commands separated by ';', dropping what they print */
+static void saveCheckRun(Session *s, const char *script) {
+    char line[MAX_INPUT_LEN];
+    while (*script) {
+        size_t len = strcspn(script, ";");
+        snprintf(line, sizeof(line), "%.*s", (int)len, script);
+        handleLine(s, line, strlen(line));
+        outputDiscard(s);
+        script += len + (script[len] == ';');
+    }
+}
+
+/* Log out and shut down as the game does on exit */
+static void saveCheckQuit(Session *s) {
+    logoutPlayer(s);
+    outputRelease(s);
+    free(s);
+    journalCommit();
+    journalSnapshotWait();
+}
+
+/* A fresh world: save, pick something up, walk off, load */
+static int saveCheckLoad(const SaveCheckState *want, SaveCheckState *next) {
+    (void)want;
+    if (!initGame(NULL)) {
+        return 0;
+    }
+    /* Someone whose name hashes like "checker": each keeps its own character */
+    uint64_t key = playerKeyFor("checker");
+    playerTableAdd(key, "impostor");
+    journalPlayerName(key, "impostor");
+    Session *s = saveCheckLogin("checker");
+    saveCheckRun(s, "take town map;n");
+    s->player.gold += 3;                         /* as a kill would pay */
+    saveCheckRun(s, "save");
+    SaveCheckState saved, got;
+    saveCheckCapture(s, &saved);
+    s->player.gold += 25;
+    saveCheckRun(s, "take rusty sword;s;load");
+    saveCheckCapture(s, &got);
+    /* Back to the saved room and gold; the sword is part of the world */
+    saveCheckAddItem(&saved, "Rusty Sword");
+    saved.ground[1]--;
+    int ok = saveCheckCompare("after load", &got, &saved);
+
+    /* Hurt with a hostile monster in the room: load must neither heal the
+     * character nor take it out of the fight */
+    Monster *m = spawnMonster(s->player.currentRoom);
+    s->player.hp -= 12;                          /* as its blows would */
+    SaveCheckState fighting;
+    saveCheckCapture(s, &fighting);
+    saveCheckRun(s, "load");
+    saveCheckCapture(s, &got);
+    ok &= m && saveCheckCompare("load in a fight", &got, &fighting);
+    /* Once it is gone, load goes back to the save but keeps the wounds */
+    if (m) {
+        removeRoomMonster(m);
+    }
+    saveCheckRun(s, "s;load");
+    saveCheckCapture(s, &got);
+    SaveCheckState wounded = fighting;
+    memcpy(wounded.stats, saved.stats, sizeof(wounded.stats));
+    wounded.stats[3] = fighting.stats[3];        /* HP */
+    ok &= saveCheckCompare("load after a fight", &got, &wounded);
+
+    s->player.gold += 10;
+    saveCheckCapture(s, next);
+    saveCheckQuit(s);
+    return ok;
+}
+
+/* Restart from the journal alone, then checkpoint in the background
+ * and keep playing while it is written */
+static int saveCheckReplay(const SaveCheckState *want, SaveCheckState *next) {
+    if (!initGame(NULL)) {
+        return 0;
+    }
+    Session *s = saveCheckLogin("checker");
+    SaveCheckState got;
+    saveCheckCapture(s, &got);
+    int ok = saveCheckCompare("after journal replay", &got, want);
+
+    saveCheckRun(s, "drop town map");
+    journalPlayer(s);
+    journalCheckpoint();
+    saveCheckRun(s, "s");
+    s->player.gold += 5;
+    saveCheckCapture(s, next);
+    saveCheckQuit(s);
+    return ok;
+}
+
+/* Restart from that checkpoint and the journal after it, then write a
+ * second version of the character to the player store */
+static int saveCheckCheckpoint(const SaveCheckState *want, SaveCheckState *next) {
+    int ok = access(JOURNAL_NEXT_NAME, F_OK) != 0;
+    if (!ok) {
+        fprintf(stderr, "  %s was left behind by the background checkpoint\n", JOURNAL_NEXT_NAME);
+    }
+    if (!initGame(NULL)) {
+        return 0;
+    }
+    Session *s = saveCheckLogin("checker");
+    SaveCheckState got;
+    saveCheckCapture(s, &got);
+    ok &= saveCheckCompare("after checkpoint", &got, want);
+
+    s->player.gold += 7;
+    journalPlayer(s);
+    if (!journalCompact()) {
+        return 0;
+    }
+    saveCheckCapture(s, next);
+    saveCheckQuit(s);
+    return ok;
+}
+
+/* Restart with an empty journal: the character comes from the store */
+static int saveCheckStore(const SaveCheckState *want, SaveCheckState *next) {
+    if (!initGame(NULL)) {
+        return 0;
+    }
+    Session *s = saveCheckLogin("checker");
+    SaveCheckState got;
+    saveCheckCapture(s, &got);
+    int ok = saveCheckCompare("from the player store", &got, want);
+    *next = got;
+    saveCheckQuit(s);
+    return ok;
+}
+
+/* Write a v0 save (the original raw struct dump) and load it */
+static int saveCheckLegacy(const SaveCheckState *want, SaveCheckState *next) {
+    (void)want;
+    static const char *roomNames[SAVE_CHECK_ROOMS] = {
+        "Town Square", "Blacksmith", "Forest Edge", "Deep Forest", "Ancient Ruin"
+    };
+    LegacyPlayer lp;
+    memset(&lp, 0, sizeof(lp));
+    snprintf(lp.name, sizeof(lp.name), "veteran");
+    int32_t stats[PLAYER_STAT_COUNT] = { 3, 40, 60, 45, 50, 12, 15, 9, 42, 2 };
+    memcpy(lp.stats, stats, sizeof(stats));
+    lp.items[0] = (LegacyItem){ "Rusty Sword", ITEM_WEAPON, 5, 10 };
+    lp.items[1] = (LegacyItem){ "Old Lantern", ITEM_MISC, 0, 3 };
+    lp.itemCount = 2;
+    LegacyRoom rooms[SAVE_CHECK_ROOMS];
+    memset(rooms, 0, sizeof(rooms));
+    for (int i = 0; i < SAVE_CHECK_ROOMS; i++) {
+        rooms[i].id = i;
+        snprintf(rooms[i].name, sizeof(rooms[i].name), "%s", roomNames[i]);
+    }
+    rooms[0].itemsInRoom[0] = (LegacyItem){ "Town Map", ITEM_MISC, 0, 5 };
+    rooms[0].itemCount = 1;
+    rooms[4].itemsInRoom[0] = (LegacyItem){ "Ancient Relic", ITEM_MISC, 0, 100 };
+    rooms[4].itemCount = 1;
+
+    unlink(SAVE_FILE_NAME);
+    unlink(JOURNAL_FILE_NAME);
+    unlink(PLAYER_STORE_NAME);
+    int roomCount = SAVE_CHECK_ROOMS;
+    FILE *f = fopen(SAVE_FILE_NAME, "wb");
+    if (!f || fwrite(&lp, sizeof(lp), 1, f) != 1 ||
+        fwrite(&roomCount, sizeof(int), 1, f) != 1 ||
+        fwrite(rooms, sizeof(LegacyRoom), SAVE_CHECK_ROOMS, f) != SAVE_CHECK_ROOMS ||
+        fclose(f) != 0) {
+        perror(SAVE_FILE_NAME);
+        return 0;
+    }
+    if (!initGame(NULL)) {
+        return 0;
+    }
+
+    SaveCheckState expect;
+    memset(&expect, 0, sizeof(expect));
+    memcpy(expect.stats, stats, sizeof(stats));
+    saveCheckAddItem(&expect, "Rusty Sword");
+    saveCheckAddItem(&expect, "Old Lantern");
+    expect.ground[0] = expect.ground[4] = 1;
+    Session *s = saveCheckLogin("veteran");
+    SaveCheckState got;
+    saveCheckCapture(s, &got);
+    int ok = saveCheckCompare("after the upgrade", &got, &expect);
+    *next = got;
+    saveCheckQuit(s);
+    return ok;
+}
+
+/* Restart from the upgraded save, now in the current format */
+static int saveCheckUpgraded(const SaveCheckState *want, SaveCheckState *next) {
+    if (!initGame(NULL)) {
+        return 0;
+    }
+    Session *s = saveCheckLogin("veteran");
+    SaveCheckState got;
+    saveCheckCapture(s, &got);
+    int ok = saveCheckCompare("after restarting the upgrade", &got, want);
+    *next = got;
+    saveCheckQuit(s);
+    return ok;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(const SaveCheckState *want, SaveCheckState *next);
+} g_saveCheckStages[] = {
+    /* The journal: save and load (refused in a fight), then its replay.
+     * The first stage also adds a character whose name hashes like the
+     * checker's, which every later login must tell apart. */
+    { "save, move and load",                  saveCheckLoad },
+    { "restart: journal replay",              saveCheckReplay },
+    /* Checkpoints written by a forked child while play goes on */
+    { "restart: background checkpoint",       saveCheckCheckpoint },
+    /* Characters read back from the player store alone */
+    { "restart: player store",                saveCheckStore },
+    /* The versioned save format and upgrading raw-struct saves */
+    { "upgrade a v0 save",                    saveCheckLegacy },
+    { "restart: upgraded save",               saveCheckUpgraded },
+};
+
+/* Remove what the stages left in the scratch directory */
+static void saveCheckCleanup(const char *dir) {
+    DIR *d = opendir(".");
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+            unlink(e->d_name);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    if (chdir("/") < 0 || rmdir(dir) < 0) {
+        perror(dir);
+    }
+}
+
+int runSaveCheck() {
+    char dir[] = "/tmp/mud_check_XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+    size_t count = sizeof(g_saveCheckStages) / sizeof(g_saveCheckStages[0]);
+    size_t passed = 0;
+    SaveCheckState want;
+    memset(&want, 0, sizeof(want));
+    printf("Save check in %s:\n", dir);
+    for (size_t i = 0; i < count; i++) {
+        int fds[2];
+        if (pipe(fds) < 0) {
+            perror("pipe");
+            break;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            /* The game's own messages would get in the way of the report */
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) {
+                dup2(null, STDOUT_FILENO);
+                close(null);
+            }
+            close(fds[0]);
+            SaveCheckState next = want;
+            int ok = g_saveCheckStages[i].run(&want, &next);
+            ok = write(fds[1], &next, sizeof(next)) == (ssize_t)sizeof(next) && ok;
+            fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+        close(fds[1]);
+        int status = 0;
+        pid_t done = pid;
+        while (done > 0 && (done = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
+            done = pid;
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
+        /* Smaller than PIPE_BUF: written in one piece, already waiting */
+        SaveCheckState next;
+        int ok = done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                 read(fds[0], &next, sizeof(next)) == (ssize_t)sizeof(next);
+        close(fds[0]);
+        printf("  %-36s %s\n", g_saveCheckStages[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            break;  /* the rest build on this one */
+        }
+        want = next;
+        passed++;
+    }
+    saveCheckCleanup(dir);
+    printf("  %zu of %zu stages passed\n", passed, count);
+    return passed != count;
+}
+#endif /* MUD_SELF_TEST */
+
+/*****************************************************************************
+ * COMBAT SIMULATOR
+ *
+ * `--simulate` plays whole careers: a player starting at a chosen level
+ * fights one monster after another, resting to full HP in between, until
+ * it dies or has fought the requested number of fights. Every blow,
+ * spawn, reward and level-up goes through the game's own rules
+ * (combatRound, spawnLevel, makeMonster, awardKill, levelUp), so the
+ * numbers it prints are the numbers players will see.
+ *
+ * Careers are dealt out in chunks of SIM_LANES to one thread per core.
+ * A thread plays its chunk side by side: the stats a round of combat
+ * touches are kept as arrays (one per stat, one slot per career) and
+ * combatRound runs over all of them at once; a career that ends is
+ * swapped out of the arrays so every round works on live fights only.
+ * Each chunk has its own generator, seeded from the run seed and the
+ * chunk number, so a seed gives the same results on any number of cores.
+ *****************************************************************************/
+
+/* The careers of one chunk, as arrays of stats */
+typedef struct {
+    int      playerHp[SIM_LANES];
+    int      playerAttack[SIM_LANES];
+    int      monsterHp[SIM_LANES];
+    int      monsterAttack[SIM_LANES];
+    int      monsterLevel[SIM_LANES];
+    int      rounds[SIM_LANES];        /* of the fight in progress */
+    int      fight[SIM_LANES];         /* fights finished */
+    int      dealt[SIM_LANES];
+    int      taken[SIM_LANES];
+    uint64_t expEarned[SIM_LANES];
+    Player   player[SIM_LANES];        /* the rest, used between fights */
+} SimLanes;
+
+/* What one thread saw; summed over threads at the end */
+typedef struct {
+    pthread_t thread;
+    uint64_t  fights[SIM_MAX_LEVEL + 1][MONSTER_MAX_LEVEL + 1]; /* by player, monster level */
+    uint64_t  wins[SIM_MAX_LEVEL + 1][MONSTER_MAX_LEVEL + 1];
+    uint64_t  rounds[MONSTER_MAX_LEVEL + 1][SIM_MAX_ROUNDS + 1]; /* won fights by length */
+    uint64_t *alive;                   /* per fight: careers that won it */
+    uint64_t *level;                   /* and the sums of their stats after it */
+    uint64_t *gold;
+    uint64_t *exp;
+} SimWorker;
+
+static struct {
+    long careers;
+    int  fights;                       /* per career, at most */
+    int  level;                        /* starting player level */
+    int  monsterLevel;                 /* 0 = as spawned in the game */
+    long chunks;
+    long nextChunk;
+} g_sim;
+
+/* Put a fresh monster in front of the career in `lane`, player rested */
+static void simStartFight(SimLanes *l, int lane, Rng *rng) {
+    Monster m;
+    makeMonster(&m, g_sim.monsterLevel ? g_sim.monsterLevel : spawnLevel(rng));
+    l->monsterHp[lane] = m.hp;
+    l->monsterAttack[lane] = m.attackPower;
+    l->monsterLevel[lane] = m.level;
+    l->playerHp[lane] = l->player[lane].maxHp;
+    l->playerAttack[lane] = l->player[lane].attackPower;
+    l->rounds[lane] = 0;
+}
+
+static void simMoveLane(SimLanes *l, int to, int from) {
+    l->playerHp[to] = l->playerHp[from];
+    l->playerAttack[to] = l->playerAttack[from];
+    l->monsterHp[to] = l->monsterHp[from];
+    l->monsterAttack[to] = l->monsterAttack[from];
+    l->monsterLevel[to] = l->monsterLevel[from];
+    l->rounds[to] = l->rounds[from];
+    l->fight[to] = l->fight[from];
+    l->expEarned[to] = l->expEarned[from];
+    l->player[to] = l->player[from];
+}
+
+/* Play every career in a chunk to its end */
+static void simChunk(SimWorker *w, SimLanes *l, long chunk) {
+    long first = chunk * SIM_LANES;
+    int n = g_sim.careers - first < SIM_LANES ? (int)(g_sim.careers - first) : SIM_LANES;
+    Rng rng;
+    rngSeed(&rng, g_seed, (uint64_t)chunk);
+
+    for (int i = 0; i < n; i++) {
+        initPlayer(&l->player[i], "Sim");
+        while (l->player[i].level < g_sim.level) {
+            levelUp(&l->player[i]);
+        }
+        l->fight[i] = 0;
+        l->expEarned[i] = 0;
+        simStartFight(l, i, &rng);
+    }
+
+    while (n > 0) {
+        combatRound(&rng, n, l->playerAttack, l->playerHp,
+                    l->monsterAttack, l->monsterHp, l->dealt, l->taken);
+        for (int i = 0; i < n; i++) {
+            l->rounds[i]++;
+        }
+        for (int i = 0; i < n; ) {
+            if (l->monsterHp[i] > 0 && l->playerHp[i] > 0) {
+                i++;
+                continue;
+            }
+            Player *p = &l->player[i];
+            int row = p->level < SIM_MAX_LEVEL ? p->level : SIM_MAX_LEVEL;
+            int ml = l->monsterLevel[i];
+            w->fights[row][ml]++;
+            if (l->monsterHp[i] <= 0) {
+                w->wins[row][ml]++;
+                w->rounds[ml][l->rounds[i] < SIM_MAX_ROUNDS ? l->rounds[i] : SIM_MAX_ROUNDS]++;
+                int gold, exp;
+                awardKill(&rng, p, ml, &gold, &exp);
+                l->expEarned[i] += (uint64_t)exp;
+                int k = l->fight[i]++;
+                w->alive[k]++;
+                w->level[k] += (uint64_t)p->level;
+                w->gold[k] += (uint64_t)p->gold;
+                w->exp[k] += l->expEarned[i];
+                if (l->fight[i] < g_sim.fights) {
+                    simStartFight(l, i, &rng);
+                    i++;
+                    continue;
+                }
+            }
+            /* This career is over: its slot goes to the last live one */
+            simMoveLane(l, i, --n);
+        }
+    }
+}
+
+static void *simThread(void *arg) {
+    SimWorker *w = arg;
+    SimLanes *l = malloc(sizeof(SimLanes));
+    if (!l) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (;;) {
+        long chunk = __atomic_fetch_add(&g_sim.nextChunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= g_sim.chunks) {
+            break;
+        }
+        simChunk(w, l, chunk);
+    }
+    free(l);
+    return NULL;
+}
+
+/* Fight count below which a fraction q of the counted fights fall */
+static int simPercentile(const uint64_t *hist, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * (double)count);
+    uint64_t seen = 0;
+    for (int r = 0; r <= SIM_MAX_ROUNDS; r++) {
+        seen += hist[r];
+        if (seen > rank) {
+            return r;
+        }
+    }
+    return SIM_MAX_ROUNDS;
+}
+
+/* Run the simulator and print win rates, time to kill and progress */
+int runSimulation(long careers, int fights, int level, int monsterLevel, int threads) {
+    if (careers < 1 || fights < 1 || level < 1 || level > SIM_MAX_LEVEL ||
+        monsterLevel < 0 || monsterLevel > MONSTER_MAX_LEVEL) {
+        fprintf(stderr, "Invalid simulation: careers and fights must be positive, "
+                        "level 1-%d, monster level 0-%d.\n", SIM_MAX_LEVEL, MONSTER_MAX_LEVEL);
+        return 1;
+    }
+    g_sim.careers = careers;
+    g_sim.fights = fights;
+    g_sim.level = level;
+    g_sim.monsterLevel = monsterLevel;
+    g_sim.chunks = (careers + SIM_LANES - 1) / SIM_LANES;
+    g_sim.nextChunk = 0;
+    if (threads > g_sim.chunks) {
+        threads = (int)g_sim.chunks;
+    }
+
+    SimWorker *workers = calloc((size_t)threads, sizeof(SimWorker));
+    uint64_t *curves = calloc((size_t)threads * 4 * (size_t)fights, sizeof(uint64_t));
+    if (!workers || !curves) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    uint64_t t0 = nowNs();
+    for (int t = 0; t < threads; t++) {
+        SimWorker *w = &workers[t];
+        w->alive = curves + (size_t)t * 4 * (size_t)fights;
+        w->level = w->alive + fights;
+        w->gold = w->level + fights;
+        w->exp = w->gold + fights;
+        if (pthread_create(&w->thread, NULL, simThread, w) != 0) {
+            fprintf(stderr, "Could not start simulator thread.\n");
+            return 1;
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double seconds = (double)(nowNs() - t0) / 1e9;
+
+    /* Sum everything into the first worker */
+    SimWorker *sum = &workers[0];
+    for (int t = 1; t < threads; t++) {
+        const SimWorker *w = &workers[t];
+        for (int r = 0; r <= SIM_MAX_LEVEL; r++) {
+            for (int m = 0; m <= MONSTER_MAX_LEVEL; m++) {
+                sum->fights[r][m] += w->fights[r][m];
+                sum->wins[r][m] += w->wins[r][m];
+            }
+        }
+        for (int m = 0; m <= MONSTER_MAX_LEVEL; m++) {
+            for (int r = 0; r <= SIM_MAX_ROUNDS; r++) {
+                sum->rounds[m][r] += w->rounds[m][r];
+            }
+        }
+        for (int k = 0; k < fights; k++) {
+            sum->alive[k] += w->alive[k];
+            sum->level[k] += w->level[k];
+            sum->gold[k] += w->gold[k];
+            sum->exp[k] += w->exp[k];
+        }
+    }
+    uint64_t total = 0;
+    for (int r = 0; r <= SIM_MAX_LEVEL; r++) {
+        for (int m = 0; m <= MONSTER_MAX_LEVEL; m++) {
+            total += sum->fights[r][m];
+        }
+    }
+
+    printf("Combat simulation: %ld careers of up to %d fights from level %d, "
+           "monsters %s, seed %llu, %d thread%s\n",
+           careers, fights, level, monsterLevel ? "of one level" : "as spawned",
+           (unsigned long long)g_seed, threads, threads == 1 ? "" : "s");
+    printf("  %llu fights in %.2f s (%.0f fights/s)\n\n",
+           (unsigned long long)total, seconds, (double)total / seconds);
+
+    printf("Win rate by player level:\n");
+    printf("  level");
+    for (int m = 1; m <= MONSTER_MAX_LEVEL; m++) {
+        printf("     vs level %d     ", m);
+    }
+    printf("\n");
+    for (int r = 1; r <= SIM_MAX_LEVEL; r++) {
+        uint64_t row = 0;
+        for (int m = 1; m <= MONSTER_MAX_LEVEL; m++) {
+            row += sum->fights[r][m];
+        }
+        if (row == 0) {
+            continue;
+        }
+        printf("  %4d%s", r, r == SIM_MAX_LEVEL ? "+" : " ");
+        for (int m = 1; m <= MONSTER_MAX_LEVEL; m++) {
+            if (sum->fights[r][m] == 0) {
+                printf("  %10s        ", "-");
+            } else {
+                printf("  %10llu %6.2f%%", (unsigned long long)sum->fights[r][m],
+                       100.0 * (double)sum->wins[r][m] / (double)sum->fights[r][m]);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\nRounds to kill (won fights, one round per attack):\n");
+    printf("  monster     fights   mean  p50  p90  p99  max\n");
+    for (int m = 1; m <= MONSTER_MAX_LEVEL; m++) {
+        uint64_t count = 0, rounds = 0;
+        int max = 0;
+        for (int r = 0; r <= SIM_MAX_ROUNDS; r++) {
+            count += sum->rounds[m][r];
+            rounds += sum->rounds[m][r] * (uint64_t)r;
+            if (sum->rounds[m][r]) {
+                max = r;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        printf("  level %d %10llu %6.2f %4d %4d %4d %3d%s\n", m, (unsigned long long)count,
+               (double)rounds / (double)count, simPercentile(sum->rounds[m], count, 0.50),
+               simPercentile(sum->rounds[m], count, 0.90),
+               simPercentile(sum->rounds[m], count, 0.99), max,
+               max == SIM_MAX_ROUNDS ? "+" : "");
+    }
+
+    printf("\nCareers after each fight (averages over the survivors):\n");
+    printf("  fight   alive    level       gold   exp earned\n");
+    for (int k = 0; k < fights; k++) {
+        int shown = k + 1;
+        int step = 1;
+        while (step * 10 <= shown) {
+            step *= 10;
+        }
+        if (shown % step != 0 && shown != fights) {
+            continue; /* 1-10, then 20-100, 200-1000, ... and the last */
+        }
+        uint64_t alive = sum->alive[k];
+        printf("  %5d %6.2f%%", shown, 100.0 * (double)alive / (double)careers);
+        if (alive) {
+            printf(" %8.2f %10.1f %12.1f", (double)sum->level[k] / (double)alive,
+                   (double)sum->gold[k] / (double)alive, (double)sum->exp[k] / (double)alive);
+        }
+        printf("\n");
+    }
+
+    free(curves);
+    free(workers);
+    return 0;
 }
 
 /*****************************************************************************
  * UTILITY & HELPER FUNCTIONS
  *****************************************************************************/
 
-/* Find item in room by name, return index or -1 if not found */
-int findItemInRoom(Room *room, const char *itemName) {
-    for (int i = 0; i < room->itemCount; i++) {
-        if (strcasecmp(room->itemsInRoom[i].name, itemName) == 0) {
-            return i;
+/* Case-folded FNV-1a hash of an item name; Inventory indexes are keyed
+ * on it, so "health potion" and "Health Potion" land in the same slot. */
+uint32_t itemNameHash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
+    }
+    return h;
+}
+
+/* Index slot of the item at `pos` */
+static size_t inventorySlotOf(const Inventory *inv, int pos) {
+    size_t j = itemProto(inv->items[pos])->nameHash & (ITEM_INDEX_SLOTS - 1);
+    while (inv->index[j] != pos + 1) {
+        j = (j + 1) & (ITEM_INDEX_SLOTS - 1);
+    }
+    return j;
+}
+
+static void inventoryIndexAdd(Inventory *inv, int pos) {
+    size_t j = itemProto(inv->items[pos])->nameHash & (ITEM_INDEX_SLOTS - 1);
+    while (inv->index[j]) {
+        j = (j + 1) & (ITEM_INDEX_SLOTS - 1);
+    }
+    inv->index[j] = (InventorySlot)(pos + 1);
+}
+
+/* Empty slot j, pulling later entries of its probe run back so that no
+ * tombstones are needed */
+static void inventoryIndexErase(Inventory *inv, size_t j) {
+    const size_t mask = ITEM_INDEX_SLOTS - 1;
+    inv->index[j] = 0;
+    for (size_t k = (j + 1) & mask; inv->index[k]; k = (k + 1) & mask) {
+        size_t home = itemProto(inv->items[inv->index[k] - 1])->nameHash & mask;
+        if (((k - home) & mask) >= ((k - j) & mask)) {
+            inv->index[j] = inv->index[k];
+            inv->index[k] = 0;
+            j = k;
         }
     }
-    return -1;
 }
 
-/* Find item in inventory by name, return index or -1 if not found */
-int findItemInInventory(Inventory *inv, const char *itemName) {
+/* Rebuild the name index after the item array was changed directly */
+void reindexInventory(Inventory *inv) {
+    memset(inv->index, 0, sizeof(inv->index));
     for (int i = 0; i < inv->count; i++) {
-        if (strcasecmp(inv->items[i].name, itemName) == 0) {
-            return i;
+        inventoryIndexAdd(inv, i);
+    }
+}
+
+/* Does `query` (len bytes) start the name, or one of its words? */
+static int itemNameMatches(const char *name, const char *query, size_t len) {
+    for (const char *w = name; *w; w++) {
+        if ((w == name || w[-1] == ' ') && strncasecmp(w, query, len) == 0) {
+            return 1;
         }
     }
-    return -1;
+    return 0;
 }
 
-/* Remove item from room at index, shifting the rest */
-void removeItemFromRoom(Room *room, int index) {
-    if (index < 0 || index >= room->itemCount) return;
-    for (int i = index; i < room->itemCount - 1; i++) {
-        room->itemsInRoom[i] = room->itemsInRoom[i+1];
+/* Find item in inventory by name: an exact (case-insensitive) name through
+ * the index, else a partial name ("potion", "heal"). Returns its index, -1
+ * if not found, or -2 if the partial name fits differently named items. */
+int findItemInInventory(const Inventory *inv, const char *itemName) {
+    size_t len = strlen(itemName);
+    if (len == 0) {
+        return -1;
+    }
+    uint32_t h = itemNameHash(itemName, len);
+    for (size_t j = h & (ITEM_INDEX_SLOTS - 1); inv->index[j]; j = (j + 1) & (ITEM_INDEX_SLOTS - 1)) {
+        int pos = inv->index[j] - 1;
+        const Item *item = itemProto(inv->items[pos]);
+        if (item->nameHash == h && strcasecmp(item->name, itemName) == 0) {
+            return pos;
+        }
+    }
+
+    /* A partial name can match any word, so the index can't key it. Big
+     * floors are mostly copies of a few items, so a copy of the item just
+     * tested, or of the one found, is not tested again. */
+    int found = -1;
+    ItemId tested = 0;
+    int testedMatches = 0;
+    for (int i = 0; i < inv->count; i++) {
+        ItemId id = inv->items[i];
+        if (i == 0 || id != tested) {
+            if (found >= 0 && id == inv->items[found]) {
+                continue;
+            }
+            tested = id;
+            testedMatches = itemNameMatches(itemProto(id)->name, itemName, len);
+        }
+        if (!testedMatches) {
+            continue;
+        }
+        if (found < 0) {
+            found = i;
+        } else if (id != inv->items[found] &&
+                   strcasecmp(itemProto(inv->items[found])->name, itemProto(id)->name) != 0) {
+            return -2;
+        }
     }
-    room->itemCount--;
+    return found;
 }
 
-/* Remove item from inventory at index, shifting the rest */
+/* Find item in room by name, as findItemInInventory */
+int findItemInRoom(Room *room, const char *itemName) {
+    return findItemInInventory(&room->ground, itemName);
+}
+
+/* Remove item from inventory at index; the last item takes its place */
 void removeItemFromInventory(Inventory *inv, int index) {
     if (index < 0 || index >= inv->count) return;
-    for (int i = index; i < inv->count - 1; i++) {
-        inv->items[i] = inv->items[i+1];
+    int last = inv->count - 1;
+    inventoryIndexErase(inv, inventorySlotOf(inv, index));
+    if (index != last) {
+        inv->index[inventorySlotOf(inv, last)] = (InventorySlot)(index + 1);
+        inv->items[index] = inv->items[last];
     }
     inv->count--;
 }
 
-/* Add an item to inventory */
-void addItemToInventory(Inventory *inv, Item item) {
+/* Remove item from room at index */
+void removeItemFromRoom(Room *room, int index) {
+    removeItemFromInventory(&room->ground, index);
+    roomChanged(room->id);
+}
+
+/* Add an item to inventory; 0 if it is full */
+int addItemToInventory(Inventory *inv, ItemId item) {
     if (inv->count >= MAX_INVENTORY_SIZE) {
-        return; /* already full */
+        return 0; /* already full */
     }
     inv->items[inv->count] = item;
+    inventoryIndexAdd(inv, inv->count);
     inv->count++;
+    return 1;
 }
 
 /* Add item to room */
-void addItemToRoom(Room *room, Item item) {
-    if (room->itemCount >= MAX_INVENTORY_SIZE) {
-        return;
-    }
-    room->itemsInRoom[room->itemCount] = item;
-    room->itemCount++;
+void addItemToRoom(Room *room, ItemId item) {
+    addItemToInventory(&room->ground, item);
+    roomChanged(room->id);
 }
 
-/* Convert direction string to index (north=0, south=1, etc.) */
+/* Convert direction string to index (north=0, south=1, etc.). Any prefix
+ * works ("n", "nor") since every direction starts with a different letter. */
 int getExitIndexByName(const char *exitName) {
-    if (strcmp(exitName, "north") == 0) return DIR_NORTH;
-    if (strcmp(exitName, "south") == 0) return DIR_SOUTH;
-    if (strcmp(exitName, "east") == 0)  return DIR_EAST;
-    if (strcmp(exitName, "west") == 0)  return DIR_WEST;
-    if (strcmp(exitName, "up") == 0)    return DIR_UP;
-    if (strcmp(exitName, "down") == 0)  return DIR_DOWN;
+    size_t len = strlen(exitName);
+    if (len == 0) {
+        return -1;
+    }
+    for (int i = 0; i < DIR_COUNT; i++) {
+        if (strncmp(exitName, g_dirNames[i], len) == 0) {
+            return i;
+        }
+    }
     return -1;
 }
 
+/* Damage for n blows at once, lane i striking with attack[i]: each in
+ * [attack / 2, attack], drawn exactly as randomInRange would draw it.
+ * Lanes whose hp[i] is 0 or less strike nothing (hp may be NULL).
+ * Random bits are drawn in lane order; turning them into damage is a
+ * branch-free pass over the arrays that the compiler vectorizes, and the
+ * rare draw that Lemire's method rejects is redone afterwards. */
+void rollDamage(Rng *rng, int n, const int *attack, const int *hp, int *damage) {
+    uint32_t bits[ROLL_BLOCK];
+    uint32_t strikes[ROLL_BLOCK];   /* all ones or zero */
+    for (int base = 0; base < n; base += ROLL_BLOCK) {
+        int count = n - base < ROLL_BLOCK ? n - base : ROLL_BLOCK;
+        const int *a = attack + base;
+        int *d = damage + base;
+        for (int i = 0; i < count; i++) {
+            strikes[i] = !hp || hp[base + i] > 0 ? ~0u : 0;
+            bits[i] = strikes[i] ? (uint32_t)(rngNext(rng) >> 32) : 0;
+        }
+        uint32_t suspect = 0;
+        for (int i = 0; i < count; i++) {
+            uint32_t min = (uint32_t)(a[i] / 2);
+            uint32_t range = (uint32_t)a[i] - min + 1;
+            uint64_t m = (uint64_t)bits[i] * range;
+            d[i] = (int)((min + (uint32_t)(m >> 32)) & strikes[i]);
+            suspect |= ((uint32_t)m < range ? ~0u : 0) & strikes[i];
+        }
+        if (!suspect) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            uint32_t min = (uint32_t)(a[i] / 2);
+            uint32_t range = (uint32_t)a[i] - min + 1;
+            uint64_t m = (uint64_t)bits[i] * range;
+            if (!strikes[i] || (uint32_t)m >= range) {
+                continue;
+            }
+            uint32_t threshold = -range % range;
+            while ((uint32_t)m < threshold) {
+                m = (uint64_t)(uint32_t)(rngNext(rng) >> 32) * range;
+            }
+            d[i] = (int)(min + (uint32_t)(m >> 32));
+        }
+    }
+}
+
+/* One exchange of blows in each of n fights: the player strikes first
+ * and the monster, if it is still standing, strikes back. `dealt` and
+ * `taken` get the damage done (0 for a blow not struck). The game plays
+ * one fight at a time through this; the simulator plays thousands. */
+void combatRound(Rng *rng, int n, const int *playerAttack, int *playerHp,
+                 const int *monsterAttack, int *monsterHp, int *dealt, int *taken) {
+    rollDamage(rng, n, playerAttack, NULL, dealt);
+    for (int i = 0; i < n; i++) {
+        monsterHp[i] -= dealt[i];
+    }
+    rollDamage(rng, n, monsterAttack, monsterHp, taken);
+    for (int i = 0; i < n; i++) {
+        playerHp[i] -= taken[i];
+    }
+}
+
 /* Simple monster combat logic */
-void combatWithMonster(Monster *monster) {
+void combatWithMonster(Session *s, Monster *monster) {
+    Player *p = &s->player;
+
     if (monster->state == MONSTER_DEAD) {
-        printf("The monster is already dead.\n");
+        sessPrintf(s, "The monster is already dead.\n");
         return;
     }
     
-    /* Player attacks first */
-    int playerDamage = randomInRange(g_player.attackPower / 2, g_player.attackPower);
-    monster->hp -= playerDamage;
-    printf("You deal %d damage to the %s!\n", playerDamage, monster->name);
+    int playerDamage, monsterDamage;
+    combatRound(&s->rng, 1, &p->attackPower, &p->hp,
+                &monster->attackPower, &monster->hp, &playerDamage, &monsterDamage);
+    sessPrintf(s, "You deal %d damage to the %s!\n", playerDamage, monster->name);
     
     if (monster->hp <= 0) {
         monster->hp = 0;
         monster->state = MONSTER_DEAD;
+        metricsCount(METRIC_KILLS);
         return;
     }
     
-    /* Monster attacks back if not dead */
-    int monsterDamage = randomInRange(monster->attackPower / 2, monster->attackPower);
-    g_player.hp -= monsterDamage;
-    printf("The %s hits you for %d damage!\n", monster->name, monsterDamage);
+    sessPrintf(s, "The %s hits you for %d damage!\n", monster->name, monsterDamage);
+}
+
+/* Hurt badly enough to run rather than fight */
+static int monsterFleeing(const Monster *m) {
+    return m->hp * 100 < m->maxHp * MONSTER_FLEE_HP;
+}
+
+/* Hostile monsters in the character's room notice it: unless they are
+ * already acting against it, they strike after MONSTER_AGGRO_TICKS. Idle
+ * monsters leave it alone until provoked. */
+void monsterAIArm(Session *s) {
+    if (s->aiTimer || s->player.hp <= 0) {
+        return;
+    }
+    int room = getRoom(s->player.currentRoom)->id;
+    for (const Monster *m = firstMonster(room); m; m = nextMonster(m)) {
+        if (m->state == MONSTER_AGGRESSIVE) {
+            s->aiTimer = timerSchedule(TIMER_MONSTER_AI, 0, s, MONSTER_AGGRO_TICKS);
+            return;
+        }
+    }
+}
+
+/* TIMER: every hostile monster in the character's room acts: a badly hurt
+ * one flees through a random exit and calms down, the others strike. The
+ * text goes out as a notice. Returns 1 to stay armed, while any of them
+ * is still there and the character still alive. */
+int monstersAct(Session *s) {
+    static __thread ByteBuf text;
+    Player *p = &s->player;
+    int room = p->currentRoom;
+    Region *r = regionOf(room);
+    text.len = 0;
+    int hostile = 0, fled = 0;
+    for (Monster *m = firstMonster(room), *next; m && p->hp > 0; m = next) {
+        next = nextMonster(m);
+        if (m->state != MONSTER_AGGRESSIVE) {
+            continue;
+        }
+        if (monsterFleeing(m)) {
+            /* Only into rooms of this region: their monsters are ours */
+            int exits[DIR_COUNT], count = 0;
+            for (int d = 0; d < DIR_COUNT; d++) {
+                int to = roomExit(room, d);
+                if (to >= 0 && regionOf(to) == r) {
+                    exits[count++] = d;
+                }
+            }
+            if (count > 0) {
+                int d = exits[randomInRange(&r->rng, 0, count - 1)];
+                int to = getRoom(roomExit(room, d))->id;
+                if (moveRoomMonster(m, to)) {
+                    m->state = MONSTER_IDLE;
+                    journalRoomMonsters(to);
+                    bufPrintf(&text, "The %s flees %s!\n", m->name, g_dirNames[d]);
+                    fled++;
+                    continue;
+                }
+            }
+            /* Cornered: it fights on */
+        }
+        int damage;
+        rollDamage(&s->rng, 1, &m->attackPower, NULL, &damage);
+        p->hp -= damage;
+        bufPrintf(&text, "The %s attacks you for %d damage!\n", m->name, damage);
+        hostile++;
+    }
+    if (text.len == 0) {
+        s->aiTimer = 0;
+        return 0;
+    }
+    if (fled) {
+        journalRoomMonsters(room);
+    }
+    journalPlayer(s);
+    int died = p->hp <= 0;
+    if (died) {
+        bufPrintf(&text, "You have died. Game Over.\n");
+    }
+    sessionNotify(s, (const char *)text.data, text.len, died);
+    if (died || hostile == 0) {
+        s->aiTimer = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* The monster the character was fighting chases it into its new room,
+ * unless it is running away itself. It gives up at the region's edge:
+ * monster pools are per region, and the next region may be running on
+ * another worker. Returns 1 if it followed. */
+int monsterPursue(Session *s, int from) {
+    Monster *m = monsterFromRef(from, s->target);
+    int to = s->player.currentRoom;
+    if (!m || m->state != MONSTER_AGGRESSIVE || monsterFleeing(m) ||
+        regionOf(to) != regionOf(from)) {
+        return 0;
+    }
+    getRoom(to);
+    if (!moveRoomMonster(m, to)) {
+        return 0;
+    }
+    journalRoomMonsters(from);
+    journalRoomMonsters(to);
+    return 1;
+}
+
+/* Reward a player for killing a monster of `level`. Reports the gold and
+ * exp paid; returns 1 if the player went up a level. */
+int awardKill(Rng *rng, Player *p, int level, int *gold, int *exp) {
+    *gold = randomInRange(rng, 5, 20) * level;
+    *exp = 5 * level;
+    p->gold += *gold;
+    p->exp += *exp;
+    if (p->exp >= p->expToNextLevel) {
+        levelUp(p);
+        return 1;
+    }
+    return 0;
 }
 
 /* Level up logic */
@@ -828,28 +9839,99 @@ void levelUp(Player *p) {
     p->hp = p->maxHp;
     p->mp = p->maxMp;
     p->attackPower += 2;
-    printf("Congratulations! You are now level %d!\n", p->level);
 }
 
-/* Spawn a random monster in a room */
-void spawnMonster(Room *room) {
-    room->monsterPresent = 1;
-    strcpy(room->monster.name, "Goblin");
-    room->monster.level = randomInRange(1, 3);
-    room->monster.maxHp = 10 + 5 * room->monster.level;
-    room->monster.hp = room->monster.maxHp;
-    room->monster.attackPower = 3 + 2 * room->monster.level;
-    room->monster.state = MONSTER_AGGRESSIVE;
+/* Level of a newly spawned monster */
+int spawnLevel(Rng *rng) {
+    return randomInRange(rng, 1, MONSTER_MAX_LEVEL);
+}
+
+/* How many monsters a room starts with, when it has any */
+int spawnPackSize(Rng *rng) {
+    int roll = randomInRange(rng, 1, 10);
+    return roll <= 6 ? 1 : roll <= 9 ? 2 : 3;
+}
+
+/* Fill in a monster of the given level */
+void makeMonster(Monster *m, int level) {
+    m->name = "Goblin";
+    m->level = level;
+    m->maxHp = 10 + 5 * m->level;
+    m->hp = m->maxHp;
+    m->attackPower = 3 + 2 * m->level;
+    m->state = MONSTER_AGGRESSIVE;
+}
+
+/* Spawn a random monster in a room. Returns it, or NULL if the room or
+ * its region's monster pool is full. */
+Monster *spawnMonster(int room) {
+    Monster m;
+    makeMonster(&m, spawnLevel(&regionOf(room)->rng));
+    Monster *added = addRoomMonster(room, &m);
+    if (added) {
+        metricsCount(METRIC_SPAWNS);
+    }
+    return added;
+}
+
+/* Seed a generator for one stream of the world seed (a region number or
+ * a player key). SplitMix64 spreads the pair over the full state. */
+void rngSeed(Rng *rng, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed ^ (stream * 0xd1342543de82ef95ull);
+    for (int i = 0; i < 4; i++) {
+        x += 0x9e3779b97f4a7c15ull;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Next 64 random bits */
+uint64_t rngNext(Rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
 }
 
-/* Return random integer in [min, max] */
-int randomInRange(int min, int max) {
+/* Return random integer in [min, max], without the bias of `% range`
+ * (Lemire's multiply-and-reject) */
+int randomInRange(Rng *rng, int min, int max) {
     if (max < min) {
         int temp = max;
         max = min;
         min = temp;
     }
-    return (rand() % (max - min + 1)) + min;
+    uint32_t range = (uint32_t)max - (uint32_t)min + 1;
+    if (range == 0) {
+        return (int)(uint32_t)rngNext(rng); /* the whole int range */
+    }
+    uint64_t m = (uint64_t)(uint32_t)(rngNext(rng) >> 32) * range;
+    if ((uint32_t)m < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t)m < threshold) {
+            m = (uint64_t)(uint32_t)(rngNext(rng) >> 32) * range;
+        }
+    }
+    return (int)((uint32_t)min + (uint32_t)(m >> 32));
+}
+
+/* Monotonic time in nanoseconds */
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
 /* Clear stdin buffer (optional) */